@@ -0,0 +1,25 @@
+// Instruction pairs the decoder fuses: a flag setter followed by b.cond,
+// and movz followed by stur. Results must not depend on the fusion.
+.text
+mov X1, 0x1000
+lsl X1, X1, 16          // X1 = 0x10000000
+movz X2, 6
+
+loop:
+movz X3, 0x55
+stur X3, [X1, 0x0]      // movz + stur
+add X1, X1, 8
+movz X4, 3
+subs X2, X2, 1          // subs + b.ne, right after a movz that does not fuse
+bne loop
+
+cmp X4, 3
+beq skip                // cmp + b.eq, taken
+movz X5, 1
+skip:
+adds X6, X4, 2
+blt done                // adds + b.lt, not taken
+movz X7, 9
+stur X7, [X1, 0x0]
+done:
+HLT 0
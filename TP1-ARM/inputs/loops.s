@@ -0,0 +1,34 @@
+// Counted loops: subs Xc, Xc, 1 closing a single block with b.ne.
+// Results must be the same whether they are run ahead or interpreted.
+.text
+movz X1, 1000
+loop1:                  // closed form: every write steps by a constant
+add X2, X2, 3
+add X3, X3, 5
+subs X1, X1, 1
+bne loop1
+
+movz X1, 500
+loop2:                  // tight pass: X4 depends on X2
+add X2, X2, 1
+eor X4, X4, X2
+subs X1, X1, 1
+bne loop2
+
+mov X5, 0x1000
+lsl X5, X5, 16          // X5 = 0x10000000
+movz X1, 20
+loop3:                  // stores whose base steps by a constant
+stur X2, [X5, 0x0]
+add X5, X5, 8
+add X2, X2, 7
+subs X1, X1, 1
+bne loop3
+
+movz X1, 10
+movz X6, 4
+loop4:                  // tst writes X31, which the simulator keeps like any register
+tst X6, X6
+subs X1, X1, 1
+bne loop4
+HLT 0
@@ -0,0 +1,34 @@
+// Self-modifying code: the program patches instructions it has already run,
+// with stur, and runs them again. The second pass must see the new code, also
+// when the patched instruction is the second half of a fused pair (subs + b.ne).
+// X0 = 0x2a at the end.
+.text
+movz X9, 0x40
+lsl X9, X9, 16          // X9 = 0x400000, the start of the text
+movz X8, 2              // two passes
+
+again:
+movz X0, 7              // patched to movz X0, 0x29
+subs X7, X0, 7
+bne done                // patched to add X0, X0, 1
+
+// movz X0, 7 ^ movz X0, 0x29 = 0x5c0, into the instruction at 12
+ldur X5, [X9, 12]
+movz X3, 0x5c0
+eor X5, X5, X3
+stur X5, [X9, 12]
+
+// bne done ^ add X0, X0, 1 = 0xc50005c1, into the instruction at 20
+ldur X5, [X9, 20]
+movz X3, 0xc500
+lsl X3, X3, 16
+movz X4, 0x05c1
+orr X3, X3, X4
+eor X5, X5, X3
+stur X5, [X9, 20]
+
+subs X8, X8, 1
+bne again
+
+done:
+HLT 0
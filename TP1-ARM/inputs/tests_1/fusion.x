@@ -0,0 +1,17 @@
+d2820001 
+d370bc21 
+d28000c2 
+d2800aa3 
+f8000023 
+91002021 
+d2800064 
+f1000442 
+54ffff61 
+f1000c9f 
+54000040 
+d2800025 
+b1000886 
+5400006b 
+d2800127 
+f8000027 
+d4400000 
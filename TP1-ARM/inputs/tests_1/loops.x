@@ -0,0 +1,24 @@
+d2807d01 
+91000c42 
+91001463 
+f1000421 
+54ffffa1 
+d2803e81 
+91000442 
+ca020084 
+f1000421 
+54ffffa1 
+d2820005 
+d370bca5 
+d2800281 
+f80000a2 
+910020a5 
+91001c42 
+f1000421 
+54ffff81 
+d2800141 
+d2800086 
+ea0600df 
+f1000421 
+54ffffc1 
+d4400000 
@@ -0,0 +1,20 @@
+d2800809 
+d370bd29 
+d2800048 
+d28000e0 
+f1001c07 
+540001c1 
+f840c125 
+d280b803 
+ca0300a5 
+f800c125 
+f8414125 
+d298a003 
+d370bc63 
+d280b824 
+aa040063 
+ca0300a5 
+f8014125 
+f1000508 
+54fffe21 
+d4400000 
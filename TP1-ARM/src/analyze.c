@@ -0,0 +1,415 @@
+#include "analyze.h"
+#include "cfg.h"
+#include "decode.h"
+#include "shell.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Static throughput analyzer, in the spirit of llvm-mca.
+//
+// The program is loaded but not run; its basic blocks come from the load-time
+// CFG (cfg.c). Natural loops are found from the back edges of the dominator
+// tree. For each loop body (all of its blocks, as
+// if every one ran on each iteration) three bounds are computed:
+//
+//   resource bound    busiest port; an instruction that can use several ports
+//                     puts an equal share on each of them
+//   dependency bound  growth per iteration of the longest register/flag
+//                     dependency chain, found by running the dataflow over many
+//                     iterations (dependencies through memory are ignored)
+//   issue bound       instructions / issue width
+//
+// The prediction is the largest of the three. Latencies and ports come from a
+// table that can be replaced with --latency-table.
+
+#define MAX_PORTS   16
+
+#define STEADY_ITERATIONS 32
+
+typedef struct {
+    int latency;
+    uint32_t ports;         // bit mask of the ports that can execute it
+} ClassInfo;
+
+typedef struct {
+    ClassInfo classes[NUM_CLASSES];
+    int width;
+    int num_ports;
+} Machine;
+
+static const char* const class_names[NUM_CLASSES] = { "alu", "mul", "load", "store", "branch" };
+
+// A generic 4-wide out-of-order core: 3 ALUs (one with the multiplier),
+// 2 load ports, 1 store port and a branch unit
+static const Machine default_machine = {
+    .classes = {
+        [CLASS_ALU]    = { 1, 0x07 },
+        [CLASS_MUL]    = { 3, 0x04 },
+        [CLASS_LOAD]   = { 4, 0x18 },
+        [CLASS_STORE]  = { 1, 0x20 },
+        [CLASS_BRANCH] = { 1, 0x40 },
+    },
+    .width = 4,
+    .num_ports = 7,
+};
+
+// A fused slot (see fuse_pair() in decode.c) stands for its first
+// instruction; the partner has its own slot
+static InstructionType unfused_type(const DecodedInstruction* d) {
+    if (d->type == FUSED_ALU_BCOND || d->type == FUSED_MOVZ_STUR) return d->op;
+    return d->type;
+}
+
+InsnClass insn_class(const DecodedInstruction* d) {
+    switch (unfused_type(d)) {
+        case MUL: return CLASS_MUL;
+        case LDUR: case LDURB: case LDURH: return CLASS_LOAD;
+        case LDXR: case LDADD: case SWP: case CAS: return CLASS_LOAD;
+        case STUR: case STURB: case STURH: case STXR: return CLASS_STORE;
+        case B: case BR: case BEQ: case BNE: case BGT: case BLT: case BGE: case BLE:
+        case CBZ: case CBNZ: case HLT:
+            return CLASS_BRANCH;
+        default: return CLASS_ALU;
+    }
+}
+
+int insn_operands(const DecodedInstruction* d, int* srcs, int* dst, int* sets_flags) {
+    int n = 0;
+    *dst = -1;
+    *sets_flags = 0;
+
+    switch (unfused_type(d)) {
+        case ADDS_REG: case SUBS_REG: case ANDS_REG:
+            *sets_flags = 1;
+            /* fall through */
+        case ADD_REG: case EOR_REG: case ORR_REG: case MUL:
+            srcs[n++] = d->rn;
+            srcs[n++] = d->rm;
+            *dst = d->rd;
+            break;
+        case ADDS_IMM: case SUBS_IMM:
+            *sets_flags = 1;
+            /* fall through */
+        case ADD_IMM: case LSL_IMM: case LSR_IMM:
+        case LDUR: case LDURB: case LDURH: case LDXR:
+            srcs[n++] = d->rn;
+            *dst = d->rd;
+            break;
+        case LDADD: case SWP:
+            srcs[n++] = d->rn;
+            srcs[n++] = d->rm;
+            *dst = d->rd;
+            break;
+        case STXR:
+            srcs[n++] = d->rn;
+            srcs[n++] = d->rd;
+            *dst = d->rm;
+            break;
+        case CAS:
+            srcs[n++] = d->rn;
+            srcs[n++] = d->rm;
+            srcs[n++] = d->rd;
+            *dst = d->rm;
+            break;
+        case CMP_REG:
+            srcs[n++] = d->rm;
+            /* fall through */
+        case CMP_IMM:
+            srcs[n++] = d->rn;
+            *sets_flags = 1;
+            break;
+        case MOVZ:
+            *dst = d->rd;
+            break;
+        case STUR: case STURB: case STURH:
+            srcs[n++] = d->rn;
+            srcs[n++] = d->rd;
+            break;
+        case BEQ: case BNE: case BGT: case BLT: case BGE: case BLE:
+            srcs[n++] = REG_FLAGS;
+            break;
+        case CBZ: case CBNZ:
+            srcs[n++] = d->rd;
+            break;
+        case BR:
+            srcs[n++] = d->rn;
+            break;
+        default:
+            break;
+    }
+    // Drop XZR
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        if (srcs[i] != 31) srcs[k++] = srcs[i];
+    }
+    if (*dst == 31) *dst = -1;
+    return k;
+}
+
+int class_latency(InsnClass c) {
+    return default_machine.classes[c].latency;
+}
+
+/***************************************************************/
+/* Machine description                                         */
+/***************************************************************/
+
+// Lines: "<class> <latency> <port>[,<port>...]" or "width <n>"; # comments
+static int load_machine(const char* path, Machine* m) {
+    char line[256];
+    int lineno = 0;
+    FILE* f = fopen(path, "r");
+
+    if (f == NULL) {
+        printf("Error: Can't open latency table %s\n", path);
+        return -1;
+    }
+    *m = default_machine;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char name[32], ports[128];
+        int latency, k;
+
+        lineno++;
+        char* hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        if (sscanf(line, "%31s", name) != 1) continue;
+
+        if (strcmp(name, "width") == 0) {
+            if (sscanf(line, "%*s %d", &m->width) == 1 && m->width > 0) continue;
+        } else if (sscanf(line, "%*s %d %127s", &latency, ports) == 2 && latency >= 0) {
+            for (k = 0; k < NUM_CLASSES && strcmp(name, class_names[k]) != 0; k++);
+            uint32_t mask = 0;
+            char* save;
+            for (char* p = strtok_r(ports, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+                int port = atoi(p);
+                if (port < 0 || port >= MAX_PORTS) mask = 0;
+                else mask |= 1u << port;
+                if (port + 1 > m->num_ports) m->num_ports = port + 1;
+            }
+            if (k < NUM_CLASSES && mask != 0) {
+                m->classes[k].latency = latency;
+                m->classes[k].ports = mask;
+                continue;
+            }
+        }
+        printf("Error: %s:%d: expected '<class> <latency> <ports>' or 'width <n>'\n", path, lineno);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+/***************************************************************/
+/* Loops                                                       */
+/***************************************************************/
+
+typedef uint64_t* BitSet;
+
+#define BIT_TEST(s, i) (((s)[(i) / 64] >> ((i) % 64)) & 1)
+#define BIT_SET(s, i)  ((s)[(i) / 64] |= (uint64_t)1 << ((i) % 64))
+
+// True if block P has an edge to block B
+static int edge(const Cfg* cfg, int p, int b) {
+    return cfg->succ[2 * p] == b || cfg->succ[2 * p + 1] == b;
+}
+
+// dom[b]: blocks that dominate b (iterative data-flow)
+static BitSet* dominators(const Cfg* cfg, int words) {
+    int n = cfg->nblocks;
+    BitSet* dom = malloc(n * sizeof(BitSet));
+    BitSet tmp = malloc(words * sizeof(uint64_t));
+
+    for (int b = 0; b < n; b++) {
+        dom[b] = malloc(words * sizeof(uint64_t));
+        memset(dom[b], b == 0 ? 0 : 0xFF, words * sizeof(uint64_t));
+    }
+    BIT_SET(dom[0], 0);
+
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (int b = 1; b < n; b++) {
+            int any = 0;
+            memset(tmp, 0xFF, words * sizeof(uint64_t));
+            for (int p = 0; p < n; p++) {
+                if (!edge(cfg, p, b)) continue;
+                for (int w = 0; w < words; w++) tmp[w] &= dom[p][w];
+                any = 1;
+            }
+            if (!any) continue;     // entry-less block: leave it dominated by everything
+            BIT_SET(tmp, b);
+            if (memcmp(tmp, dom[b], words * sizeof(uint64_t)) != 0) {
+                memcpy(dom[b], tmp, words * sizeof(uint64_t));
+                changed = 1;
+            }
+        }
+    }
+    free(tmp);
+    return dom;
+}
+
+static char* reachable(const Cfg* cfg) {
+    char* seen = calloc(cfg->nblocks + 1, 1);
+    int* stack = malloc((cfg->nblocks + 1) * sizeof(int));
+    int top = 0;
+
+    if (cfg->nblocks > 0) {
+        seen[0] = 1;
+        stack[top++] = 0;
+    }
+    while (top > 0) {
+        int b = stack[--top];
+        for (int s = 0; s < 2; s++) {
+            int t = cfg->succ[2 * b + s];
+            if (t != CFG_NONE && !seen[t]) {
+                seen[t] = 1;
+                stack[top++] = t;
+            }
+        }
+    }
+    free(stack);
+    return seen;
+}
+
+// Adds to BODY every reachable block that reaches TAIL without going through HEADER
+static void loop_body(const Cfg* cfg, const char* reach, int header, int tail, BitSet body) {
+    int* stack = malloc(cfg->nblocks * sizeof(int));
+    int top = 0;
+
+    BIT_SET(body, header);
+    if (!BIT_TEST(body, tail)) {
+        BIT_SET(body, tail);
+        stack[top++] = tail;
+    }
+    while (top > 0) {
+        int b = stack[--top];
+        for (int p = 0; p < cfg->nblocks; p++) {
+            if (edge(cfg, p, b) && reach[p] && !BIT_TEST(body, p)) {
+                BIT_SET(body, p);
+                stack[top++] = p;
+            }
+        }
+    }
+    free(stack);
+}
+
+/***************************************************************/
+/* Throughput                                                  */
+/***************************************************************/
+
+static void analyze_loop(const Cfg* cfg, const Machine* m, int number, int header, BitSet body) {
+    double pressure[MAX_PORTS] = { 0 };
+    double ready[NUM_DEPS] = { 0 };
+    double prev_max = 0, half_max = 0;
+    int ninsns = 0, nblocks = 0;
+
+    for (int b = 0; b < cfg->nblocks; b++) {
+        if (!BIT_TEST(body, b)) continue;
+        nblocks++;
+        for (int i = cfg->first[b]; i < cfg->first[b + 1]; i++) {
+            const ClassInfo* c = &m->classes[insn_class(cfg_insn(i))];
+            double share = 1.0 / __builtin_popcount(c->ports);
+            for (int p = 0; p < m->num_ports; p++) {
+                if (c->ports & (1u << p)) pressure[p] += share;
+            }
+            ninsns++;
+        }
+    }
+
+    // Dependency bound: steady-state growth of the latest result
+    for (int iter = 1; iter <= STEADY_ITERATIONS; iter++) {
+        for (int b = 0; b < cfg->nblocks; b++) {
+            if (!BIT_TEST(body, b)) continue;
+            for (int i = cfg->first[b]; i < cfg->first[b + 1]; i++) {
+                const DecodedInstruction* d = cfg_insn(i);
+                int srcs[3], dst, sets_flags;
+                int nsrc = insn_operands(d, srcs, &dst, &sets_flags);
+                double start = 0;
+                for (int k = 0; k < nsrc; k++) {
+                    if (ready[srcs[k]] > start) start = ready[srcs[k]];
+                }
+                double done = start + m->classes[insn_class(d)].latency;
+                if (dst >= 0) ready[dst] = done;
+                if (sets_flags) ready[REG_FLAGS] = done;
+            }
+        }
+        prev_max = 0;
+        for (int r = 0; r < NUM_DEPS; r++) {
+            if (ready[r] > prev_max) prev_max = ready[r];
+        }
+        if (iter == STEADY_ITERATIONS / 2) half_max = prev_max;
+    }
+    double dep_bound = (prev_max - half_max) / (STEADY_ITERATIONS / 2);
+
+    int busiest = 0;
+    for (int p = 1; p < m->num_ports; p++) {
+        if (pressure[p] > pressure[busiest]) busiest = p;
+    }
+    double res_bound = pressure[busiest];
+    double issue_bound = (double)ninsns / m->width;
+
+    double predicted = res_bound;
+    const char* bottleneck = "resources";
+    if (dep_bound > predicted) {
+        predicted = dep_bound;
+        bottleneck = "dependency chain";
+    }
+    if (issue_bound > predicted) {
+        predicted = issue_bound;
+        bottleneck = "issue width";
+    }
+
+    printf("Loop %d: header 0x%" PRIx64 ", %d blocks, %d instructions\n",
+           number, cfg->base + 4 * (uint64_t)cfg->first[header], nblocks, ninsns);
+    printf("  Resource bound   : %6.2f cycles/iter (port %d)\n", res_bound, busiest);
+    printf("  Dependency bound : %6.2f cycles/iter\n", dep_bound);
+    printf("  Issue bound      : %6.2f cycles/iter (width %d)\n", issue_bound, m->width);
+    printf("  Predicted        : %6.2f cycles/iter, IPC %.2f (%s)\n",
+           predicted, predicted > 0 ? ninsns / predicted : 0.0, bottleneck);
+    printf("  Port pressure    :");
+    for (int p = 0; p < m->num_ports; p++) printf(" %d:%.2f", p, pressure[p]);
+    printf("\n\n");
+}
+
+int analyze_main(const char* program_filename, const char* latency_table) {
+    const Cfg* cfg = &PROGRAM_CFG;
+    Machine machine = default_machine;
+    int loops = 0;
+
+    VERBOSE = FALSE;
+    if (latency_table != NULL && load_machine(latency_table, &machine) < 0) return 2;
+
+    // Loading the program builds its CFG
+    initialize((char**)&program_filename, 1);
+
+    printf("%s: %d instructions, %d basic blocks\n\n", program_filename, cfg->ninsns, cfg->nblocks);
+    if (cfg->nblocks == 0) {
+        printf("No loops found\n");
+        return 0;
+    }
+    int words = (cfg->nblocks + 63) / 64;
+    BitSet* dom = dominators(cfg, words);
+    char* reach = reachable(cfg);
+
+    // One loop per header, merging all of its back edges
+    for (int h = 0; h < cfg->nblocks; h++) {
+        BitSet body = calloc(words, sizeof(uint64_t));
+        int found = 0;
+        for (int b = 0; b < cfg->nblocks; b++) {
+            if (reach[b] && edge(cfg, b, h) && BIT_TEST(dom[b], h)) {
+                loop_body(cfg, reach, h, b, body);
+                found = 1;
+            }
+        }
+        if (found) analyze_loop(cfg, &machine, ++loops, h, body);
+        free(body);
+    }
+    if (loops == 0) printf("No loops found\n");
+
+    for (int b = 0; b < cfg->nblocks; b++) free(dom[b]);
+    free(dom);
+    free(reach);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+#include "decode.h"
+
+// Static throughput analysis of a program's loops (--analyze).
+// LATENCY_TABLE may be NULL for the built-in machine description.
+int analyze_main(const char* program_filename, const char* latency_table);
+
+#define NUM_CLASSES 5
+#define REG_FLAGS   32      // N/Z flags, tracked like a register
+#define NUM_DEPS    33
+
+typedef enum { CLASS_ALU, CLASS_MUL, CLASS_LOAD, CLASS_STORE, CLASS_BRANCH } InsnClass;
+
+InsnClass insn_class(const DecodedInstruction* d);
+
+// Registers read (into SRCS, returns how many) and written (XZR is not a
+// dependency). Also used by the timing model of sample.c.
+int insn_operands(const DecodedInstruction* d, int* srcs, int* dst, int* sets_flags);
+
+// Latency of the class on the built-in machine
+int class_latency(InsnClass c);
+
+#endif
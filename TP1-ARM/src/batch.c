@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include "batch.h"
+#include "coherence.h"
+#include "hostprof.h"
+#include "memprof.h"
+#include "mmu.h"
+#include "roi.h"
+#include "shell.h"
+#include "smp.h"
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Non-interactive execution mode.
+// The whole report is built in memory and emitted with a single write so that
+// scripts running thousands of simulations only pay one syscall per run and
+// never see interleaved partial output.
+
+static void dump_text(FILE* out, const SimOptions* opts) {
+    if (opts->dump_regs && SMP_NCORES > 0)
+        smp_rdump_to(out);
+    else if (opts->dump_regs)
+        rdump_to(out);
+    for (int i = 0; i < opts->num_mem_ranges; i++)
+        mdump_to(out, opts->mem_ranges[i].start, opts->mem_ranges[i].stop);
+    for (int i = 0; opts->dump_mmu && i < (SMP_NCORES > 0 ? SMP_NCORES : 1); i++) {
+        if (SMP_NCORES > 0) {
+            smp_select(i);
+            fprintf(out, "\nCore %d:", i);
+        }
+        mmu_report_text(out);
+    }
+    if (opts->coherence)
+        coh_report_text(out);
+    if (opts->mem_profile)
+        memprof_report_text(out);
+    if (opts->host_profile)
+        hostprof_report_text(out);
+    if (opts->roi)
+        roi_report_text(out);
+}
+
+// 64-bit values are written as hex strings: JSON numbers are doubles
+static void dump_json_core(FILE* out, const SimOptions* opts) {
+    fprintf(out, "\"instructions\":%u,\"halted\":%s,\"pc\":\"0x%" PRIx64 "\"",
+            INSTRUCTION_COUNT, RUN_BIT ? "false" : "true", CURRENT_STATE.PC);
+
+    if (opts->dump_regs) {
+        fprintf(out, ",\"regs\":{");
+        for (int k = 0; k < ARM_REGS; k++)
+            fprintf(out, "%s\"X%d\":\"0x%" PRIx64 "\"", k ? "," : "", k, CURRENT_STATE.REGS[k]);
+        fprintf(out, "},\"flags\":{\"N\":%d,\"Z\":%d}", CURRENT_STATE.FLAG_N, CURRENT_STATE.FLAG_Z);
+    }
+    if (opts->dump_mmu) {
+        fprintf(out, ",\"mmu\":");
+        mmu_report_json(out);
+    }
+}
+
+// Multi-core runs report {"cores":[...],"mem":[...]}
+static void dump_json(FILE* out, const SimOptions* opts) {
+    fprintf(out, "{");
+    if (SMP_NCORES > 0) {
+        fprintf(out, "\"cores\":[");
+        for (int i = 0; i < SMP_NCORES; i++) {
+            smp_select(i);
+            fprintf(out, "%s{", i ? "," : "");
+            dump_json_core(out, opts);
+            fprintf(out, "}");
+        }
+        fprintf(out, "]");
+    } else {
+        dump_json_core(out, opts);
+    }
+
+    if (opts->num_mem_ranges > 0) {
+        fprintf(out, ",\"mem\":[");
+        for (int i = 0; i < opts->num_mem_ranges; i++) {
+            const MemRange* r = &opts->mem_ranges[i];
+            fprintf(out, "%s{\"start\":\"0x%" PRIx64 "\",\"stop\":\"0x%" PRIx64 "\",\"words\":[",
+                    i ? "," : "", r->start, r->stop);
+            for (uint64_t a = r->start; a <= r->stop; a += 4) {
+                fprintf(out, "%s\"0x%x\"", a == r->start ? "" : ",", mem_read_32(a));
+                if (r->stop - a < 4) break;     // the next address would wrap
+            }
+            fprintf(out, "]}");
+        }
+        fprintf(out, "]");
+    }
+    if (opts->coherence) {
+        fprintf(out, ",\"coherence\":");
+        coh_report_json(out);
+    }
+    if (opts->mem_profile) {
+        fprintf(out, ",\"mem_profile\":");
+        memprof_report_json(out);
+    }
+    if (opts->host_profile) {
+        fprintf(out, ",\"host_profile\":");
+        hostprof_report_json(out);
+    }
+    if (opts->roi) {
+        fprintf(out, ",\"roi\":");
+        roi_report_json(out);
+    }
+    fprintf(out, "}\n");
+}
+
+void batch_run(long long max_insns) {
+    if (max_insns >= 0 && max_insns < INT_MAX - INSTRUCTION_COUNT)
+        INSTRUCTION_LIMIT = INSTRUCTION_COUNT + max_insns;
+
+    while (RUN_BIT && INSTRUCTION_COUNT < INSTRUCTION_LIMIT)
+        cycle();
+    INSTRUCTION_LIMIT = INT_MAX;
+}
+
+void batch_report(FILE* out, const SimOptions* opts) {
+    SimOptions o = *opts;
+
+    // With no --dump at all, report the registers like "go; rdump" would
+    if (!o.dump_regs && !o.dump_mmu && o.num_mem_ranges == 0)
+        o.dump_regs = 1;
+
+    if (o.json) dump_json(out, &o);
+    else dump_text(out, &o);
+}
+
+int batch_main(const SimOptions* opts) {
+    char* buf = NULL;
+    size_t len = 0;
+    SimOptions o = *opts;
+
+    VERBOSE = FALSE;
+    initialize(o.programs, o.num_programs);
+    if (o.coherence)
+        coh_init(o.coherence, o.cores);
+    if (o.mem_profile)
+        memprof_init();
+    if (o.roi)
+        roi_init();
+    if (o.cores > 1) {
+        smp_run(o.cores, o.quantum, o.deterministic, o.max_insns);
+    } else {
+        hostprof_run_begin();
+        batch_run(o.max_insns);
+        hostprof_run_end(NULL);
+    }
+    COHERENCE = 0;      // the dumps don't count
+    MEMPROF = 0;
+    HOSTPROF = 0;
+    if (o.mem_profile_csv != NULL && memprof_write_csv(o.mem_profile_csv) < 0)
+        return 2;
+
+    FILE* out = open_memstream(&buf, &len);
+    batch_report(out, &o);
+    fclose(out);
+
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = write(STDOUT_FILENO, buf + done, len - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    free(buf);
+
+    if (o.dumpsim_path != NULL) {
+        FILE* dumpsim_file = fopen(o.dumpsim_path, "w");
+        if (dumpsim_file == NULL) {
+            fprintf(stderr, "Error: Can't open dumpsim file %s\n", o.dumpsim_path);
+            return 2;
+        }
+        o.json = 0;  // the dumpsim file always uses the shell's text format
+        batch_report(dumpsim_file, &o);
+        fclose(dumpsim_file);
+    }
+
+    // --run-to-halt promises a halted machine; running out of budget is an error
+    int running = RUN_BIT;
+    for (int i = 0; i < SMP_NCORES; i++)
+        running |= SMP_CORES[i].run_bit;
+    return (o.run_to_halt && running) ? 1 : 0;
+}
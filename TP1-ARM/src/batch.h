@@ -0,0 +1,17 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "options.h"
+#include <stdio.h>
+
+// Runs the programs without the interactive shell and writes the requested
+// dumps to stdout in a single write. Returns the process exit status.
+int batch_main(const SimOptions* opts);
+
+// Building blocks shared with the job server: run the loaded program for at
+// most max_insns instructions (-1 = until HLT), then write the dumps
+// selected in opts (registers if none) in the requested format.
+void batch_run(long long max_insns);
+void batch_report(FILE* out, const SimOptions* opts);
+
+#endif
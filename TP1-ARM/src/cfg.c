@@ -0,0 +1,130 @@
+#include "cfg.h"
+#include "shell.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Load-time control-flow graph.
+//
+// The text segment is decoded once, which also fills the decoded-instruction
+// cache, and split into basic blocks: a block starts at the program entry, at
+// every B/B.cond/CBZ/CBNZ target and after every branch or HLT. BR ends a block
+// with unknown successors. Everything is kept in flat arrays indexed by block
+// or instruction number.
+
+Cfg PROGRAM_CFG;
+
+int cfg_ends_block(const DecodedInstruction* d) {
+    switch (d->type) {
+        case B: case BR: case HLT: case CBZ: case CBNZ:
+        case BEQ: case BNE: case BGT: case BLT: case BGE: case BLE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int has_target(const DecodedInstruction* d) {
+    return cfg_ends_block(d) && d->type != BR && d->type != HLT;
+}
+
+static int falls_through(const DecodedInstruction* d) {
+    return d->type != B && d->type != BR && d->type != HLT;
+}
+
+const DecodedInstruction* cfg_insn(int i) {
+    return decode_slot(PROGRAM_CFG.base + 4 * (uint64_t)i);
+}
+
+// Instruction index of a branch target, or CFG_NONE if it leaves the text
+static int target_index(int from, int64_t offset) {
+    int64_t target = from + offset / 4;
+    if (offset % 4 != 0 || target < 0 || target >= PROGRAM_CFG.ninsns) return CFG_NONE;
+    return (int)target;
+}
+
+static void cfg_free(Cfg* cfg) {
+    free(cfg->first);
+    free(cfg->succ);
+    free(cfg->flags);
+    free(cfg->block_of);
+    memset(cfg, 0, sizeof(*cfg));
+}
+
+void cfg_build(uint64_t base, int ninsns) {
+    Cfg* cfg = &PROGRAM_CFG;
+    int saved_verbose = VERBOSE;
+
+    cfg_free(cfg);
+    cfg->base = base;
+    cfg->ninsns = ninsns;
+    cfg->block_of = malloc((ninsns + 1) * sizeof(int32_t));
+
+    // Decode everything once, without tracing it
+    VERBOSE = FALSE;
+    uint8_t* leader = calloc(ninsns + 1, 1);
+    if (ninsns > 0) leader[0] = 1;
+    for (int i = 0; i < ninsns; i++) {
+        const DecodedInstruction* d = decode_cached(base + 4 * (uint64_t)i, mem_peek_32(base + 4 * (uint64_t)i));
+        if (!cfg_ends_block(d)) continue;
+        leader[i + 1] = 1;
+        int t = has_target(d) ? target_index(i, d->imm) : CFG_NONE;
+        if (t != CFG_NONE) leader[t] = 1;
+    }
+    VERBOSE = saved_verbose;
+
+    for (int i = 0; i < ninsns; i++) cfg->nblocks += leader[i];
+    cfg->first = malloc((cfg->nblocks + 1) * sizeof(int32_t));
+    cfg->succ = malloc(2 * (cfg->nblocks + 1) * sizeof(int32_t));
+    cfg->flags = calloc(cfg->nblocks + 1, 1);
+
+    int b = -1;
+    for (int i = 0; i < ninsns; i++) {
+        if (leader[i]) cfg->first[++b] = i;
+        cfg->block_of[i] = b;
+    }
+    cfg->first[cfg->nblocks] = ninsns;
+
+    for (b = 0; b < cfg->nblocks; b++) {
+        int last = cfg->first[b + 1] - 1;
+        const DecodedInstruction* d = cfg_insn(last);
+
+        cfg->succ[2 * b] = cfg->succ[2 * b + 1] = CFG_NONE;
+        if (has_target(d)) {
+            int t = target_index(last, d->imm);
+            if (t != CFG_NONE) cfg->succ[2 * b] = cfg->block_of[t];
+            else cfg->flags[b] |= CFG_EXTERNAL;
+        }
+        if (falls_through(d) && last + 1 < ninsns) cfg->succ[2 * b + 1] = b + 1;
+        if (d->type == BR) cfg->flags[b] |= CFG_INDIRECT;
+        if (d->type == HLT) cfg->flags[b] |= CFG_HALT;
+    }
+    free(leader);
+}
+
+void cfg_dump_dot(FILE* out) {
+    const Cfg* cfg = &PROGRAM_CFG;
+
+    fprintf(out, "digraph cfg {\n");
+    fprintf(out, "  node [shape=box fontname=monospace];\n");
+    for (int b = 0; b < cfg->nblocks; b++) {
+        fprintf(out, "  b%d [label=\"", b);
+        for (int i = cfg->first[b]; i < cfg->first[b + 1]; i++) {
+            uint64_t address = cfg->base + 4 * (uint64_t)i;
+            fprintf(out, "0x%" PRIx64 ": %s\\l", address, instruction_name(mem_peek_32(address)));
+        }
+        fprintf(out, "\"];\n");
+
+        if (cfg->succ[2 * b] != CFG_NONE)
+            fprintf(out, "  b%d -> b%d [label=\"taken\"];\n", b, cfg->succ[2 * b]);
+        if (cfg->succ[2 * b + 1] != CFG_NONE)
+            fprintf(out, "  b%d -> b%d;\n", b, cfg->succ[2 * b + 1]);
+        if (cfg->flags[b] & CFG_INDIRECT)
+            fprintf(out, "  b%d -> indirect [style=dashed];\n", b);
+        if (cfg->flags[b] & CFG_EXTERNAL)
+            fprintf(out, "  b%d -> external [style=dashed];\n", b);
+        if (cfg->flags[b] & CFG_HALT)
+            fprintf(out, "  b%d -> halt;\n", b);
+    }
+    fprintf(out, "}\n");
+}
@@ -0,0 +1,37 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "decode.h"
+
+// Control-flow graph of the loaded program, built once by load_program()
+
+#define CFG_NONE      (-1)
+
+// Block flags
+#define CFG_INDIRECT  0x1   // ends in BR: successors unknown
+#define CFG_HALT      0x2   // ends in HLT
+#define CFG_EXTERNAL  0x4   // branches outside the loaded text
+
+typedef struct {
+    uint64_t base;          // address of instruction 0
+    int ninsns;
+    int nblocks;
+    int32_t* first;         // first instruction of each block (nblocks + 1 entries)
+    int32_t* succ;          // 2 per block: taken target, fall-through (or CFG_NONE)
+    uint8_t* flags;         // CFG_* per block
+    int32_t* block_of;      // block of each instruction
+} Cfg;
+
+extern Cfg PROGRAM_CFG;
+
+void cfg_build(uint64_t base, int ninsns);
+void cfg_dump_dot(FILE* out);
+
+// Decoded instruction I of the program (from the decoded-instruction cache)
+const DecodedInstruction* cfg_insn(int i);
+
+int cfg_ends_block(const DecodedInstruction* d);
+
+#endif
@@ -0,0 +1,332 @@
+#include "coherence.h"
+#include "smp.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Cache-coherence model, see coherence.h.
+//
+// One bus transaction per miss or upgrade, snooped by every other cache:
+//   BusRd    read miss: a Modified copy is written back (MESI) or becomes the
+//            Owner (MOESI), Exclusive copies become Shared; the line is
+//            filled Exclusive if nobody else has it, else Shared
+//   BusRdX   write miss: every other copy is invalidated
+//   BusUpgr  write hit on a Shared or Owned copy: the same, without data
+// A dirty (M/O) copy that supplies the data is a cache-to-cache transfer.
+// Invalidated lines keep their tag, so the next miss on them counts as a
+// coherence miss instead of a cold or capacity one.
+//
+// False sharing: an invalidation is false sharing when the invalidated core
+// never touched the bytes being written, only other bytes of the same line.
+// Every cached line remembers the bytes its core touched since the fill.
+//
+// All cores share the model behind one lock. Parallel runs interleave in real
+// time, so only --deterministic runs give the same report every time.
+
+enum { I, S, E, O, M };
+
+typedef struct {
+    uint64_t tag;               // line number (address >> COH_LINE_SHIFT)
+    uint8_t state;
+    uint8_t invalidated;        // I because another core wrote the line
+    uint64_t touched;           // bytes accessed since the fill, one bit each
+    uint64_t used;              // LRU stamp
+} CohLine;
+
+typedef struct {
+    uint64_t accesses, hits, misses, coherence_misses;
+    uint64_t bus_rd, bus_rdx, bus_upgr;
+    uint64_t invalidations_sent, invalidations_received, false_sharing;
+    uint64_t writebacks, transfers;
+} CohStats;
+
+// Coherence events of one line
+typedef struct {
+    uint64_t key;               // line number + 1, 0 = free slot
+    uint64_t invalidations, false_sharing, coherence_misses;
+    uint64_t bytes[SMP_MAX_CORES];  // bytes each core had touched, seen at invalidations
+} HotLine;
+
+int COHERENCE;
+
+static pthread_mutex_t coh_lock = PTHREAD_MUTEX_INITIALIZER;
+static int protocol, ncores;
+static CohLine (*caches)[COH_SETS][COH_WAYS];
+static CohStats* stats;
+static uint64_t tick;
+
+static HotLine* hot;            // open addressing, at most half full
+static size_t hot_cap, hot_used;
+
+void coh_init(int proto, int cores) {
+    protocol = proto;
+    ncores = cores;
+    free(caches);
+    caches = calloc(cores, sizeof(*caches));
+    free(stats);
+    stats = calloc(cores, sizeof(CohStats));
+    free(hot);
+    hot_cap = 256;
+    hot_used = 0;
+    hot = calloc(hot_cap, sizeof(HotLine));
+    tick = 0;
+    COHERENCE = proto;
+}
+
+static HotLine* hot_line(uint64_t line) {
+    if (2 * (hot_used + 1) > hot_cap) {
+        HotLine* old = hot;
+        size_t old_cap = hot_cap;
+        hot_cap *= 2;
+        hot = calloc(hot_cap, sizeof(HotLine));
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].key == 0) continue;
+            size_t j = (old[i].key * 0x9E3779B97F4A7C15ull) & (hot_cap - 1);
+            while (hot[j].key != 0) j = (j + 1) & (hot_cap - 1);
+            hot[j] = old[i];
+        }
+        free(old);
+    }
+
+    uint64_t key = line + 1;
+    size_t j = (key * 0x9E3779B97F4A7C15ull) & (hot_cap - 1);
+    while (hot[j].key != key && hot[j].key != 0) j = (j + 1) & (hot_cap - 1);
+    if (hot[j].key == 0) {
+        hot[j].key = key;
+        hot_used++;
+    }
+    return &hot[j];
+}
+
+// The copy of LINE in CORE's cache: valid, or invalidated with its tag kept
+static CohLine* lookup(int core, uint64_t line) {
+    CohLine* set = caches[core][line % COH_SETS];
+    for (int w = 0; w < COH_WAYS; w++) {
+        if (set[w].tag == line && (set[w].state != I || set[w].invalidated))
+            return &set[w];
+    }
+    return NULL;
+}
+
+// WRITER writes the bytes in MASK of LINE, L is the copy of core C
+static void invalidate(int writer, int c, CohLine* l, uint64_t line, uint64_t mask) {
+    HotLine* h = hot_line(line);
+
+    stats[writer].invalidations_sent++;
+    stats[c].invalidations_received++;
+    h->invalidations++;
+    h->bytes[writer] |= mask;
+    h->bytes[c] |= l->touched;
+    if (!(l->touched & mask)) {
+        stats[c].false_sharing++;
+        h->false_sharing++;
+    }
+    l->state = I;
+    l->invalidated = 1;
+}
+
+// Every other cache sees CORE's transaction. Returns whether one of them
+// keeps a copy.
+static int snoop(int core, uint64_t line, int write, int needs_data, uint64_t mask) {
+    int shared = 0;
+
+    for (int c = 0; c < ncores; c++) {
+        CohLine* l = c == core ? NULL : lookup(c, line);
+        if (l == NULL || l->state == I) continue;
+
+        if (needs_data && (l->state == M || l->state == O)) {
+            stats[c].transfers++;
+            // MESI has no owner: the dirty line goes back to memory too
+            if (protocol == COH_MESI) stats[c].writebacks++;
+        }
+        if (write) {
+            invalidate(core, c, l, line, mask);
+        } else {
+            if (l->state == M) l->state = protocol == COH_MOESI ? O : S;
+            else if (l->state == E) l->state = S;
+            shared = 1;
+        }
+    }
+    return shared;
+}
+
+static void access_line(int core, uint64_t line, uint64_t mask, int write) {
+    CohStats* st = &stats[core];
+    CohLine* l = lookup(core, line);
+
+    st->accesses++;
+    tick++;
+
+    if (l != NULL && l->state != I) {
+        st->hits++;
+        if (write && (l->state == S || l->state == O)) {
+            st->bus_upgr++;
+            snoop(core, line, 1, 0, mask);
+        }
+        if (write) l->state = M;
+        l->touched |= mask;
+        l->used = tick;
+        return;
+    }
+
+    st->misses++;
+    if (l != NULL) {
+        st->coherence_misses++;
+        hot_line(line)->coherence_misses++;
+    } else {
+        // A free way, else the least recently used one
+        CohLine* set = caches[core][line % COH_SETS];
+        l = &set[0];
+        for (int w = 0; w < COH_WAYS; w++) {
+            if (set[w].state == I) {
+                l = &set[w];
+                break;
+            }
+            if (set[w].used < l->used) l = &set[w];
+        }
+        if (l->state == M || l->state == O) st->writebacks++;
+    }
+
+    if (write) {
+        st->bus_rdx++;
+        snoop(core, line, 1, 1, mask);
+        l->state = M;
+    } else {
+        st->bus_rd++;
+        l->state = snoop(core, line, 0, 1, mask) ? S : E;
+    }
+    l->tag = line;
+    l->invalidated = 0;
+    l->touched = mask;
+    l->used = tick;
+}
+
+void coh_access(uint64_t address, int len, int write) {
+    int core = SMP_CORE_ID;
+    uint64_t end = address + len;
+
+    pthread_mutex_lock(&coh_lock);
+    // Split at line boundaries
+    while (address < end) {
+        uint64_t line = address >> COH_LINE_SHIFT;
+        uint64_t next = (line + 1) << COH_LINE_SHIFT;
+        uint64_t stop = end < next ? end : next;
+        uint64_t bits = stop - address == 64 ? ~0ull : (1ull << (stop - address)) - 1;
+        access_line(core, line, bits << (address & (COH_LINE_SIZE - 1)), write);
+        address = stop;
+    }
+    pthread_mutex_unlock(&coh_lock);
+}
+
+// Data moved on the bus: fills and write-backs
+static uint64_t traffic(const CohStats* st) {
+    return (st->misses + st->writebacks) * COH_LINE_SIZE;
+}
+
+static int hot_order(const void* a, const void* b) {
+    const HotLine* x = a;
+    const HotLine* y = b;
+    uint64_t ex = x->invalidations + x->coherence_misses;
+    uint64_t ey = y->invalidations + y->coherence_misses;
+    if (ex != ey) return ex < ey ? 1 : -1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// The hottest lines, most coherence events first. Returns how many.
+static int hot_lines(HotLine** out) {
+    int n = 0;
+    HotLine* lines = malloc((hot_used + 1) * sizeof(HotLine));
+    for (size_t i = 0; i < hot_cap; i++) {
+        if (hot[i].key != 0) lines[n++] = hot[i];
+    }
+    qsort(lines, n, sizeof(HotLine), hot_order);
+    *out = lines;
+    return n < COH_HOT_LINES ? n : COH_HOT_LINES;
+}
+
+// "+0-7,+16-23": the byte offsets set in MASK
+static void print_bytes(FILE* out, uint64_t mask) {
+    const char* sep = "";
+    for (int i = 0; i < COH_LINE_SIZE; i++) {
+        if (!(mask >> i & 1)) continue;
+        int j = i;
+        while (j + 1 < COH_LINE_SIZE && (mask >> (j + 1) & 1)) j++;
+        if (j == i) fprintf(out, "%s+%d", sep, i);
+        else fprintf(out, "%s+%d-%d", sep, i, j);
+        sep = ",";
+        i = j;
+    }
+}
+
+void coh_report_text(FILE* out) {
+    HotLine* lines;
+    int n = hot_lines(&lines);
+
+    fprintf(out, "\nCoherence: %s, %d core%s, %d KiB %d-way private caches, %d-byte lines\n",
+            protocol == COH_MOESI ? "MOESI" : "MESI", ncores, ncores == 1 ? "" : "s",
+            COH_SETS * COH_WAYS * COH_LINE_SIZE / 1024, COH_WAYS, COH_LINE_SIZE);
+    fprintf(out, "-------------------------------------\n");
+    fprintf(out, "Core %10s %10s %10s %10s %9s %9s %9s %9s %10s %9s %12s\n",
+            "Accesses", "Hits", "Misses", "Coherence", "Upgrades", "Inval-out", "Inval-in",
+            "False-shr", "Writebacks", "Transfers", "Traffic(B)");
+    for (int c = 0; c < ncores; c++) {
+        const CohStats* st = &stats[c];
+        fprintf(out, "%4d %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %9" PRIu64
+                     " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %10" PRIu64 " %9" PRIu64 " %12" PRIu64 "\n",
+                c, st->accesses, st->hits, st->misses, st->coherence_misses, st->bus_upgr,
+                st->invalidations_sent, st->invalidations_received, st->false_sharing,
+                st->writebacks, st->transfers, traffic(st));
+    }
+
+    if (n > 0) {
+        fprintf(out, "\nHot lines:\n");
+        fprintf(out, "%-18s %9s %9s %9s  %s\n", "Line", "Invals", "False-shr", "Coh-miss", "Bytes touched per core");
+    }
+    for (int i = 0; i < n; i++) {
+        const HotLine* h = &lines[i];
+        fprintf(out, "0x%016" PRIx64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " ",
+                (h->key - 1) << COH_LINE_SHIFT, h->invalidations, h->false_sharing, h->coherence_misses);
+        for (int c = 0; c < ncores; c++) {
+            if (h->bytes[c] == 0) continue;
+            fprintf(out, " core %d: ", c);
+            print_bytes(out, h->bytes[c]);
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "\n");
+    free(lines);
+}
+
+void coh_report_json(FILE* out) {
+    HotLine* lines;
+    int n = hot_lines(&lines);
+
+    fprintf(out, "{\"protocol\":\"%s\",\"line_size\":%d,\"cores\":[",
+            protocol == COH_MOESI ? "moesi" : "mesi", COH_LINE_SIZE);
+    for (int c = 0; c < ncores; c++) {
+        const CohStats* st = &stats[c];
+        fprintf(out, "%s{\"accesses\":%" PRIu64 ",\"hits\":%" PRIu64 ",\"misses\":%" PRIu64
+                     ",\"coherence_misses\":%" PRIu64 ",\"bus_rd\":%" PRIu64 ",\"bus_rdx\":%" PRIu64
+                     ",\"bus_upgr\":%" PRIu64 ",\"invalidations_sent\":%" PRIu64
+                     ",\"invalidations_received\":%" PRIu64 ",\"false_sharing\":%" PRIu64
+                     ",\"writebacks\":%" PRIu64 ",\"transfers\":%" PRIu64 ",\"traffic_bytes\":%" PRIu64 "}",
+                c ? "," : "", st->accesses, st->hits, st->misses, st->coherence_misses,
+                st->bus_rd, st->bus_rdx, st->bus_upgr, st->invalidations_sent,
+                st->invalidations_received, st->false_sharing, st->writebacks, st->transfers,
+                traffic(st));
+    }
+    fprintf(out, "],\"hot_lines\":[");
+    for (int i = 0; i < n; i++) {
+        const HotLine* h = &lines[i];
+        fprintf(out, "%s{\"line\":\"0x%" PRIx64 "\",\"invalidations\":%" PRIu64 ",\"false_sharing\":%" PRIu64
+                     ",\"coherence_misses\":%" PRIu64 ",\"bytes\":[",
+                i ? "," : "", (h->key - 1) << COH_LINE_SHIFT, h->invalidations, h->false_sharing,
+                h->coherence_misses);
+        for (int c = 0; c < ncores; c++)
+            fprintf(out, "%s\"0x%" PRIx64 "\"", c ? "," : "", h->bytes[c]);
+        fprintf(out, "]}");
+    }
+    fprintf(out, "]}");
+    free(lines);
+}
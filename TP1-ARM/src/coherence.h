@@ -0,0 +1,36 @@
+#ifndef COHERENCE_H
+#define COHERENCE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Cache-coherence model (--coherence mesi|moesi).
+//
+// Each core gets a private set-associative data cache; the caches are kept
+// coherent by snooping on a shared bus. The model only counts: data always
+// lives in guest memory, so turning it on never changes what a program does.
+// It is fed by mem_read_32 / mem_write_32 and the atomics, not by fetches.
+
+#define COH_LINE_SHIFT  6                       // 64-byte lines
+#define COH_LINE_SIZE   (1 << COH_LINE_SHIFT)
+#define COH_SETS        64
+#define COH_WAYS        8                       // 32 KiB per core
+#define COH_HOT_LINES   10                      // lines in the report
+
+#define COH_MESI        1
+#define COH_MOESI       2
+
+extern int COHERENCE;           // 0 (off), COH_MESI or COH_MOESI
+
+// Clears the caches and the statistics for a run on NCORES cores and turns
+// the model on with PROTOCOL
+void coh_init(int protocol, int ncores);
+
+// An access of LEN bytes at ADDRESS by the calling thread's core
+void coh_access(uint64_t address, int len, int write);
+
+// Per-core statistics and the lines with the most coherence traffic
+void coh_report_text(FILE* out);
+void coh_report_json(FILE* out);
+
+#endif
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include "cosim.h"
+#include "decode.h"
+#include "shell.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Lockstep co-simulation against the reference simulator.
+//
+// The reference is driven through its own shell ("run n" + "rdump") while our
+// simulator runs inside this process. Both advance in chunks that double while
+// they agree. When a chunk disagrees we rewind our side to the last agreeing
+// checkpoint, restart the reference, and bisect the chunk down to the first
+// instruction whose result differs.
+//
+// The reference uses stdio, so its stdout is fully buffered when it is a pipe
+// and it would never answer a command. We talk to it through a pseudo-terminal
+// instead, where it behaves exactly like an interactive session.
+
+#define COSIM_PROMPT "ARM-SIM> "
+#define COSIM_MAX_CHUNK (1 << 20)
+#define COSIM_MAX_INSTRUCTIONS 100000000
+#define COSIM_TIMEOUT_MS 10000
+
+typedef struct {
+    pid_t pid;
+    int fd;             // master side of the pty
+    char* buf;          // output of the last command, up to the prompt
+    size_t len, cap;
+} RefSim;
+
+typedef struct {
+    unsigned int count;
+    uint64_t PC;
+    int64_t REGS[ARM_REGS];
+    int FLAG_N;
+    int FLAG_Z;
+} ArchState;
+
+
+static int ref_wait_prompt(RefSim* r) {
+    size_t plen = strlen(COSIM_PROMPT);
+
+    r->len = 0;
+    while (r->len < plen || memcmp(r->buf + r->len - plen, COSIM_PROMPT, plen) != 0) {
+        struct pollfd p = { r->fd, POLLIN, 0 };
+        if (poll(&p, 1, COSIM_TIMEOUT_MS) <= 0) {
+            fprintf(stderr, "cosim: reference simulator did not answer\n");
+            return -1;
+        }
+        if (r->cap - r->len < 4096) {
+            r->cap = r->cap ? r->cap * 2 : 65536;
+            r->buf = realloc(r->buf, r->cap + 1);
+        }
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len);
+        if (n <= 0) {
+            fprintf(stderr, "cosim: reference simulator exited\n");
+            return -1;
+        }
+        r->len += n;
+    }
+    r->buf[r->len] = '\0';
+    return 0;
+}
+
+static void ref_stop(RefSim* r) {
+    if (r->pid > 0) {
+        kill(r->pid, SIGKILL);
+        waitpid(r->pid, NULL, 0);
+        close(r->fd);
+    }
+    r->pid = 0;
+}
+
+static int ref_start(RefSim* r, const char* ref_path, const char* program) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        perror("cosim: posix_openpt");
+        return -1;
+    }
+    char* slave_name = ptsname(master);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("cosim: fork");
+        close(master);
+        return -1;
+    }
+    if (pid == 0) {
+        setsid();
+        int slave = open(slave_name, O_RDWR);
+        struct termios t;
+        tcgetattr(slave, &t);
+        cfmakeraw(&t);  // no echo, no \n -> \r\n translation
+        tcsetattr(slave, TCSANOW, &t);
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        close(slave);
+        close(master);
+        execl(ref_path, ref_path, program, (char*)NULL);
+        _exit(127);
+    }
+
+    r->pid = pid;
+    r->fd = master;
+    return ref_wait_prompt(r);
+}
+
+static int ref_command(RefSim* r, const char* fmt, ...) {
+    char cmd[64];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(cmd, sizeof(cmd) - 1, fmt, ap);
+    va_end(ap);
+    cmd[n++] = '\n';
+
+    if (write(r->fd, cmd, n) != n) {
+        perror("cosim: write");
+        return -1;
+    }
+    return ref_wait_prompt(r);
+}
+
+// Parses the output of "rdump" into s. Returns 0 if every field was found.
+static int parse_rdump(char* text, ArchState* s) {
+    int fields = 0;
+    char* save;
+
+    for (char* line = strtok_r(text, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save)) {
+        int k;
+        int64_t value;
+        if (sscanf(line, "Instruction Count : %u", &s->count) == 1) fields++;
+        else if (sscanf(line, "PC : 0x%" SCNx64, &s->PC) == 1) fields++;
+        else if (sscanf(line, "X%d: 0x%" SCNx64, &k, &value) == 2 && k >= 0 && k < ARM_REGS) {
+            s->REGS[k] = value;
+            fields++;
+        }
+        else if (sscanf(line, "FLAG_N: %d", &s->FLAG_N) == 1) fields++;
+        else if (sscanf(line, "FLAG_Z: %d", &s->FLAG_Z) == 1) fields++;
+    }
+    return fields == ARM_REGS + 4 ? 0 : -1;
+}
+
+// Restarts the reference (if needed) and leaves it after `steps` run steps
+static int ref_state_at(RefSim* r, const char* ref_path, const char* program,
+                        int restart, long steps, ArchState* s) {
+    if (restart) {
+        ref_stop(r);
+        if (ref_start(r, ref_path, program) < 0) return -1;
+    }
+    if (steps > 0 && ref_command(r, "run %ld", steps) < 0) return -1;
+    if (ref_command(r, "rdump") < 0) return -1;
+    if (parse_rdump(r->buf, s) < 0) {
+        fprintf(stderr, "cosim: could not parse reference rdump\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void local_run(long steps) {
+    INSTRUCTION_LIMIT = INSTRUCTION_COUNT + steps;
+    while (INSTRUCTION_COUNT < INSTRUCTION_LIMIT && RUN_BIT)
+        cycle();
+    INSTRUCTION_LIMIT = INT_MAX;
+}
+
+static void local_state(ArchState* s) {
+    s->count = INSTRUCTION_COUNT;
+    s->PC = CURRENT_STATE.PC;
+    memcpy(s->REGS, CURRENT_STATE.REGS, sizeof(s->REGS));
+    s->FLAG_N = CURRENT_STATE.FLAG_N;
+    s->FLAG_Z = CURRENT_STATE.FLAG_Z;
+}
+
+static int same_state(const ArchState* a, const ArchState* b) {
+    return a->count == b->count && a->PC == b->PC &&
+           a->FLAG_N == b->FLAG_N && a->FLAG_Z == b->FLAG_Z &&
+           memcmp(a->REGS, b->REGS, sizeof(a->REGS)) == 0;
+}
+
+static void report_divergence(uint64_t pc, uint32_t instruction,
+                              const ArchState* ref, const ArchState* sim) {
+    printf("Divergence at instruction %u (PC 0x%" PRIx64 ": 0x%08x %s)\n\n",
+           sim->count > ref->count ? ref->count : sim->count, pc,
+           instruction, instruction_name(instruction));
+    printf("  %-18s %-20s %-20s\n", "", "reference", "sim");
+    if (ref->count != sim->count)
+        printf("  %-18s %-20u %-20u\n", "Instruction Count", ref->count, sim->count);
+    if (ref->PC != sim->PC)
+        printf("  %-18s 0x%-18" PRIx64 " 0x%-18" PRIx64 "\n", "PC", ref->PC, sim->PC);
+    for (int k = 0; k < ARM_REGS; k++) {
+        if (ref->REGS[k] != sim->REGS[k]) {
+            char name[8];
+            snprintf(name, sizeof(name), "X%d", k);
+            printf("  %-18s 0x%-18" PRIx64 " 0x%-18" PRIx64 "\n", name, ref->REGS[k], sim->REGS[k]);
+        }
+    }
+    if (ref->FLAG_N != sim->FLAG_N)
+        printf("  %-18s %-20d %-20d\n", "FLAG_N", ref->FLAG_N, sim->FLAG_N);
+    if (ref->FLAG_Z != sim->FLAG_Z)
+        printf("  %-18s %-20d %-20d\n", "FLAG_Z", ref->FLAG_Z, sim->FLAG_Z);
+    printf("\n");
+}
+
+int cosim(const char* ref_path, char* program_filename) {
+    RefSim ref = { 0 };
+    sim_checkpoint_t good = { 0 };
+    ArchState rs, ss;
+    long lo = 0;             // run steps after which both agree
+    long chunk = 1;
+    int result = 2;
+
+    VERBOSE = FALSE;
+    printf("Co-simulating %s against %s\n\n", program_filename, ref_path);
+
+    if (ref_start(&ref, ref_path, program_filename) < 0) goto out;
+    initialize(&program_filename, 1);
+    save_checkpoint(&good);
+
+    // Advance both in growing chunks until they disagree or halt
+    for (;;) {
+        local_run(chunk);
+        local_state(&ss);
+        if (ref_state_at(&ref, ref_path, program_filename, FALSE, chunk, &rs) < 0) goto out;
+        if (!same_state(&rs, &ss)) break;
+
+        if (!RUN_BIT) {
+            // Make sure the reference halted at the same instruction too
+            if (ref_state_at(&ref, ref_path, program_filename, FALSE, 1, &rs) < 0) goto out;
+            if (!same_state(&rs, &ss)) break;
+            printf("Simulators agree on all %u instructions up to HLT.\n", ss.count);
+            result = 0;
+            goto out;
+        }
+        lo += chunk;
+        if (lo >= COSIM_MAX_INSTRUCTIONS) {
+            printf("Simulators agree on the first %u instructions (limit reached).\n", ss.count);
+            result = 0;
+            goto out;
+        }
+        save_checkpoint(&good);
+        if (chunk < COSIM_MAX_CHUNK) chunk *= 2;
+    }
+
+    // Bisect (lo, lo + chunk] down to the single step that differs
+    long hi = lo + chunk;
+    while (hi - lo > 1) {
+        long mid = lo + (hi - lo) / 2;
+        restore_checkpoint(&good);
+        local_run(mid - lo);
+        local_state(&ss);
+        if (ref_state_at(&ref, ref_path, program_filename, TRUE, mid, &rs) < 0) goto out;
+        if (same_state(&rs, &ss)) {
+            lo = mid;
+            save_checkpoint(&good);
+        } else {
+            hi = mid;
+        }
+    }
+
+    restore_checkpoint(&good);
+    uint64_t pc = CURRENT_STATE.PC;
+    uint32_t instruction = mem_read_32(pc);
+    local_run(1);
+    local_state(&ss);
+    if (ref_state_at(&ref, ref_path, program_filename, TRUE, hi, &rs) < 0) goto out;
+    report_divergence(pc, instruction, &rs, &ss);
+    result = 1;
+
+out:
+    ref_stop(&ref);
+    free(ref.buf);
+    free_checkpoint(&good);
+    return result;
+}
@@ -0,0 +1,10 @@
+#ifndef COSIM_H
+#define COSIM_H
+
+// Runs program_filename on this simulator and on the reference simulator
+// in lockstep and reports the first instruction where their register state
+// differs. Returns 0 when both agree up to HLT, 1 on a divergence and 2 if
+// the reference could not be driven.
+int cosim(const char* ref_path, char* program_filename);
+
+#endif
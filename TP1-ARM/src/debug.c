@@ -0,0 +1,259 @@
+#include "debug.h"
+#include "decode.h"
+#include "execute.h"
+#include "shell.h"
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+// Breakpoints and watchpoints.
+//
+// Neither costs anything while it is not being hit. Setting a breakpoint
+// patches the decoded-instruction slot of its address into a BREAKPOINT, so
+// the normal dispatch in process_instruction() is the only check. A watchpoint
+// tags its page with PAGE_WATCH, which turns off the memory fast paths for that
+// page alone; the byte-wise slow path reports each access to watch_access().
+//
+// A hit sets RUN_BIT to STOPPED, which ends go/run; the shell reports the stop
+// and sets RUN_BIT back to TRUE. The instruction under a breakpoint has not run
+// yet, so resuming skips the breakpoint at that address once.
+
+typedef enum { COND_NONE, COND_EQ, COND_NE, COND_LT, COND_GT, COND_LE, COND_GE } CondOp;
+
+typedef struct {
+    int number;         // 0 for a free entry
+    int is_watch;
+    uint64_t address;
+    uint64_t size;      // watchpoints
+    int access;         // WATCH_* (watchpoints)
+    int reg;            // condition: X<reg> <op> <value> (breakpoints)
+    CondOp op;
+    int64_t value;
+} DebugPoint;
+
+static DebugPoint points[DEBUG_MAX_POINTS];
+static int next_number = 1;
+// Per core, like the CPU state
+static __thread uint64_t resume_pc = UINT64_MAX;
+static __thread DebugPoint stop_point;
+static __thread uint64_t stop_address;
+
+static const char* const cond_names[] = { "", "==", "!=", "<", ">", "<=", ">=" };
+
+static DebugPoint* new_point(void) {
+    for (int i = 0; i < DEBUG_MAX_POINTS; i++) {
+        if (points[i].number == 0) {
+            memset(&points[i], 0, sizeof(points[i]));
+            return &points[i];
+        }
+    }
+    printf("Error: too many breakpoints and watchpoints\n\n");
+    return NULL;
+}
+
+// "" or "x<n> <op> <value>"
+static int parse_cond(const char* s, DebugPoint* p) {
+    char op[3];
+
+    while (isspace((unsigned char)*s)) s++;
+    if (*s == '\0') {
+        p->op = COND_NONE;
+        return 0;
+    }
+    if (sscanf(s, "%*[xX]%d %2[=!<>] %" SCNi64, &p->reg, op, &p->value) != 3 ||
+        p->reg < 0 || p->reg >= ARM_REGS) {
+        return -1;
+    }
+    for (int k = COND_EQ; k <= COND_GE; k++) {
+        if (strcmp(op, cond_names[k]) == 0) {
+            p->op = k;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int cond_holds(const DebugPoint* p) {
+    int64_t x = CURRENT_STATE.REGS[p->reg];
+    switch (p->op) {
+        case COND_EQ: return x == p->value;
+        case COND_NE: return x != p->value;
+        case COND_LT: return x < p->value;
+        case COND_GT: return x > p->value;
+        case COND_LE: return x <= p->value;
+        case COND_GE: return x >= p->value;
+        default: return 1;
+    }
+}
+
+int debug_break(uint64_t pc, const char* cond) {
+    DebugPoint* p = new_point();
+    if (p == NULL) return -1;
+
+    if (parse_cond(cond, p) < 0) {
+        printf("Error: bad condition, expected: x<n> ==|!=|<|>|<=|>= <value>\n\n");
+        return -1;
+    }
+    DecodedInstruction* slot = decode_slot(pc);
+    if (slot == NULL) {
+        printf("Error: no memory at 0x%" PRIx64 "\n\n", pc);
+        return -1;
+    }
+    decode_unfuse(pc);
+    memset(slot, 0, sizeof(*slot));
+    slot->type = BREAKPOINT;
+    slot->instruction = mem_peek_32(pc);
+
+    p->address = pc;
+    p->number = next_number++;
+    printf("Breakpoint %d at 0x%" PRIx64 "\n\n", p->number, pc);
+    return p->number;
+}
+
+// Tags (or untags) every page a watchpoint touches
+static int watch_pages(const DebugPoint* p, int enable) {
+    uint64_t first = p->address >> MEM_PAGE_SHIFT;
+    uint64_t last = (p->address + p->size - 1) >> MEM_PAGE_SHIFT;
+
+    for (uint64_t vpn = first; vpn <= last; vpn++) {
+        if (mem_translate(vpn << MEM_PAGE_SHIFT, 0) == NULL) return -1;
+        mem_watch_page(vpn << MEM_PAGE_SHIFT, enable);
+    }
+    return 0;
+}
+
+int debug_watch(uint64_t address, uint64_t size, int access) {
+    DebugPoint* p = new_point();
+    if (p == NULL) return -1;
+
+    p->address = address;
+    p->size = size ? size : 1;
+    if (watch_pages(p, TRUE) < 0) {
+        printf("Error: no memory at 0x%" PRIx64 "\n\n", address);
+        return -1;
+    }
+    p->is_watch = TRUE;
+    p->access = access;
+    p->number = next_number++;
+    printf("Watchpoint %d at 0x%" PRIx64 "\n\n", p->number, address);
+    return p->number;
+}
+
+int debug_delete(int number) {
+    DebugPoint* p = NULL;
+    for (int i = 0; i < DEBUG_MAX_POINTS; i++) {
+        if (points[i].number == number && number != 0) p = &points[i];
+    }
+    if (p == NULL) {
+        printf("Error: no breakpoint or watchpoint %d\n\n", number);
+        return -1;
+    }
+    p->number = 0;
+
+    if (p->is_watch) {
+        // Untag the pages, then tag again the ones other watchpoints still need
+        watch_pages(p, FALSE);
+        for (int i = 0; i < DEBUG_MAX_POINTS; i++) {
+            if (points[i].number != 0 && points[i].is_watch)
+                watch_pages(&points[i], TRUE);
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < DEBUG_MAX_POINTS; i++) {
+        if (points[i].number != 0 && !points[i].is_watch && points[i].address == p->address)
+            return 0;
+    }
+    decode_slot(p->address)->type = NOT_DECODED;
+    if (resume_pc == p->address) resume_pc = UINT64_MAX;
+    return 0;
+}
+
+int debug_find(int is_watch, uint64_t address) {
+    for (int i = 0; i < DEBUG_MAX_POINTS; i++) {
+        if (points[i].number != 0 && points[i].is_watch == is_watch && points[i].address == address)
+            return points[i].number;
+    }
+    return 0;
+}
+
+void debug_list(void) {
+    printf("Num  Type        Address             Condition\n");
+    for (int i = 0; i < DEBUG_MAX_POINTS; i++) {
+        const DebugPoint* p = &points[i];
+        if (p->number == 0) continue;
+        if (p->is_watch) {
+            printf("%-4d watch %-5s 0x%016" PRIx64 "  %" PRIu64 " bytes\n", p->number,
+                   p->access == WATCH_READ ? "r" : p->access == WATCH_WRITE ? "w" : "rw",
+                   p->address, p->size);
+        } else if (p->op != COND_NONE) {
+            printf("%-4d break       0x%016" PRIx64 "  X%d %s %" PRId64 "\n", p->number, p->address,
+                   p->reg, cond_names[p->op], p->value);
+        } else {
+            printf("%-4d break       0x%016" PRIx64 "\n", p->number, p->address);
+        }
+    }
+    printf("\n");
+}
+
+void debug_report_stop(void) {
+    if (stop_point.is_watch) {
+        printf("Watchpoint %d: 0x%" PRIx64 " = 0x%x, stopped at PC 0x%" PRIx64 "\n\n",
+               stop_point.number, stop_point.address, mem_peek_32(stop_point.address),
+               CURRENT_STATE.PC);
+    } else {
+        printf("Breakpoint %d at PC 0x%" PRIx64 "\n\n", stop_point.number, CURRENT_STATE.PC);
+    }
+    RUN_BIT = TRUE;
+}
+
+int debug_stop_reason(uint64_t* address) {
+    *address = stop_point.is_watch ? stop_address : stop_point.address;
+    return stop_point.is_watch ? stop_point.access : 0;
+}
+
+void debug_step_over(void) {
+    resume_pc = CURRENT_STATE.PC;
+}
+
+void breakpoint_hit(void) {
+    uint64_t pc = CURRENT_STATE.PC;
+
+    if (pc != resume_pc) {
+        for (int i = 0; i < DEBUG_MAX_POINTS; i++) {
+            const DebugPoint* p = &points[i];
+            if (p->number == 0 || p->is_watch || p->address != pc || !cond_holds(p))
+                continue;
+            // Stop before the instruction: undo what cycle() is about to do
+            stop_point = *p;
+            resume_pc = pc;
+            NEXT_STATE.PC = pc;
+            INSTRUCTION_COUNT--;
+            RUN_BIT = STOPPED;
+            return;
+        }
+    }
+
+    // Not stopping: run the instruction that is really there
+    resume_pc = UINT64_MAX;
+    DecodedInstruction d = decode_instruction(mem_peek_32(pc));
+    execute_instruction(&d);
+}
+
+void watch_access(uint64_t address, int is_write) {
+    if (RUN_BIT != TRUE) return;
+
+    for (int i = 0; i < DEBUG_MAX_POINTS; i++) {
+        const DebugPoint* p = &points[i];
+        if (p->number == 0 || !p->is_watch) continue;
+        if (address - p->address < p->size &&
+            (p->access & (is_write ? WATCH_WRITE : WATCH_READ))) {
+            // The access completes; the run stops after this instruction
+            stop_point = *p;
+            stop_address = address;
+            RUN_BIT = STOPPED;
+            return;
+        }
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include <stdint.h>
+
+// Breakpoints and watchpoints for the interactive shell
+
+#define WATCH_READ  0x1
+#define WATCH_WRITE 0x2
+
+#define WATCH_BYTES 4    // default watchpoint size: one word, as mdump shows it
+
+#define DEBUG_MAX_POINTS 64
+
+int  debug_break(uint64_t pc, const char* cond);   // number, or -1
+int  debug_watch(uint64_t address, uint64_t size, int access);  // number, or -1
+int  debug_delete(int number);
+int  debug_find(int is_watch, uint64_t address);   // number, or 0
+void debug_list(void);
+void debug_report_stop(void);
+int  debug_stop_reason(uint64_t* address);  // 0 for a breakpoint, else WATCH_*
+void debug_step_over(void);                 // don't stop at the current PC
+
+// Hooks: a patched slot was executed / a watched page was accessed
+void breakpoint_hit(void);
+void watch_access(uint64_t address, int is_write);
+
+#endif
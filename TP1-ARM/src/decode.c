@@ -1,5 +1,9 @@
 #include "decode.h"
+#include "hostprof.h"
+#include "loop.h"
+#include "utils.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // Instructions patterns 
@@ -9,6 +13,10 @@ const InstructionPattern patterns[] = {
     // System instructions (29 bits)
     {0xFFFFFC1F, 0xD4400000, HLT, "HLT"},
     {0xFFFFFC1F, 0xD61F0000, BR, "BR"},
+    {0xFFFFFBFF, 0xD508831F, TLBI, "TLBI VMALLE1"},
+    {0xFFFFF01F, 0xD503201F, HINT, "HINT"},
+    {0xFFF00000, 0xD5100000, MSR, "MSR"},
+    {0xFFF00000, 0xD5300000, MRS, "MRS"},
     
     // Register operations with specific flags (21 bits)
     {0xFFE0FC1F, 0xEB00001F, CMP_REG, "CMP Register"},
@@ -22,6 +30,14 @@ const InstructionPattern patterns[] = {
     {0xFFE0FC00, 0xAA000000, ORR_REG, "ORR Register"},
     {0xFFE0FC00, 0x9B000000, MUL, "MUL"},
     
+    // Exclusive and atomic memory operations (15-21 bits)
+    // The acquire/release variants share a type: every access is sequentially consistent
+    {0xFFFF7C00, 0xC85F7C00, LDXR, "LDXR"},
+    {0xFFE07C00, 0xC8007C00, STXR, "STXR"},
+    {0xFFA07C00, 0xC8A07C00, CAS, "CAS"},
+    {0xFF20FC00, 0xF8200000, LDADD, "LDADD"},
+    {0xFF20FC00, 0xF8208000, SWP, "SWP"},
+    
     // Immediate operations with specific flags (13 bits)
     {0xFF80001F, 0xF100001F, CMP_IMM, "CMP Immediate"},
     
@@ -70,7 +86,7 @@ DecodedInstruction decode_instruction(uint32_t instruction) {
         if ((instruction & patterns[i].mask) == patterns[i].value) {
             
             d.type = patterns[i].type;
-            printf("Detected Instruction: %s\n", patterns[i].name);
+            trace("Detected Instruction: %s\n", patterns[i].name);
             
             // Extract fields based on instruction type
             switch (d.type) {
@@ -107,6 +123,11 @@ DecodedInstruction decode_instruction(uint32_t instruction) {
                 case EOR_REG:
                 case ORR_REG:
                 case MUL:
+                case LDXR:      // rd = Rt, rn = base, rm = Rs
+                case STXR:
+                case LDADD:
+                case SWP:
+                case CAS:
                     extract_register_fields(instruction, &d);
                     break;
 
@@ -116,6 +137,13 @@ DecodedInstruction decode_instruction(uint32_t instruction) {
                 case BR:
                     extract_br_fields(instruction, &d);
                     break;
+                case MSR:
+                case MRS:
+                    extract_sysreg_fields(instruction, &d);
+                    break;
+                case HINT:
+                    d.imm = (instruction >> 5) & 0x7F; // CRm:op2 [11:5]
+                    break;
                 case CBZ:
                 case CBNZ:
                 extract_cb_fields(instruction, &d);
@@ -133,7 +161,7 @@ DecodedInstruction decode_instruction(uint32_t instruction) {
                     case 0xc: d.type = BGT; break; // Z==0 && N==V => (Z=0 && N=0 => X1 > X2)
                     case 0xd: d.type = BLE; break; // Z==1 || N!=V => (Z=1 || N=1 => X1 <= X2)
                     default:
-                        printf("Unsupported condition code: 0x%x\n", d.cond);
+                        trace("Unsupported condition code: 0x%x\n", d.cond);
                         d.type = UNKNOWN;
                         break;
                 }
@@ -144,11 +172,157 @@ DecodedInstruction decode_instruction(uint32_t instruction) {
     }
     
     d.type = UNKNOWN;
-    printf("Unknown instruction\n");
+    trace("Unknown instruction\n");
     return d;
 }
 
 
+// Decoded-instruction cache
+// Each page instructions are fetched from gets an array with the decoded form
+// of its words, so the pattern table is only searched the first time an
+// instruction runs. Such pages are marked PAGE_CODE: stores to them take the
+// slow path, which calls decode_invalidate() for the bytes written, so the
+// cache stays right when a program rewrites its own code.
+// The debugger patches breakpoints into these slots (see debug.c).
+DecodedInstruction* decode_slot(uint64_t pc) {
+    mem_page_t* pg = mem_translate(pc, 0);
+    if (pg == NULL) return NULL;
+
+    if (pg->decoded == NULL) {
+        DecodedPage* decoded = malloc(sizeof(DecodedPage));
+        for (int i = 0; i < MEM_PAGE_SIZE / 4; i++) {
+            decoded->insn[i].type = NOT_DECODED;
+        }
+        mem_track_code(pg, decoded);
+    }
+    return &pg->decoded->insn[(pc & MEM_PAGE_MASK) >> 2];
+}
+
+static int sets_flags(InstructionType type) {
+    switch (type) {
+        case ADDS_IMM: case ADDS_REG: case SUBS_IMM: case SUBS_REG:
+        case CMP_IMM: case CMP_REG: case ANDS_REG:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int is_bcond(InstructionType type) {
+    return type == BEQ || type == BNE || type == BGT || type == BLT || type == BGE || type == BLE;
+}
+
+// Macro-op fusion
+// A slot whose instruction forms a known pair with the next one becomes a
+// single fused entry: its own fields are kept and `op` remembers its type,
+// the partner is read from the following slot when the pair runs. Pairs never
+// cross a page and never include a breakpoint.
+static void fuse_pair(uint64_t pc, DecodedInstruction* slot) {
+    if ((pc & MEM_PAGE_MASK) == MEM_PAGE_SIZE - 4) return;
+
+    // The partner is decoded into a local: left undecoded, its slot is still
+    // tried as the head of a pair of its own when it is reached
+    DecodedInstruction* next = slot + 1;
+    if (next->type == BREAKPOINT) return;
+    DecodedInstruction partner = next->type == NOT_DECODED ? decode_instruction(mem_peek_32(pc + 4)) : *next;
+
+    if (sets_flags(slot->type) && is_bcond(partner.type)) {
+        slot->op = slot->type;
+        slot->type = FUSED_ALU_BCOND;
+    } else if (slot->type == MOVZ && slot->rd != 31 && partner.type == STUR) {
+        slot->op = slot->type;
+        slot->type = FUSED_MOVZ_STUR;
+    } else {
+        return;
+    }
+    // B.cond and STUR never start a pair, so the partner can be cached now
+    if (next->type == NOT_DECODED)
+        *next = partner;
+}
+
+// Turns the pair that ends at PC back into two plain instructions
+void decode_unfuse(uint64_t pc) {
+    if ((pc & MEM_PAGE_MASK) == 0) return;
+    DecodedInstruction* prev = decode_slot(pc - 4);
+    if (prev != NULL && (prev->type == FUSED_ALU_BCOND || prev->type == FUSED_MOVZ_STUR)) {
+        prev->type = prev->op;
+    }
+}
+
+// Forgets the decoded form of the words overlapping [ADDRESS, ADDRESS + LEN),
+// splits a pair whose second half is among them and drops the counted loops
+// that contain them. Breakpoint slots stay: they re-read memory when they run.
+void decode_invalidate(uint64_t address, uint64_t len) {
+    uint64_t first = address & ~(uint64_t)3;
+    uint64_t last = (address + len - 1) & ~(uint64_t)3;
+
+    for (uint64_t pc = first; pc <= last; pc += 4) {
+        mem_page_t* pg = mem_translate(pc, 0);
+        if (pg == NULL || pg->decoded == NULL) continue;
+        DecodedInstruction* slot = &pg->decoded->insn[(pc & MEM_PAGE_MASK) >> 2];
+        if (slot->type != BREAKPOINT) slot->type = NOT_DECODED;
+        // Loops are keyed by load-time (physical) address, PC may be virtual
+        loop_invalidate((pg->vpn << MEM_PAGE_SHIFT) | (pc & MEM_PAGE_MASK), 4);
+    }
+    decode_unfuse(first);
+}
+
+const DecodedInstruction* decode_cached(uint64_t pc, uint32_t instruction) {
+    static __thread DecodedInstruction uncached;
+    DecodedInstruction* slot = decode_slot(pc);
+
+    if (slot == NULL) {
+        uint64_t t0 = HOSTPROF ? hostprof_ticks() : 0;
+        uncached = decode_instruction(instruction);
+        if (HOSTPROF) hostprof_path(HOSTPROF_UNCACHED, hostprof_ticks() - t0);
+        return &uncached;
+    }
+    if (slot->type == BREAKPOINT) return slot;
+
+    // The trace shows the decoding and every single instruction, so verbose
+    // runs always decode and never fuse
+    if (VERBOSE || slot->type == NOT_DECODED) {
+        uint64_t t0 = HOSTPROF ? hostprof_ticks() : 0;
+        *slot = decode_instruction(instruction);
+        if (!VERBOSE) fuse_pair(pc, slot);
+        if (HOSTPROF) hostprof_path(HOSTPROF_DECODE, hostprof_ticks() - t0);
+    }
+    return slot;
+}
+
+
+// Name of an instruction type: its first pattern, for reports
+const char* type_name(InstructionType type) {
+    switch (type) {
+        case NOT_DECODED: return "NOT_DECODED";
+        case BREAKPOINT: return "BREAKPOINT";
+        case FUSED_ALU_BCOND: return "ALU+B.cond";
+        case FUSED_MOVZ_STUR: return "MOVZ+STUR";
+        case BEQ: return "B.EQ";
+        case BNE: return "B.NE";
+        case BGT: return "B.GT";
+        case BLT: return "B.LT";
+        case BGE: return "B.GE";
+        case BLE: return "B.LE";
+        default: break;
+    }
+    for (int i = 0; i < PATTERN_COUNT; i++) {
+        if (patterns[i].type == type) return patterns[i].name;
+    }
+    return "Unknown";
+}
+
+// Name of the pattern an instruction word matches, for reports and dumps
+const char* instruction_name(uint32_t instruction) {
+    for (int i = 0; i < PATTERN_COUNT; i++) {
+        if ((instruction & patterns[i].mask) == patterns[i].value) {
+            return patterns[i].name;
+        }
+    }
+    return "Unknown";
+}
+
+
 // Field extraction functions (to be called after matching a pattern)
 // Each function extracts the relevant fields from the instruction based on its type
 // The extracted fields are stored in the DecodedInstruction struct
@@ -185,7 +359,7 @@ void extract_immediate_fields(uint32_t instruction, DecodedInstruction* d) {
         
         if (hw != 0) {
             // just in case, for the custom tests
-            printf("Warning: MOVZ with hw != 0 not supported\n");
+            trace("Warning: MOVZ with hw != 0 not supported\n");
         }
     
         d->imm = imm16;
@@ -212,7 +386,7 @@ void extract_immediate_fields(uint32_t instruction, DecodedInstruction* d) {
         
         d->shift = 0;
         
-        printf("Extracted shift amount: %ld\n", d->imm);
+        trace("Extracted shift amount: %ld\n", d->imm);
     }
     
     void extract_memory_fields(uint32_t instruction, DecodedInstruction* d) {
@@ -275,4 +449,9 @@ void extract_immediate_fields(uint32_t instruction, DecodedInstruction* d) {
     
     void extract_br_fields(uint32_t instruction, DecodedInstruction* d) {
         d->rn = instruction & 0x1F; // [4:0]
+    }
+    
+    void extract_sysreg_fields(uint32_t instruction, DecodedInstruction* d) {
+        d->rd = instruction & 0x1F; // Xt [4:0]
+        d->imm = (instruction >> 5) & 0x7FFF; // o0:op1:CRn:CRm:op2 [19:5]
     }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define DECODE_H
 
 #include <stdint.h>
+#include "memory.h"
 
 typedef enum {
     ADDS_IMM,
@@ -40,14 +41,45 @@ typedef enum {
     MUL,
     CBZ,
     CBNZ,
+
+    // Exclusive and atomic memory operations, 64-bit only
+    LDXR,       // LDXR / LDAXR
+    STXR,       // STXR / STLXR
+    LDADD,      // LDADD / LDADDA / LDADDL / LDADDAL
+    SWP,        // SWP / SWPA / SWPL / SWPAL
+    CAS,        // CAS / CASA / CASL / CASAL
+
+    // System instructions
+    MSR,        // MSR <sysreg>, Xt (imm = SYSREG_* key)
+    MRS,        // MRS Xt, <sysreg>
+    TLBI,       // TLBI VMALLE1 / VMALLE1IS
+    HINT,       // NOP, YIELD, ... (imm = CRm:op2); #0x60 / #0x61 mark the ROI
     
     // SUB_IMM,
     // SUB_REG,
     B_COND,
     
-    UNKNOWN
+    UNKNOWN,
+
+    // Decoded-instruction cache only
+    NOT_DECODED,    // slot never filled
+    BREAKPOINT,     // patched by the debugger
+    FUSED_ALU_BCOND,    // flag-setting ALU op + B.cond, see fuse_pair()
+    FUSED_MOVZ_STUR     // MOVZ + STUR
 } InstructionType;
 
+// MSR/MRS system registers: op0:op1:CRn:CRm:op2, bits [19:5] of the word
+#define SYSREG_SCTLR_EL1    0x4080
+#define SYSREG_TTBR0_EL1    0x4100
+#define SYSREG_CNTFRQ_EL0   0x5F00      // read-only: GUEST_CLOCK_HZ
+#define SYSREG_CNTVCT_EL0   0x5F02      // read-only: cycles
+#define SYSREG_PMCCNTR_EL0  0x5CE8      // read-only: cycles
+#define SYSREG_PMEVCNTR0_EL0 0x5F40     // read-only: instructions retired
+
+// Nominal clock of the guest core. The generic timer runs at the same rate,
+// so CNTVCT_EL0 and PMCCNTR_EL0 read the same cycle count.
+#define GUEST_CLOCK_HZ      1000000000
+
 typedef struct {
     InstructionType type;  // Instruction type
     uint32_t instruction;  // Original instruction
@@ -60,6 +92,8 @@ typedef struct {
 
     int cond;             // For branch conditions (EQ=0, NE=1, etc.)
 
+    InstructionType op;   // Fused pairs: type of the first instruction
+
 } DecodedInstruction;
 
 
@@ -71,7 +105,19 @@ typedef struct {
 } InstructionPattern;
 
 
+// Decoded form of every word of one guest page
+typedef struct DecodedPage {
+    DecodedInstruction insn[MEM_PAGE_SIZE / 4];
+} DecodedPage;
+
+
 DecodedInstruction decode_instruction(uint32_t instruction);
+DecodedInstruction* decode_slot(uint64_t pc);
+const DecodedInstruction* decode_cached(uint64_t pc, uint32_t instruction);
+void decode_unfuse(uint64_t pc);
+void decode_invalidate(uint64_t address, uint64_t len);
+const char* instruction_name(uint32_t instruction);
+const char* type_name(InstructionType type);
 void extract_immediate_fields(uint32_t instruction, DecodedInstruction* d);
 void extract_register_fields(uint32_t instruction, DecodedInstruction* d);
 void extract_movz_fields(uint32_t instruction, DecodedInstruction* d);
@@ -81,6 +127,7 @@ void extract_bcond_fields(uint32_t instruction, DecodedInstruction* d);
 void extract_b_fields(uint32_t instruction, DecodedInstruction* d);
 void extract_cb_fields(uint32_t instruction, DecodedInstruction* d);
 void extract_br_fields(uint32_t instruction, DecodedInstruction* d);
+void extract_sysreg_fields(uint32_t instruction, DecodedInstruction* d);
 
 
 #endif
\ No newline at end of file
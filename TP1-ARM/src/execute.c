@@ -1,6 +1,12 @@
 #include "execute.h"
+#include "memprof.h"
+#include "mmu.h"
+#include "roi.h"
+#include "scheduler.h"
 #include "shell.h"
+#include "timing.h"
 #include "utils.h"
+#include <pthread.h>
 #include <stdio.h>
 
 // Function to update flags based on the result of an operation
@@ -19,81 +25,82 @@ void update_flags(int64_t result, int updateFlags) {
 // There is some repeted code, but for testing, debugging and readability, I think is better to have it like this
 
 void adds_imm(DecodedInstruction d) {
-    printf("Executing ADDS_IMM\n");
+    trace("Executing ADDS_IMM\n");
     int64_t result = CURRENT_STATE.REGS[d.rn] + d.imm;
     NEXT_STATE.REGS[d.rd] = result;
     update_flags(result, 1);
 }
 
 void adds_reg(DecodedInstruction d) {
-    printf("Executing ADDS_REG\n");
+    trace("Executing ADDS_REG\n");
     int64_t result = CURRENT_STATE.REGS[d.rn] + CURRENT_STATE.REGS[d.rm];
     NEXT_STATE.REGS[d.rd] = result;
     update_flags(result, 1);
 }
 
 void subs_imm(DecodedInstruction d) {
-    printf("Executing SUBS_IMM\n");
+    trace("Executing SUBS_IMM\n");
     int64_t result = CURRENT_STATE.REGS[d.rn] - d.imm;
     NEXT_STATE.REGS[d.rd] = result;
     update_flags(result, 1);
 }
 
 void subs_reg(DecodedInstruction d) {
-    printf("Executing SUBS_REG\n");
+    trace("Executing SUBS_REG\n");
     int64_t result = CURRENT_STATE.REGS[d.rn] - CURRENT_STATE.REGS[d.rm];
     NEXT_STATE.REGS[d.rd] = result;
     update_flags(result, 1);
 }
 
 void hlt() {
-    printf("Executing HLT\n");
+    trace("Executing HLT\n");
     RUN_BIT = 0;
 }
 
 void cmp_imm(DecodedInstruction d) {
-    printf("Executing CMP_IMM\n");
+    trace("Executing CMP_IMM\n");
     int64_t result = CURRENT_STATE.REGS[d.rn] - d.imm;
     update_flags(result, 1);
 }
 
 void cmp_reg(DecodedInstruction d) {
-    printf("Executing CMP_REG\n");
+    trace("Executing CMP_REG\n");
     int64_t result = CURRENT_STATE.REGS[d.rn] - CURRENT_STATE.REGS[d.rm];
     update_flags(result, 1);
 }
 
 void ands_reg(DecodedInstruction d) {
-    printf("Executing ANDS_REG\n");
+    trace("Executing ANDS_REG\n");
     int64_t result = CURRENT_STATE.REGS[d.rn] & CURRENT_STATE.REGS[d.rm];
     NEXT_STATE.REGS[d.rd] = result;
     update_flags(result, 1);
 }
 
 void eor_reg(DecodedInstruction d) {
-    printf("Executing EOR_REG\n");
+    trace("Executing EOR_REG\n");
     int64_t result = CURRENT_STATE.REGS[d.rn] ^ CURRENT_STATE.REGS[d.rm];
     NEXT_STATE.REGS[d.rd] = result;
     update_flags(result, 0);
 }
 
 void orr_reg(DecodedInstruction d) {
-    printf("Executing ORR_REG\n");
+    trace("Executing ORR_REG\n");
     int64_t result = CURRENT_STATE.REGS[d.rn] | CURRENT_STATE.REGS[d.rm];
     NEXT_STATE.REGS[d.rd] = result;
     update_flags(result, 0);
 }
 
 void movz(DecodedInstruction d) {
-    printf("Executing MOVZ\n");
+    trace("Executing MOVZ\n");
     NEXT_STATE.REGS[d.rd] = d.imm;
 }
 
 void stur(DecodedInstruction d) {
-    printf("Executing STUR\n");
+    trace("Executing STUR\n");
     //stur X1, [X2, #0x10] (descripción: M[X2 + 0x10] = X1)
     
     uint64_t address = CURRENT_STATE.REGS[d.rn] + d.imm;
+    if (MEMPROF) memprof_access(CURRENT_STATE.PC, address, 8, 1);
     
     // Store full 64-bit value from Xn to memory
     // Since mem_write_32 only writes 32 bits at a time, we need two operations
@@ -106,14 +113,15 @@ void stur(DecodedInstruction d) {
     uint32_t upper_word = (uint32_t)((CURRENT_STATE.REGS[d.rd] >> 32) & 0xFFFFFFFF);
     mem_write_32(address + 4, upper_word);
     
-    printf("Stored 0x%lx at address 0x%lx\n", CURRENT_STATE.REGS[d.rd], address);
+    trace("Stored 0x%lx at address 0x%lx\n", CURRENT_STATE.REGS[d.rd], address);
 }
 
 
 void sturh(DecodedInstruction d) {
-    printf("Executing STURH\n");
+    trace("Executing STURH\n");
     
     uint64_t address = CURRENT_STATE.REGS[d.rn] + d.imm;
+    if (MEMPROF) memprof_access(CURRENT_STATE.PC, address, 2, 1);
     
     uint32_t current_value = mem_read_32(address);
     
@@ -130,13 +138,14 @@ void sturh(DecodedInstruction d) {
     
     mem_write_32(address & ~0x3, new_value);
     
-    printf("Stored halfword 0x%x at address 0x%lx\n", halfword_to_store, address);
+    trace("Stored halfword 0x%x at address 0x%lx\n", halfword_to_store, address);
 }
 
 void sturb(DecodedInstruction d) {
-    printf("Executing STURB\n");
+    trace("Executing STURB\n");
     
     uint64_t address = CURRENT_STATE.REGS[d.rn] + d.imm;
+    if (MEMPROF) memprof_access(CURRENT_STATE.PC, address, 1, 1);
     
     uint32_t current_value = mem_read_32(address);
     
@@ -153,23 +162,23 @@ void sturb(DecodedInstruction d) {
     
     mem_write_32(address & ~0x3, new_value);
     
-    printf("Stored byte 0x%x at address 0x%lx\n", byte_to_store, address);
+    trace("Stored byte 0x%x at address 0x%lx\n", byte_to_store, address);
 }
 
 void lsl_imm(DecodedInstruction d) {
-    printf("Executing LSL_IMM\n");
+    trace("Executing LSL_IMM\n");
     
     int shift_amount = d.imm;
     
     int64_t result = CURRENT_STATE.REGS[d.rn] << shift_amount;
     NEXT_STATE.REGS[d.rd] = result;
     
-    printf("X%d = X%d << %d = 0x%lx\n", d.rd, d.rn, shift_amount, result);
+    trace("X%d = X%d << %d = 0x%lx\n", d.rd, d.rn, shift_amount, result);
 }
 
 
 void lsr_imm(DecodedInstruction d) {
-    printf("Executing LSR_IMM\n");
+    trace("Executing LSR_IMM\n");
     
     int shift_amount = d.imm;
     
@@ -177,14 +186,15 @@ void lsr_imm(DecodedInstruction d) {
     uint64_t result = unsigned_value >> shift_amount;
     
     NEXT_STATE.REGS[d.rd] = (int64_t)result;
-    printf("X%d = X%d >> %d = 0x%lx\n", d.rd, d.rn, shift_amount, (int64_t)result);
+    trace("X%d = X%d >> %d = 0x%lx\n", d.rd, d.rn, shift_amount, (int64_t)result);
 }
 
 
 void ldur(DecodedInstruction d) {
-    printf("Executing LDUR\n");
+    trace("Executing LDUR\n");
     
     uint64_t address = CURRENT_STATE.REGS[d.rn] + d.imm;
+    if (MEMPROF) memprof_access(CURRENT_STATE.PC, address, 8, 0);
     
     // Load 64-bit value from memory (two 32-bit reads)
     uint32_t lower_word = mem_read_32(address);
@@ -195,14 +205,15 @@ void ldur(DecodedInstruction d) {
     
     NEXT_STATE.REGS[d.rd] = result;
     
-    printf("X%d = Memory[0x%lx] = 0x%lx\n", d.rd, address, result);
+    trace("X%d = Memory[0x%lx] = 0x%lx\n", d.rd, address, result);
 }
 
 void ldurh(DecodedInstruction d) {
-    printf("Executing LDURH\n");
+    trace("Executing LDURH\n");
     
     // Calculate memory address
     uint64_t address = CURRENT_STATE.REGS[d.rn] + d.imm;
+    if (MEMPROF) memprof_access(CURRENT_STATE.PC, address, 2, 0);
     
     // Read the 32-bit word containing our halfword
     uint32_t word = mem_read_32(address & ~0x3);
@@ -219,13 +230,14 @@ void ldurh(DecodedInstruction d) {
     // Store in destination register
     NEXT_STATE.REGS[d.rd] = result;
     
-    printf("X%d = Zero-extend(Memory[0x%lx](15:0)) = 0x%lx\n", d.rd, address, result);
+    trace("X%d = Zero-extend(Memory[0x%lx](15:0)) = 0x%lx\n", d.rd, address, result);
 }
 
 void ldurb(DecodedInstruction d) {
-    printf("Executing LDURB\n");
+    trace("Executing LDURB\n");
     
     uint64_t address = CURRENT_STATE.REGS[d.rn] + d.imm;
+    if (MEMPROF) memprof_access(CURRENT_STATE.PC, address, 1, 0);
     
     uint32_t word = mem_read_32(address & ~0x3);
     
@@ -238,26 +250,26 @@ void ldurb(DecodedInstruction d) {
     
     NEXT_STATE.REGS[d.rd] = result;
     
-    printf("X%d = Zero-extend(Memory[0x%lx](7:0)) = 0x%lx\n", d.rd, address, result);
+    trace("X%d = Zero-extend(Memory[0x%lx](7:0)) = 0x%lx\n", d.rd, address, result);
 }
 
 
 void add_imm(DecodedInstruction d) {
-    printf("Executing ADD_IMM\n");
+    trace("Executing ADD_IMM\n");
     int64_t result = CURRENT_STATE.REGS[d.rn] + d.imm;
     NEXT_STATE.REGS[d.rd] = result;
     update_flags(result, 0);
 }
 
 void add_reg(DecodedInstruction d) {
-    printf("Executing ADD_REG\n");
+    trace("Executing ADD_REG\n");
     int64_t result = CURRENT_STATE.REGS[d.rn] + CURRENT_STATE.REGS[d.rm];
     NEXT_STATE.REGS[d.rd] = result;
     update_flags(result, 0);
 }
 
 void beq(DecodedInstruction d) {
-    printf("Executing BEQ\n");
+    trace("Executing BEQ\n");
     // Branch if Z == 1
     if (CURRENT_STATE.FLAG_Z == 1) {
         NEXT_STATE.PC = CURRENT_STATE.PC + d.imm;
@@ -265,7 +277,7 @@ void beq(DecodedInstruction d) {
 }
 
 void bne(DecodedInstruction d) {
-    printf("Executing BNE\n");
+    trace("Executing BNE\n");
     // Branch if Z == 0
     if (CURRENT_STATE.FLAG_Z == 0) {
         NEXT_STATE.PC = CURRENT_STATE.PC + d.imm;
@@ -273,7 +285,7 @@ void bne(DecodedInstruction d) {
 }
 
 void bgt(DecodedInstruction d) {
-    printf("Executing BGT\n");
+    trace("Executing BGT\n");
     // Branch if (Z == 0 && N == 0) (with C=V=0)
     if (CURRENT_STATE.FLAG_Z == 0 && CURRENT_STATE.FLAG_N == 0) {
         NEXT_STATE.PC = CURRENT_STATE.PC + d.imm;
@@ -281,7 +293,7 @@ void bgt(DecodedInstruction d) {
 }
 
 void blt(DecodedInstruction d) {
-    printf("Executing BLT\n");
+    trace("Executing BLT\n");
     // Branch if N == 1
     if (CURRENT_STATE.FLAG_N == 1) {
         NEXT_STATE.PC = CURRENT_STATE.PC + d.imm;
@@ -289,7 +301,7 @@ void blt(DecodedInstruction d) {
 }
 
 void bge(DecodedInstruction d) {
-    printf("Executing BGE\n");
+    trace("Executing BGE\n");
     // Branch if N == 0
     if (CURRENT_STATE.FLAG_N == 0) {
         NEXT_STATE.PC = CURRENT_STATE.PC + d.imm;
@@ -297,7 +309,7 @@ void bge(DecodedInstruction d) {
 }
 
 void ble(DecodedInstruction d) {
-    printf("Executing BLE\n");
+    trace("Executing BLE\n");
     // Branch if Z == 1 || N == 1
     if (CURRENT_STATE.FLAG_Z == 1 || CURRENT_STATE.FLAG_N == 1) {
         NEXT_STATE.PC = CURRENT_STATE.PC + d.imm;
@@ -305,50 +317,294 @@ void ble(DecodedInstruction d) {
 }
 
 void b(DecodedInstruction d) {
-    printf("Executing B\n");
+    trace("Executing B\n");
     
     NEXT_STATE.PC = CURRENT_STATE.PC + d.imm;
     
-    printf("Branching to PC + %ld = 0x%lx\n", d.imm, NEXT_STATE.PC);
+    trace("Branching to PC + %ld = 0x%lx\n", d.imm, NEXT_STATE.PC);
 }
 
 void br(DecodedInstruction d) {
-    printf("Executing BR\n");
+    trace("Executing BR\n");
     
     NEXT_STATE.PC = CURRENT_STATE.REGS[d.rn];
     
-    printf("Branching to address in X%d = 0x%lx\n", d.rn, NEXT_STATE.PC);
+    trace("Branching to address in X%d = 0x%lx\n", d.rn, NEXT_STATE.PC);
 }
 
 void mul(DecodedInstruction d) {
-    printf("Executing MUL\n");
+    trace("Executing MUL\n");
     
     int64_t result = CURRENT_STATE.REGS[d.rn] * CURRENT_STATE.REGS[d.rm];
     
     NEXT_STATE.REGS[d.rd] = result;
     
-    printf("X%d = X%d * X%d = %ld\n", d.rd, d.rn, d.rm, result);
+    trace("X%d = X%d * X%d = %ld\n", d.rd, d.rn, d.rm, result);
 }
 
 void cbz(DecodedInstruction d) {
-    printf("Executing CBZ\n");
+    trace("Executing CBZ\n");
 
     if (CURRENT_STATE.REGS[d.rd] == 0) {
         NEXT_STATE.PC = CURRENT_STATE.PC + d.imm;
-        printf("X%d is zero, branching to PC + %ld = 0x%lx\n", d.rd, d.imm, NEXT_STATE.PC);
+        trace("X%d is zero, branching to PC + %ld = 0x%lx\n", d.rd, d.imm, NEXT_STATE.PC);
     } else {
-        printf("X%d is not zero (%ld), not branching\n", d.rd, CURRENT_STATE.REGS[d.rd]);
+        trace("X%d is not zero (%ld), not branching\n", d.rd, CURRENT_STATE.REGS[d.rd]);
     }
 }
 
 void cbnz(DecodedInstruction d) {
-    printf("Executing CBNZ\n");
+    trace("Executing CBNZ\n");
     
     if (CURRENT_STATE.REGS[d.rd] != 0) {
         NEXT_STATE.PC = CURRENT_STATE.PC + d.imm;
-        printf("X%d is not zero (%ld), branching to PC + %ld = 0x%lx\n", 
+        trace("X%d is not zero (%ld), branching to PC + %ld = 0x%lx\n", 
                d.rd, CURRENT_STATE.REGS[d.rd], d.imm, NEXT_STATE.PC);
     } else {
-        printf("X%d is zero, not branching\n", d.rd);
+        trace("X%d is zero, not branching\n", d.rd);
     }
-}
\ No newline at end of file
+}
+
+// Exclusive and atomic memory operations
+// They map onto host atomics on the shared guest memory, so cores running on
+// different threads (see smp.c) see them as indivisible. Pages the fast path
+// can't use (watched, code, protected) are accessed through mem_read_32 /
+// mem_write_32 under atomic_lock instead. Every access is sequentially
+// consistent, which covers the acquire/release variants.
+//
+// The exclusive monitor remembers the value LDXR read: STXR stores only if
+// memory still holds it. A store from another core that changes the value
+// makes the STXR fail like on hardware; one that writes back the same value
+// goes unnoticed.
+
+static __thread struct {
+    int valid;
+    uint64_t address;
+    uint64_t value;
+} monitor;
+
+static pthread_mutex_t atomic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum { RMW_ADD, RMW_SWP, RMW_CAS };
+
+// Unaligned exclusive or atomic accesses fault, like on hardware
+static int atomic_address(DecodedInstruction d, uint64_t* address) {
+    *address = CURRENT_STATE.REGS[d.rn];
+    if (*address & 7) {
+        printf("Alignment fault: atomic access of 0x%" PRIx64 " (PC 0x%" PRIx64 ")\n",
+               *address, CURRENT_STATE.PC);
+        RUN_BIT = FALSE;
+        return 0;
+    }
+    return 1;
+}
+
+static uint64_t read_64(uint64_t address) {
+    return (uint64_t)mem_read_32(address + 4) << 32 | mem_read_32(address);
+}
+
+// Adds OPERAND to, swaps it into, or compares memory with EXPECTED and then
+// stores OPERAND. Returns the old value.
+static uint64_t atomic_rmw(uint64_t address, int op, uint64_t operand, uint64_t expected) {
+    uint64_t* p = mem_atomic_64(address);
+    uint64_t old;
+
+    if (p != NULL) {
+        switch (op) {
+            case RMW_ADD: return __atomic_fetch_add(p, operand, __ATOMIC_SEQ_CST);
+            case RMW_SWP: return __atomic_exchange_n(p, operand, __ATOMIC_SEQ_CST);
+            default:
+                old = expected;
+                __atomic_compare_exchange_n(p, &old, operand, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                return old;
+        }
+    }
+
+    pthread_mutex_lock(&atomic_lock);
+    old = read_64(address);
+    if (RUN_BIT != FALSE && (op != RMW_CAS || old == expected)) {
+        uint64_t value = op == RMW_ADD ? old + operand : operand;
+        mem_write_32(address, (uint32_t)value);
+        mem_write_32(address + 4, (uint32_t)(value >> 32));
+    }
+    pthread_mutex_unlock(&atomic_lock);
+    return old;
+}
+
+void ldxr(DecodedInstruction d) {
+    trace("Executing LDXR\n");
+    uint64_t address, value;
+    if (!atomic_address(d, &address)) return;
+
+    uint64_t* p = mem_atomic_64(address);
+    if (p != NULL) {
+        value = __atomic_load_n(p, __ATOMIC_SEQ_CST);
+    } else {
+        pthread_mutex_lock(&atomic_lock);
+        value = read_64(address);
+        pthread_mutex_unlock(&atomic_lock);
+    }
+    monitor.valid = 1;
+    monitor.address = address;
+    monitor.value = value;
+    NEXT_STATE.REGS[d.rd] = value;
+
+    trace("X%d = Memory[0x%lx] = 0x%lx, exclusive\n", d.rd, address, value);
+}
+
+void stxr(DecodedInstruction d) {
+    trace("Executing STXR\n");
+    uint64_t address;
+    int failed = 1;
+    if (!atomic_address(d, &address)) return;
+
+    if (monitor.valid && monitor.address == address)
+        failed = atomic_rmw(address, RMW_CAS, CURRENT_STATE.REGS[d.rd], monitor.value) != monitor.value;
+    monitor.valid = 0;
+    NEXT_STATE.REGS[d.rm] = failed;
+
+    trace("Exclusive store of 0x%lx at 0x%lx %s\n", CURRENT_STATE.REGS[d.rd], address,
+          failed ? "failed" : "succeeded");
+}
+
+void ldadd(DecodedInstruction d) {
+    trace("Executing LDADD\n");
+    uint64_t address;
+    if (!atomic_address(d, &address)) return;
+    NEXT_STATE.REGS[d.rd] = atomic_rmw(address, RMW_ADD, CURRENT_STATE.REGS[d.rm], 0);
+}
+
+void swp(DecodedInstruction d) {
+    trace("Executing SWP\n");
+    uint64_t address;
+    if (!atomic_address(d, &address)) return;
+    NEXT_STATE.REGS[d.rd] = atomic_rmw(address, RMW_SWP, CURRENT_STATE.REGS[d.rm], 0);
+}
+
+// CAS Xs, Xt, [Xn]: Xs is compared and gets the old value, Xt is stored
+void cas(DecodedInstruction d) {
+    trace("Executing CAS\n");
+    uint64_t address;
+    if (!atomic_address(d, &address)) return;
+    NEXT_STATE.REGS[d.rm] = atomic_rmw(address, RMW_CAS, CURRENT_STATE.REGS[d.rd], CURRENT_STATE.REGS[d.rm]);
+}
+
+// System registers
+// Only the MMU registers exist; writes to the others are ignored and they
+// read as zero.
+
+void msr(DecodedInstruction d) {
+    trace("Executing MSR\n");
+    mmu_write_sysreg((int)d.imm, CURRENT_STATE.REGS[d.rd]);
+}
+
+// Counters seen by MRS: while the timing model runs the program the cycles
+// are its own, otherwise every instruction takes one. The instruction
+// counter excludes the MRS reading it. Writes to them are ignored.
+void mrs(DecodedInstruction d) {
+    trace("Executing MRS\n");
+    uint64_t value;
+
+    switch ((int)d.imm) {
+        case SYSREG_CNTFRQ_EL0:
+            value = GUEST_CLOCK_HZ;
+            break;
+        case SYSREG_CNTVCT_EL0:
+        case SYSREG_PMCCNTR_EL0:
+            value = TIMING_ACTIVE ? timing_cycles() : (uint64_t)INSTRUCTION_COUNT;
+            break;
+        case SYSREG_PMEVCNTR0_EL0:
+            value = (uint64_t)INSTRUCTION_COUNT;
+            break;
+        default:
+            value = mmu_read_sysreg((int)d.imm);    // 0 for the unknown ones
+            break;
+    }
+    NEXT_STATE.REGS[d.rd] = value;
+}
+
+// Hints are NOPs, except the ROI markers and YIELD under --sched
+void hint(DecodedInstruction d) {
+    trace("Executing HINT #0x%x\n", (unsigned)d.imm);
+    if (d.imm == ROI_BEGIN_HINT || d.imm == ROI_END_HINT)
+        roi_marker((int)d.imm);
+    else if (d.imm == SCHED_YIELD_HINT && SCHED_RUNNING)
+        INSTRUCTION_LIMIT = INSTRUCTION_COUNT + 1;  // cycle() counts the YIELD
+}
+
+void tlbi(void) {
+    trace("Executing TLBI\n");
+    mmu_flush_all();
+}
+
+// Fused pairs (see fuse_pair() in decode.c)
+// Both instructions run as one step and count as two. The pair is split when
+// it would run past INSTRUCTION_LIMIT, or when the second slot was
+// invalidated by a store since the pair was fused.
+
+static const DecodedInstruction* fused_partner(InstructionType expected_type) {
+    const DecodedInstruction* next = decode_slot(CURRENT_STATE.PC + 4);
+    if (INSTRUCTION_LIMIT - INSTRUCTION_COUNT < 2)
+        return NULL;
+    if (expected_type == B_COND ? next->type < BEQ || next->type > BLE : next->type != expected_type)
+        return NULL;
+    return next;
+}
+
+// Compare and branch together: the condition is taken from the result
+// directly. N/Z are still written, they are architectural state.
+void fused_alu_bcond(DecodedInstruction d) {
+    const DecodedInstruction* br = fused_partner(B_COND);
+    if (br == NULL) {
+        d.type = d.op;
+        execute_instruction(&d);
+        return;
+    }
+
+    int64_t a = CURRENT_STATE.REGS[d.rn];
+    int64_t result;
+    switch (d.op) {
+        case ADDS_IMM: result = a + d.imm; break;
+        case ADDS_REG: result = a + CURRENT_STATE.REGS[d.rm]; break;
+        case SUBS_IMM: case CMP_IMM: result = a - d.imm; break;
+        case ANDS_REG: result = a & CURRENT_STATE.REGS[d.rm]; break;
+        default: result = a - CURRENT_STATE.REGS[d.rm]; break;     // SUBS_REG, CMP_REG
+    }
+    if (d.op != CMP_IMM && d.op != CMP_REG)
+        NEXT_STATE.REGS[d.rd] = result;
+    NEXT_STATE.FLAG_Z = (result == 0);
+    NEXT_STATE.FLAG_N = (result < 0);
+
+    int taken;
+    switch (br->type) {
+        case BEQ: taken = result == 0; break;
+        case BNE: taken = result != 0; break;
+        case BGT: taken = result > 0; break;
+        case BLT: taken = result < 0; break;
+        case BGE: taken = result >= 0; break;
+        default:  taken = result <= 0; break;     // BLE
+    }
+    NEXT_STATE.PC = CURRENT_STATE.PC + 4 + (taken ? br->imm : 4);
+    INSTRUCTION_COUNT++;
+}
+
+// The store sees the value MOVZ just wrote, as data or as base address
+void fused_movz_stur(DecodedInstruction d) {
+    const DecodedInstruction* st = fused_partner(STUR);
+    if (st == NULL) {
+        d.type = d.op;
+        execute_instruction(&d);
+        return;
+    }
+
+    NEXT_STATE.REGS[d.rd] = d.imm;
+    uint64_t base = st->rn == d.rd ? (uint64_t)d.imm : (uint64_t)CURRENT_STATE.REGS[st->rn];
+    uint64_t value = st->rd == d.rd ? (uint64_t)d.imm : (uint64_t)CURRENT_STATE.REGS[st->rd];
+    uint64_t address = base + st->imm;
+    if (MEMPROF) memprof_access(CURRENT_STATE.PC + 4, address, 8, 1);
+    mem_write_32(address, (uint32_t)value);
+    mem_write_32(address + 4, (uint32_t)(value >> 32));
+
+    NEXT_STATE.PC = CURRENT_STATE.PC + 8;
+    INSTRUCTION_COUNT++;
+}
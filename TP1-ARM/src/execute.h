@@ -3,6 +3,8 @@
 
 #include "decode.h"
 
+void execute_instruction(const DecodedInstruction* d);
+
 void adds_imm(DecodedInstruction d);
 void adds_reg(DecodedInstruction d);
 void subs_imm(DecodedInstruction d);
@@ -35,6 +37,17 @@ void br(DecodedInstruction d);
 void mul(DecodedInstruction d);
 void cbz(DecodedInstruction d);
 void cbnz(DecodedInstruction d);
+void ldxr(DecodedInstruction d);
+void stxr(DecodedInstruction d);
+void ldadd(DecodedInstruction d);
+void swp(DecodedInstruction d);
+void cas(DecodedInstruction d);
+void msr(DecodedInstruction d);
+void mrs(DecodedInstruction d);
+void hint(DecodedInstruction d);
+void tlbi(void);
+void fused_alu_bcond(DecodedInstruction d);
+void fused_movz_stur(DecodedInstruction d);
 
 void update_flags(int64_t result, int updateFlags);
 
@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+#include "gdbstub.h"
+#include "debug.h"
+#include "shell.h"
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// GDB remote serial protocol stub.
+//
+// gdb sees an aarch64 target with the core registers only: x0-x30, sp, pc and
+// cpsr (described by target.xml). This simulator has no stack pointer, so sp
+// reads as zero. Breakpoints and watchpoints are the shell's (debug.c), so they
+// cost nothing between stops. "continue" runs the same loop as `go` and only
+// looks at the socket every GDB_POLL_INTERVAL instructions, to notice a Ctrl-C.
+//
+// Supported packets: ? g G p P m M c s Z0-Z4 z0-z4 qSupported
+// qXfer:features:read H k D. Anything else gets the empty "unsupported" reply.
+
+#define GDB_PACKET_SIZE   0x4000
+#define GDB_POLL_INTERVAL (1 << 16)
+
+#define GDB_REG_SP   31
+#define GDB_REG_PC   32
+#define GDB_REG_CPSR 33
+#define GDB_NUM_REGS 34
+
+static int gdb_fd = -1;
+static unsigned char in_buf[4096];
+static size_t in_len, in_pos;
+
+static int gdb_getc(void) {
+    if (in_pos == in_len) {
+        ssize_t n = read(gdb_fd, in_buf, sizeof(in_buf));
+        if (n < 0 && errno == EINTR) return gdb_getc();
+        if (n <= 0) return -1;
+        in_len = n;
+        in_pos = 0;
+    }
+    return in_buf[in_pos++];
+}
+
+// True if gdb sent a Ctrl-C (0x03) while the program was running. Any other
+// byte is left in in_buf for recv_packet().
+static int interrupt_pending(void) {
+    struct pollfd p = { gdb_fd, POLLIN, 0 };
+
+    if (in_pos == in_len) {
+        if (poll(&p, 1, 0) <= 0) return FALSE;
+        if (gdb_getc() < 0) return TRUE;
+        in_pos--;
+    }
+    if (in_buf[in_pos] != 0x03) return FALSE;
+    in_pos++;
+    return TRUE;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Appends SIZE bytes of VALUE, in target (little-endian) order
+static char* put_le(char* out, uint64_t value, int size) {
+    for (int i = 0; i < size; i++, value >>= 8) {
+        *out++ = hex_digits[(value >> 4) & 0xF];
+        *out++ = hex_digits[value & 0xF];
+    }
+    *out = '\0';
+    return out;
+}
+
+static uint64_t get_le(const char** in, int size) {
+    uint64_t value = 0;
+    for (int i = 0; i < size && hex_value((*in)[0]) >= 0 && hex_value((*in)[1]) >= 0; i++) {
+        value |= (uint64_t)(hex_value((*in)[0]) << 4 | hex_value((*in)[1])) << (8 * i);
+        *in += 2;
+    }
+    return value;
+}
+
+static int send_packet(const char* data) {
+    char trailer[4];
+    unsigned char sum = 0;
+    size_t len = strlen(data);
+
+    for (size_t i = 0; i < len; i++) sum += (unsigned char)data[i];
+    snprintf(trailer, sizeof(trailer), "#%02x", sum);
+
+    for (;;) {
+        if (write(gdb_fd, "$", 1) != 1 || write(gdb_fd, data, len) != (ssize_t)len ||
+            write(gdb_fd, trailer, 3) != 3) {
+            return -1;
+        }
+        int c = gdb_getc();
+        if (c == '+') return 0;
+        if (c != '-') return -1;
+    }
+}
+
+// Reads one packet into BUF (NUL-terminated); -1 when gdb goes away
+static int recv_packet(char* buf, size_t size) {
+    for (;;) {
+        int c;
+        size_t len = 0;
+
+        while ((c = gdb_getc()) != '$') {
+            if (c < 0) return -1;
+        }
+        unsigned char sum = 0;
+        while ((c = gdb_getc()) != '#') {
+            if (c < 0) return -1;
+            if (len < size - 1) buf[len++] = c;
+            sum += c;
+        }
+        int hi = hex_value(gdb_getc());
+        int lo = hex_value(gdb_getc());
+        buf[len] = '\0';
+        if (hi >= 0 && lo >= 0 && (hi << 4 | lo) == sum && len < size - 1) {
+            return write(gdb_fd, "+", 1) == 1 ? (int)len : -1;
+        }
+        if (write(gdb_fd, "-", 1) != 1) return -1;
+    }
+}
+
+static const char* target_xml(void) {
+    static char xml[4096];
+    char* p = xml;
+
+    if (xml[0] != '\0') return xml;
+    p += sprintf(p, "<?xml version=\"1.0\"?>\n<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+                    "<target version=\"1.0\">\n<architecture>aarch64</architecture>\n"
+                    "<feature name=\"org.gnu.gdb.aarch64.core\">\n");
+    for (int k = 0; k < 31; k++) {
+        p += sprintf(p, "<reg name=\"x%d\" bitsize=\"64\" type=\"int\"/>\n", k);
+    }
+    p += sprintf(p, "<reg name=\"sp\" bitsize=\"64\" type=\"data_ptr\"/>\n"
+                    "<reg name=\"pc\" bitsize=\"64\" type=\"code_ptr\"/>\n"
+                    "<reg name=\"cpsr\" bitsize=\"32\" type=\"int\"/>\n"
+                    "</feature>\n</target>\n");
+    return xml;
+}
+
+static int reg_size(int n) {
+    return n == GDB_REG_CPSR ? 4 : 8;
+}
+
+static uint64_t reg_get(int n) {
+    if (n < GDB_REG_SP) return CURRENT_STATE.REGS[n];
+    if (n == GDB_REG_PC) return CURRENT_STATE.PC;
+    if (n == GDB_REG_CPSR)
+        return (uint64_t)(CURRENT_STATE.FLAG_N != 0) << 31 | (uint64_t)(CURRENT_STATE.FLAG_Z != 0) << 30;
+    return 0;
+}
+
+static void reg_set(int n, uint64_t value) {
+    if (n < GDB_REG_SP) {
+        CURRENT_STATE.REGS[n] = value;
+    } else if (n == GDB_REG_PC) {
+        CURRENT_STATE.PC = value;
+    } else if (n == GDB_REG_CPSR) {
+        CURRENT_STATE.FLAG_N = (value >> 31) & 1;
+        CURRENT_STATE.FLAG_Z = (value >> 30) & 1;
+    }
+    NEXT_STATE = CURRENT_STATE;
+}
+
+// T05 with the reason gdb wants for breakpoints and watchpoints
+static void stop_reply(char* out, int interrupted) {
+    static const char* const watch_kind[] = { "", "r", "", "a" };
+    uint64_t address;
+
+    if (RUN_BIT == FALSE) {
+        strcpy(out, "W00");
+    } else if (RUN_BIT == STOPPED) {
+        int access = debug_stop_reason(&address);
+        if (access == 0)
+            strcpy(out, "T05swbreak:;");
+        else
+            sprintf(out, "T05%swatch:%" PRIx64 ";", watch_kind[access], address);
+        RUN_BIT = TRUE;
+    } else {
+        strcpy(out, interrupted ? "T02" : "T05");
+    }
+}
+
+static void resume(const char* args, int step, char* out) {
+    int interrupted = FALSE;
+
+    if (*args != '\0') reg_set(GDB_REG_PC, strtoull(args, NULL, 16));
+
+    // gdb never expects to stop at the breakpoint it resumes from
+    debug_step_over();
+    if (step) {
+        INSTRUCTION_LIMIT = INSTRUCTION_COUNT + 1;
+        if (RUN_BIT == TRUE) cycle();
+        INSTRUCTION_LIMIT = INT_MAX;
+    } else {
+        while (RUN_BIT == TRUE && !interrupted) {
+            for (int n = 0; n < GDB_POLL_INTERVAL && RUN_BIT == TRUE; n++) {
+                cycle();
+            }
+            interrupted = RUN_BIT == TRUE && interrupt_pending();
+        }
+    }
+    stop_reply(out, interrupted);
+}
+
+// Z/z type,addr,kind
+static void breakpoint_packet(const char* args, int insert, char* out) {
+    static const int access[] = { 0, 0, WATCH_WRITE, WATCH_READ, WATCH_READ | WATCH_WRITE };
+    char* end;
+    int type = strtol(args, &end, 16);
+    uint64_t address = strtoull(end + 1, &end, 16);
+    uint64_t kind = strtoull(end + 1, NULL, 16);
+
+    if (type < 0 || type > 4) {
+        out[0] = '\0';
+        return;
+    }
+    int is_watch = type >= 2;
+    int number = debug_find(is_watch, address);
+    if (insert) {
+        if (number == 0) {
+            number = is_watch ? debug_watch(address, kind, access[type]) : debug_break(address, "");
+        }
+        strcpy(out, number > 0 ? "OK" : "E01");
+    } else {
+        if (number > 0) debug_delete(number);
+        strcpy(out, "OK");
+    }
+}
+
+static void query_packet(const char* pkt, char* out) {
+    unsigned long offset, length;
+
+    out[0] = '\0';
+    if (strncmp(pkt, "qSupported", 10) == 0) {
+        sprintf(out, "PacketSize=%x;qXfer:features:read+;swbreak+;hwbreak+", GDB_PACKET_SIZE);
+    } else if (sscanf(pkt, "qXfer:features:read:target.xml:%lx,%lx", &offset, &length) == 2) {
+        const char* xml = target_xml();
+        size_t total = strlen(xml);
+        if (offset >= total) {
+            strcpy(out, "l");
+            return;
+        }
+        if (length > GDB_PACKET_SIZE - 2) length = GDB_PACKET_SIZE - 2;
+        if (length > total - offset) length = total - offset;
+        out[0] = offset + length < total ? 'm' : 'l';
+        memcpy(out + 1, xml + offset, length);
+        out[1 + length] = '\0';
+    } else if (strcmp(pkt, "qAttached") == 0) {
+        strcpy(out, "1");
+    } else if (strcmp(pkt, "qC") == 0) {
+        strcpy(out, "QC1");
+    } else if (strcmp(pkt, "qfThreadInfo") == 0) {
+        strcpy(out, "m1");
+    } else if (strcmp(pkt, "qsThreadInfo") == 0) {
+        strcpy(out, "l");
+    }
+}
+
+// Serves one gdb session; returns when gdb kills or detaches
+static void gdb_session(void) {
+    static char pkt[GDB_PACKET_SIZE + 1], out[2 * GDB_PACKET_SIZE + 16];
+    uint64_t address, length;
+    int n;
+
+    in_len = in_pos = 0;
+    while (recv_packet(pkt, sizeof(pkt)) >= 0) {
+        const char* args = pkt + 1;
+        out[0] = '\0';
+
+        switch (pkt[0]) {
+            case '?':
+                stop_reply(out, FALSE);
+                break;
+            case 'g': {
+                char* p = out;
+                for (int k = 0; k < GDB_NUM_REGS; k++) p = put_le(p, reg_get(k), reg_size(k));
+                break;
+            }
+            case 'G':
+                for (int k = 0; k < GDB_NUM_REGS && *args; k++) reg_set(k, get_le(&args, reg_size(k)));
+                strcpy(out, "OK");
+                break;
+            case 'p':
+                n = strtol(args, NULL, 16);
+                if (n < GDB_NUM_REGS) put_le(out, reg_get(n), reg_size(n));
+                else strcpy(out, "E01");
+                break;
+            case 'P': {
+                char* end;
+                n = strtol(args, &end, 16);
+                if (n >= GDB_NUM_REGS || *end != '=') {
+                    strcpy(out, "E01");
+                    break;
+                }
+                args = end + 1;
+                reg_set(n, get_le(&args, reg_size(n)));
+                strcpy(out, "OK");
+                break;
+            }
+            case 'm': {
+                uint8_t data[GDB_PACKET_SIZE / 2];
+                if (sscanf(args, "%" SCNx64 ",%" SCNx64, &address, &length) != 2 ||
+                    length > sizeof(data) || mem_debug_read(address, data, length) < 0) {
+                    strcpy(out, "E01");
+                    break;
+                }
+                char* p = out;
+                for (uint64_t i = 0; i < length; i++) p = put_le(p, data[i], 1);
+                break;
+            }
+            case 'M': {
+                uint8_t data[GDB_PACKET_SIZE / 2];
+                const char* hex = strchr(args, ':');
+                if (sscanf(args, "%" SCNx64 ",%" SCNx64, &address, &length) != 2 || hex == NULL ||
+                    length > sizeof(data) || strlen(hex + 1) != 2 * length) {
+                    strcpy(out, "E01");
+                    break;
+                }
+                hex++;
+                for (uint64_t i = 0; i < length; i++) data[i] = get_le(&hex, 1);
+                strcpy(out, mem_debug_write(address, data, length) < 0 ? "E01" : "OK");
+                break;
+            }
+            case 'c':
+            case 's':
+                resume(args, pkt[0] == 's', out);
+                break;
+            case 'Z':
+            case 'z':
+                breakpoint_packet(args, pkt[0] == 'Z', out);
+                break;
+            case 'q':
+                query_packet(pkt, out);
+                break;
+            case 'H':
+                strcpy(out, "OK");
+                break;
+            case 'D':
+                send_packet("OK");
+                return;
+            case 'k':
+                return;
+            default:
+                break;
+        }
+        if (send_packet(out) < 0) return;
+    }
+}
+
+// A TCP port on localhost if TARGET is a number, else a Unix socket path
+static int open_listener(const char* target) {
+    int fd, one = 1;
+    char* end;
+    long port = strtol(target, &end, 10);
+
+    if (*target != '\0' && *end == '\0') {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) return -1;
+    } else {
+        struct sockaddr_un addr;
+        if (strlen(target) >= sizeof(addr.sun_path)) return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, target);
+        unlink(target);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) return -1;
+    }
+    return listen(fd, 1) < 0 ? -1 : fd;
+}
+
+int gdb_main(const char* target, const SimOptions* opts) {
+    int one = 1;
+    int listen_fd = open_listener(target);
+
+    if (listen_fd < 0) {
+        perror("Error: can't listen for gdb");
+        return 1;
+    }
+
+    VERBOSE = FALSE;
+    initialize(opts->programs, opts->num_programs);
+
+    fprintf(stderr, "Waiting for gdb on %s\n", target);
+    gdb_fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    if (gdb_fd < 0) {
+        perror("accept");
+        return 1;
+    }
+    setsockopt(gdb_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    gdb_session();
+    close(gdb_fd);
+    if (!isdigit((unsigned char)target[0])) unlink(target);
+    return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+#include "options.h"
+
+// Waits for a gdb connection on TARGET (a TCP port on localhost, or the path
+// of a Unix domain socket) and serves the remote protocol until gdb detaches
+int gdb_main(const char* target, const SimOptions* opts);
+
+#endif
@@ -0,0 +1,157 @@
+#include "hostprof.h"
+#include "shell.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Host self-profiling, see hostprof.h.
+
+typedef struct {
+    uint64_t count;
+    uint64_t ticks;
+} Cost;
+
+int HOSTPROF;
+static int initialized;         // HOSTPROF may be switched off by --roi
+
+static Cost execute_cost[HOSTPROF_TYPES];
+static Cost path_cost[HOSTPROF_PATHS];
+static uint64_t overhead;               // ticks of an empty measurement
+
+// Profiled runs: wall clock and ticks, for the tick rate
+static uint64_t run_ns, run_ticks, run_insns;
+static uint64_t begin_ns, begin_ticks;
+static int begin_count;
+
+static const char* const path_names[HOSTPROF_PATHS] = {
+    "fetch + lookup", "full decode (miss)", "uncached decode", "loop run ahead",
+};
+
+static uint64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void hostprof_init(void) {
+    memset(execute_cost, 0, sizeof(execute_cost));
+    memset(path_cost, 0, sizeof(path_cost));
+    run_ns = run_ticks = run_insns = 0;
+
+    overhead = UINT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t t0 = hostprof_ticks();
+        uint64_t t = hostprof_ticks() - t0;
+        if (t < overhead) overhead = t;
+    }
+    HOSTPROF = 1;
+    initialized = 1;
+}
+
+static void add(Cost* c, uint64_t ticks) {
+    c->count++;
+    c->ticks += ticks > overhead ? ticks - overhead : 0;
+}
+
+void hostprof_execute(InstructionType type, uint64_t ticks) {
+    add(&execute_cost[type], ticks);
+}
+
+void hostprof_path(int path, uint64_t ticks) {
+    add(&path_cost[path], ticks);
+}
+
+void hostprof_run_begin(void) {
+    if (!initialized) return;
+    begin_count = INSTRUCTION_COUNT;
+    begin_ticks = hostprof_ticks();
+    begin_ns = wall_ns();
+}
+
+void hostprof_run_end(FILE* out) {
+    if (!initialized) return;
+    uint64_t ns = wall_ns() - begin_ns;
+    uint64_t insns = (uint64_t)(INSTRUCTION_COUNT - begin_count);
+
+    run_ticks += hostprof_ticks() - begin_ticks;
+    run_ns += ns;
+    run_insns += insns;
+    if (out != NULL) {
+        fprintf(out, "%" PRIu64 " instructions in %.3f ms: %.2f MIPS\n\n",
+                insns, ns / 1e6, ns ? insns * 1e3 / ns : 0.0);
+    }
+}
+
+// Nanoseconds per tick, from the profiled runs
+static double tick_ns(void) {
+    return run_ticks ? (double)run_ns / run_ticks : 0;
+}
+
+static double ns_per_op(const Cost* c) {
+    return c->count ? c->ticks * tick_ns() / c->count : 0;
+}
+
+static const Cost* sort_key;
+
+static int by_ticks(const void* a, const void* b) {
+    uint64_t x = sort_key[*(const int*)a].ticks, y = sort_key[*(const int*)b].ticks;
+    return x < y ? 1 : x > y ? -1 : *(const int*)a - *(const int*)b;
+}
+
+// Instruction types that ran, most expensive in total first
+static int sorted_types(int* order) {
+    int n = 0;
+    for (int t = 0; t < HOSTPROF_TYPES; t++) {
+        if (execute_cost[t].count) order[n++] = t;
+    }
+    sort_key = execute_cost;
+    qsort(order, n, sizeof(int), by_ticks);
+    return n;
+}
+
+void hostprof_report_text(FILE* out) {
+    int order[HOSTPROF_TYPES];
+    int n = sorted_types(order);
+    uint64_t total = 0;
+
+    if (!initialized) {
+        fprintf(out, "Host profiling is off, start the simulator with --host-profile\n");
+        return;
+    }
+    for (int t = 0; t < HOSTPROF_TYPES; t++)
+        total += execute_cost[t].ticks;
+
+    fprintf(out, "\nHost profile: %" PRIu64 " instructions in %.3f ms, %.2f MIPS, %.3f ns/tick\n",
+            run_insns, run_ns / 1e6, run_ns ? run_insns * 1e3 / run_ns : 0.0, tick_ns());
+    fprintf(out, "\nType              Count        ns/op     Share of execute\n");
+    for (int i = 0; i < n; i++) {
+        const Cost* c = &execute_cost[order[i]];
+        fprintf(out, "%-16s  %-11" PRIu64 "  %-8.1f  %5.1f%%\n", type_name(order[i]), c->count,
+                ns_per_op(c), total ? 100.0 * c->ticks / total : 0);
+    }
+    fprintf(out, "\nPath                Count        ns/op\n");
+    for (int p = 0; p < HOSTPROF_PATHS; p++) {
+        fprintf(out, "%-18s  %-11" PRIu64 "  %.1f\n", path_names[p], path_cost[p].count,
+                ns_per_op(&path_cost[p]));
+    }
+}
+
+void hostprof_report_json(FILE* out) {
+    int order[HOSTPROF_TYPES];
+    int n = sorted_types(order);
+
+    fprintf(out, "{\"instructions\":%" PRIu64 ",\"ns\":%" PRIu64 ",\"mips\":%.3f,\"types\":[",
+            run_insns, run_ns, run_ns ? run_insns * 1e3 / run_ns : 0.0);
+    for (int i = 0; i < n; i++) {
+        const Cost* c = &execute_cost[order[i]];
+        fprintf(out, "%s{\"type\":\"%s\",\"count\":%" PRIu64 ",\"ns_per_op\":%.2f}",
+                i ? "," : "", type_name(order[i]), c->count, ns_per_op(c));
+    }
+    fprintf(out, "],\"paths\":[");
+    for (int p = 0; p < HOSTPROF_PATHS; p++) {
+        fprintf(out, "%s{\"path\":\"%s\",\"count\":%" PRIu64 ",\"ns_per_op\":%.2f}",
+                p ? "," : "", path_names[p], path_cost[p].count, ns_per_op(&path_cost[p]));
+    }
+    fprintf(out, "]}");
+}
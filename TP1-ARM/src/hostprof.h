@@ -0,0 +1,62 @@
+#ifndef HOSTPROF_H
+#define HOSTPROF_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "decode.h"
+
+// Host self-profiling (--host-profile): what each guest instruction type
+// costs to simulate, in host time.
+//
+// process_instruction() times the fetch + decoded-instruction lookup and the
+// execute.c handler of every instruction, decode_cached() its slow paths,
+// and the loop accelerator its runs ahead. Ticks come from the TSC on x86-64
+// and the virtual counter on AArch64 (a monotonic clock elsewhere); they are
+// converted to nanoseconds against the wall clock of the profiled runs. The
+// cost of reading the counter itself is measured once and subtracted.
+// Single core only.
+
+// Decode paths
+#define HOSTPROF_LOOKUP     0   // fetch + decoded-instruction lookup, every instruction
+#define HOSTPROF_DECODE     1   // cache miss: full decode + fusion
+#define HOSTPROF_UNCACHED   2   // no slot for the PC: decoded every time
+#define HOSTPROF_LOOP       3   // counted loop run ahead (loop.c)
+#define HOSTPROF_PATHS      4
+
+#define HOSTPROF_TYPES      (FUSED_MOVZ_STUR + 1)
+
+extern int HOSTPROF;
+
+static inline uint64_t hostprof_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+    uint64_t t;
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// Clears the profile and turns it on
+void hostprof_init(void);
+
+void hostprof_execute(InstructionType type, uint64_t ticks);
+void hostprof_path(int path, uint64_t ticks);
+
+// Around go, run n and batch runs: the wall clock of the run. With OUT the
+// instructions per second of the run are printed there. Both do nothing
+// without --host-profile.
+void hostprof_run_begin(void);
+void hostprof_run_end(FILE* out);
+
+void hostprof_report_text(FILE* out);
+void hostprof_report_json(FILE* out);
+
+#endif
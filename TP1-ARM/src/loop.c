@@ -0,0 +1,284 @@
+#include "loop.h"
+#include "cfg.h"
+#include "execute.h"
+#include "shell.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Counted-loop acceleration, see loop.h.
+//
+// Detection is done once per program, on the CFG, and is conservative: the
+// body may only hold register ALU instructions and stores whose base register
+// is loop-invariant or steps by a constant. The flags after the loop are the
+// ones of the last "subs Xc, Xc, #1", so it must be the last flag setter, and
+// Xc must not be written anywhere else.
+//
+// At run time whole iterations are run ahead, never more than INSTRUCTION_LIMIT
+// allows. The pass gives up at an instruction boundary, with the exact state,
+// when a store faults or hits a watchpoint, or before a store that would write
+// the loop's own code. A loop with a breakpoint is left to the interpreter; one
+// whose code is written is dropped for good (see decode_invalidate()).
+
+int LOOP_ACCEL = 1;
+
+struct LoopTable {
+    uint64_t base;              // of the CFG the loops were found in
+    int ninsns;
+    CountedLoop* loops;
+    int nloops, cap;
+    int32_t* loop_at;           // loop of each instruction index, or -1
+};
+
+static LoopTable default_table;
+static __thread LoopTable* table = &default_table;
+
+static int sets_flags(InstructionType type) {
+    return type == ADDS_IMM || type == ADDS_REG || type == SUBS_IMM || type == SUBS_REG ||
+           type == CMP_IMM || type == CMP_REG || type == ANDS_REG;
+}
+
+static int is_store(InstructionType type) {
+    return type == STUR || type == STURB || type == STURH;
+}
+
+static int writes_rd(InstructionType type) {
+    return type != CMP_IMM && type != CMP_REG && !is_store(type) && type != BNE;
+}
+
+// x = x + constant: the constant, through *step
+static int self_step(const DecodedInstruction* d, int64_t* step) {
+    if (d->rd != d->rn) return 0;
+    switch (d->type) {
+        case ADD_IMM: case ADDS_IMM: *step = d->imm; return 1;
+        case SUBS_IMM: *step = -d->imm; return 1;
+        default: return 0;
+    }
+}
+
+// Fills L from the block [first, end) if it is a counted loop
+static int detect(CountedLoop* l, int first, int end) {
+    const Cfg* cfg = &PROGRAM_CFG;
+    int flag_setter = -1, stores = 0;
+    uint32_t stepped = 0, other = 0;
+
+    memset(l, 0, sizeof(*l));
+    l->head = cfg->base + 4 * (uint64_t)first;
+    l->len = end - first;
+    if (l->len > LOOP_MAX_INSNS) return 0;
+
+    for (int j = 0; j < l->len; j++) {
+        DecodedInstruction* d = &l->insn[j];
+        *d = *cfg_insn(first + j);
+        if (d->type == FUSED_ALU_BCOND || d->type == FUSED_MOVZ_STUR) d->type = d->op;
+
+        switch (d->type) {
+            case ADDS_IMM: case ADDS_REG: case SUBS_IMM: case SUBS_REG:
+            case CMP_IMM: case CMP_REG: case ANDS_REG: case EOR_REG: case ORR_REG:
+            case ADD_IMM: case ADD_REG: case MUL: case MOVZ: case LSL_IMM: case LSR_IMM:
+                break;
+            case STUR: case STURB: case STURH:
+                stores = 1;
+                break;
+            case BNE:
+                if (j == l->len - 1) break;
+                return 0;
+            default:
+                return 0;
+        }
+        if (sets_flags(d->type)) flag_setter = j;
+
+        int64_t step;
+        // X31 is an ordinary register, as in execute.c: tst leaves its result there
+        if (!writes_rd(d->type)) continue;
+        if (self_step(d, &step)) {
+            stepped |= 1u << d->rd;
+            l->step[d->rd] += step;
+        } else {
+            if (d->type == MOVZ && !((l->constant | other | stepped) & (1u << d->rd))) {
+                l->constant |= 1u << d->rd;
+                l->step[d->rd] = d->imm;
+            } else {
+                other |= 1u << d->rd;
+            }
+        }
+        l->written |= 1u << d->rd;
+    }
+
+    // The counter, and the flags b.ne sees
+    if (flag_setter < 0) return 0;
+    const DecodedInstruction* f = &l->insn[flag_setter];
+    if (f->type != SUBS_IMM || f->rd != f->rn || f->imm != 1 || f->rd == 31) return 0;
+    l->counter = f->rd;
+    for (int j = 0; j < l->len; j++) {
+        const DecodedInstruction* d = &l->insn[j];
+        if (j != flag_setter && writes_rd(d->type) && d->rd == l->counter) return 0;
+    }
+
+    // Stores must be affine: the base is invariant or steps by a constant
+    uint32_t varying = other | (l->constant & stepped);
+    for (int j = 0; j < l->len; j++) {
+        const DecodedInstruction* d = &l->insn[j];
+        if (is_store(d->type) && ((varying | l->constant) & (1u << d->rn))) return 0;
+    }
+
+    l->closed = !stores && varying == 0;
+    return 1;
+}
+
+LoopTable* loop_table_new(void) {
+    return calloc(1, sizeof(LoopTable));
+}
+
+void loop_table_use(LoopTable* t) {
+    table = t != NULL ? t : &default_table;
+}
+
+void loop_build(void) {
+    const Cfg* cfg = &PROGRAM_CFG;
+    LoopTable* t = table;
+
+    CountedLoop l;
+
+    free(t->loop_at);
+    t->loop_at = malloc((cfg->ninsns + 1) * sizeof(int32_t));
+    t->base = cfg->base;
+    t->ninsns = cfg->ninsns;
+    t->nloops = 0;
+    for (int i = 0; i < cfg->ninsns; i++) t->loop_at[i] = -1;
+
+    for (int b = 0; b < cfg->nblocks; b++) {
+        int first = cfg->first[b], end = cfg->first[b + 1];
+        if (cfg->succ[2 * b] != b || cfg_insn(end - 1)->type != BNE) continue;
+        if (!detect(&l, first, end)) continue;
+        if (t->nloops == t->cap) {
+            t->cap = t->cap ? 2 * t->cap : 8;
+            t->loops = realloc(t->loops, t->cap * sizeof(CountedLoop));
+        }
+        t->loops[t->nloops] = l;
+        t->loop_at[first] = t->nloops++;
+    }
+}
+
+static int has_breakpoint(const CountedLoop* l) {
+    for (int j = 0; j < l->len; j++) {
+        if (decode_slot(l->head + 4 * (uint64_t)j)->type == BREAKPOINT) return 1;
+    }
+    return 0;
+}
+
+void loop_invalidate(uint64_t address, uint64_t len) {
+    LoopTable* t = table;
+
+    for (int i = 0; i < t->nloops; i++) {
+        CountedLoop* l = &t->loops[i];
+        uint64_t index = (l->head - t->base) / 4;
+        if (address < l->head + 4 * (uint64_t)l->len && address + len > l->head && t->loop_at[index] == i)
+            t->loop_at[index] = -1;
+    }
+}
+
+static void run_closed(const CountedLoop* l, int64_t* x, uint64_t iterations) {
+    for (int r = 0; r < 32; r++) {
+        if (!(l->written & (1u << r)) || r == l->counter) continue;
+        if (l->constant & (1u << r))
+            x[r] = l->step[r];
+        else
+            x[r] = (int64_t)((uint64_t)x[r] + iterations * (uint64_t)l->step[r]);
+    }
+    x[l->counter] = (int64_t)((uint64_t)x[l->counter] - iterations);
+}
+
+// Runs ITERATIONS times over X. Returns the number of instructions executed,
+// less than a whole number of iterations if a store stopped the run.
+static uint64_t run_pass(const CountedLoop* l, int64_t* x, int* flag_n, int* flag_z, uint64_t iterations) {
+    uint64_t code_end = l->head + 4 * (uint64_t)l->len;
+    int64_t result = 0;
+
+    for (uint64_t k = 0; k < iterations; k++) {
+        for (int j = 0; j < l->len - 1; j++) {
+            const DecodedInstruction* d = &l->insn[j];
+            int64_t a = x[d->rn], b = x[d->rm];
+
+            switch (d->type) {
+                case ADDS_IMM: case ADD_IMM: result = (int64_t)((uint64_t)a + d->imm); break;
+                case ADDS_REG: case ADD_REG: result = (int64_t)((uint64_t)a + (uint64_t)b); break;
+                case SUBS_IMM: case CMP_IMM: result = (int64_t)((uint64_t)a - d->imm); break;
+                case SUBS_REG: case CMP_REG: result = (int64_t)((uint64_t)a - (uint64_t)b); break;
+                case ANDS_REG: result = a & b; break;
+                case EOR_REG:  result = a ^ b; break;
+                case ORR_REG:  result = a | b; break;
+                case MUL:      result = (int64_t)((uint64_t)a * (uint64_t)b); break;
+                case MOVZ:     result = d->imm; break;
+                case LSL_IMM:  result = (int64_t)((uint64_t)a << d->imm); break;
+                case LSR_IMM:  result = (int64_t)((uint64_t)a >> d->imm); break;
+                default: {
+                    // Stores, with the handlers of execute.c: they read
+                    // CURRENT_STATE, which cycle() overwrites afterwards
+                    uint64_t address = (uint64_t)a + d->imm;
+                    uint64_t low = d->type == STUR ? address : address & ~(uint64_t)3;
+                    uint64_t high = low + (d->type == STUR ? 8 : 4);
+                    if (low < code_end && high > l->head)
+                        return k * l->len + j;
+                    CURRENT_STATE.PC = l->head + 4 * (uint64_t)j;
+                    CURRENT_STATE.REGS[d->rn] = a;
+                    CURRENT_STATE.REGS[d->rd] = x[d->rd];
+                    if (d->type == STUR) stur(*d);
+                    else if (d->type == STURB) sturb(*d);
+                    else sturh(*d);
+                    if (RUN_BIT != TRUE)
+                        return k * l->len + j + 1;
+                    continue;
+                }
+            }
+            if (writes_rd(d->type)) x[d->rd] = result;
+            if (sets_flags(d->type)) {
+                *flag_z = (result == 0);
+                *flag_n = (result < 0);
+            }
+        }
+    }
+    return iterations * l->len;
+}
+
+void loop_accelerate(void) {
+    const LoopTable* t = table;
+    uint64_t index = (NEXT_STATE.PC - t->base) / 4;
+
+    if (t->loop_at == NULL || NEXT_STATE.PC < t->base || index >= (uint64_t)t->ninsns || t->loop_at[index] < 0)
+        return;
+    const CountedLoop* l = &t->loops[t->loop_at[index]];
+    if (has_breakpoint(l)) return;
+
+    // Whole iterations only, within the budget; the branch being
+    // executed is counted by cycle()
+    int64_t allowed = (int64_t)INSTRUCTION_LIMIT - INSTRUCTION_COUNT - 1;
+    if (allowed < l->len) return;
+    uint64_t remaining = (uint64_t)NEXT_STATE.REGS[l->counter];
+    uint64_t budget = (uint64_t)allowed / l->len;
+    uint64_t iterations = remaining != 0 && remaining < budget ? remaining : budget;
+
+    int64_t x[32];
+    memcpy(x, NEXT_STATE.REGS, sizeof(x));
+    int flag_n = NEXT_STATE.FLAG_N, flag_z = NEXT_STATE.FLAG_Z;
+    uint64_t executed;
+
+    if (l->closed) {
+        run_closed(l, x, iterations);
+        executed = iterations * l->len;
+        flag_z = (x[l->counter] == 0);
+        flag_n = (x[l->counter] < 0);
+    } else {
+        executed = run_pass(l, x, &flag_n, &flag_z, iterations);
+    }
+
+    // Leave at the next instruction to run: past the loop once the
+    // counter is done, back at the head, or wherever a store stopped
+    uint64_t offset = executed % l->len;
+    if (offset == 0 && executed > 0 && x[l->counter] == 0)
+        offset = l->len;
+    memcpy(NEXT_STATE.REGS, x, sizeof(x));
+    NEXT_STATE.FLAG_N = flag_n;
+    NEXT_STATE.FLAG_Z = flag_z;
+    NEXT_STATE.PC = l->head + 4 * offset;
+    INSTRUCTION_COUNT += (int)executed;
+}
@@ -0,0 +1,46 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stdint.h>
+#include "decode.h"
+
+// Counted-loop acceleration.
+//
+// A single-block loop that counts a register down with "subs Xc, Xc, #1"
+// and closes with b.ne is run ahead in one go when it is entered through
+// its back edge: in closed form when every register it writes only steps
+// by a constant, else in a tight pass over a copy of the registers.
+
+#define LOOP_MAX_INSNS 32
+
+typedef struct {
+    uint64_t head;              // address of the first instruction
+    int len;                    // instructions per iteration, b.ne included
+    int counter;                // register counted down to zero
+    int closed;                 // no stores, every write is a constant step
+    uint32_t written;           // closed form: registers the body writes
+    uint32_t constant;          // closed form: ... with MOVZ
+    int64_t step[32];           // closed form: per-iteration increment, or MOVZ value
+    DecodedInstruction insn[LOOP_MAX_INSNS];
+} CountedLoop;
+
+extern int LOOP_ACCEL;          // 0 with --no-loop-accel
+
+// The loops of one program. loop_build() fills and loop_accelerate() uses the
+// calling thread's current table; programs scheduled in one process (see
+// scheduler.c) each have their own.
+typedef struct LoopTable LoopTable;
+
+LoopTable* loop_table_new(void);
+void loop_table_use(LoopTable* t);      // NULL: back to the default table
+
+// Finds the counted loops of PROGRAM_CFG. Called after cfg_build().
+void loop_build(void);
+
+// Called after a taken backward branch, with NEXT_STATE at the target
+void loop_accelerate(void);
+
+// Drops the loops that overlap [ADDRESS, ADDRESS + LEN)
+void loop_invalidate(uint64_t address, uint64_t len);
+
+#endif
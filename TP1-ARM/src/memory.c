@@ -0,0 +1,584 @@
+#define _GNU_SOURCE
+#include "memory.h"
+#include "coherence.h"
+#include "debug.h"
+#include "decode.h"
+#include "shell.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Sparse guest memory.
+//
+// Guest page numbers (52 bits) are split into four 13-bit indices into a
+// radix table, so finding a page is always four loads, wherever it lives in
+// the 64-bit space. A one-entry cache in front of the walk catches the common
+// case of consecutive accesses to the same page.
+//
+// Host memory for pages is carved out of large anonymous mappings, which the
+// kernel zeroes lazily. With huge pages enabled the chunks are 2 MiB aligned
+// and advised as transparent huge pages.
+//
+// Regions created with --map-file are backed by an mmap of a host file: their
+// pages point straight into the mapping, so guest loads read the file with
+// no copy. Copy-on-write mappings are MAP_PRIVATE; a reset drops the private
+// copies with MADV_DONTNEED, which brings back the file contents.
+//
+// Simulated cores share one address space from several host threads. Page
+// faults, dirty tracking and page flag changes are serialized by mem_lock; a
+// page is published by setting its host pointer last, so the unlocked walk
+// never sees a half-built page. Guest data accesses themselves are unlocked.
+//
+// With the MMU on (see mmu.c) the addresses the public functions take are
+// virtual: mem_translate() goes through the core's TLB to the physical page.
+// mem_lookup() always takes a physical address.
+//
+// Programs scheduled in one process (see scheduler.c) each get their own
+// space; MEM is per host thread, so a thread runs on whichever space it
+// switched to.
+
+#define RADIX_BITS      13
+#define RADIX_SIZE      (1 << RADIX_BITS)
+#define RADIX_MASK      (RADIX_SIZE - 1)
+
+#define CHUNK_SIZE      (256 << 10)
+#define HUGE_CHUNK_SIZE (2 << 20)
+
+static mem_space_t DEFAULT_SPACE;
+__thread mem_space_t* MEM = &DEFAULT_SPACE;
+
+__thread uint64_t MEM_LAST_VPN = UINT64_MAX;
+__thread mem_page_t* MEM_LAST_PAGE;
+
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/***************************************************************/
+/* Configuration                                               */
+/***************************************************************/
+
+void mem_add_region(uint64_t start, uint64_t size, int perms) {
+    if (MEM->nregions == MEM_MAX_REGIONS) {
+        printf("Error: too many memory regions\n");
+        exit(-1);
+    }
+    mem_region_t* r = &MEM->regions[MEM->nregions++];
+    memset(r, 0, sizeof(*r));
+    r->start = start;
+    r->size = size;
+    r->perms = perms;
+}
+
+int mem_map_file(const char* path, uint64_t start, int mode) {
+    struct stat st;
+
+    if (start & MEM_PAGE_MASK) {
+        printf("Error: %s must be mapped at a page-aligned address\n", path);
+        return -1;
+    }
+    int fd = open(path, mode == MAP_FILE_SHARED ? O_RDWR : O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        printf("Error: Can't map file %s\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    // Round up to whole pages; the tail of the last page reads as zero
+    uint64_t size = (st.st_size + MEM_PAGE_MASK) & ~(uint64_t)MEM_PAGE_MASK;
+    int prot = mode == MAP_FILE_RO ? PROT_READ : PROT_READ | PROT_WRITE;
+    int flags = mode == MAP_FILE_SHARED ? MAP_SHARED : MAP_PRIVATE;
+    uint8_t* p = mmap(NULL, size, prot, flags, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        printf("Error: Can't map file %s\n", path);
+        return -1;
+    }
+
+    mem_add_region(start, size, mode == MAP_FILE_RO ? MEM_PERM_R : MEM_PERM_R | MEM_PERM_W);
+    MEM->regions[MEM->nregions - 1].backing = p;
+    MEM->regions[MEM->nregions - 1].file_mode = mode;
+    return 0;
+}
+
+void mem_set_sparse(int perms) {
+    // size 0 stands for "up to the end of the address space"
+    mem_add_region(0, 0, perms);
+}
+
+void mem_set_huge_pages(int enable) {
+    MEM->huge_pages = enable;
+}
+
+int mem_parse_perms(const char* s) {
+    int perms = 0;
+    for (; *s; s++) {
+        switch (*s) {
+            case 'r': perms |= MEM_PERM_R; break;
+            case 'w': perms |= MEM_PERM_W; break;
+            case 'x': perms |= MEM_PERM_X; break;
+            case '-': break;
+            default: return -1;
+        }
+    }
+    return perms;
+}
+
+mem_space_t* mem_space_new(void) {
+    mem_space_t* space = calloc(1, sizeof(mem_space_t));
+
+    // File regions keep pointing at the same host mapping
+    memcpy(space->regions, MEM->regions, sizeof(space->regions));
+    space->nregions = MEM->nregions;
+    space->huge_pages = MEM->huge_pages;
+    return space;
+}
+
+void mem_init(void) {
+    // The original fixed windows. They come after any user region, so
+    // user regions win where they overlap, and before a sparse catch-all.
+    int sparse = -1;
+    if (MEM->nregions > 0 && MEM->regions[MEM->nregions - 1].size == 0)
+        sparse = MEM->regions[--MEM->nregions].perms;
+
+    mem_add_region(MEM_TEXT_START, MEM_TEXT_SIZE, MEM_PERM_RWX);
+    mem_add_region(MEM_DATA_START, MEM_DATA_SIZE, MEM_PERM_R | MEM_PERM_W);
+    mem_add_region(MEM_STACK_START, MEM_STACK_SIZE, MEM_PERM_R | MEM_PERM_W);
+    if (sparse >= 0)
+        mem_set_sparse(sparse);
+
+    MEM->root = calloc(RADIX_SIZE, sizeof(void*));
+    MEM_LAST_VPN = UINT64_MAX;
+}
+
+/***************************************************************/
+/* Pages                                                       */
+/***************************************************************/
+
+// Shared file pages are never reset, so they need no dirty tracking
+static int tracks_dirty(const mem_page_t* pg) {
+    return (pg->flags & (PAGE_FILE | PAGE_COW)) != PAGE_FILE;
+}
+
+static void update_fast(mem_page_t* pg) {
+    pg->flags &= ~(PAGE_FAST_R | PAGE_FAST_W);
+    if (pg->flags & PAGE_WATCH)
+        return;
+    if (pg->perms & MEM_PERM_R)
+        pg->flags |= PAGE_FAST_R;
+    if ((pg->perms & MEM_PERM_W) && !(pg->flags & PAGE_CODE) &&
+        ((pg->flags & PAGE_DIRTY) || !tracks_dirty(pg)))
+        pg->flags |= PAGE_FAST_W;
+}
+
+static void push_page(mem_page_t*** list, size_t* n, size_t* cap, mem_page_t* pg) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        *list = realloc(*list, *cap * sizeof(mem_page_t*));
+    }
+    (*list)[(*n)++] = pg;
+}
+
+static void mark_dirty(mem_page_t* pg) {
+    pthread_mutex_lock(&mem_lock);
+    if (!(pg->flags & PAGE_DIRTY)) {
+        pg->flags |= PAGE_DIRTY;
+        push_page(&MEM->dirty, &MEM->ndirty, &MEM->dirty_cap, pg);
+        update_fast(pg);
+    }
+    pthread_mutex_unlock(&mem_lock);
+}
+
+static uint8_t* alloc_host_page(void) {
+    if (MEM->chunk_left == 0) {
+        size_t size = MEM->huge_pages ? HUGE_CHUNK_SIZE : CHUNK_SIZE;
+        // Over-allocate so the chunk can be aligned for huge pages
+        size_t map = MEM->huge_pages ? 2 * size : size;
+        uint8_t* p = mmap(NULL, map, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            printf("Error: Can't allocate simulator memory\n");
+            exit(-1);
+        }
+        if (MEM->huge_pages) {
+            p = (uint8_t*)(((uintptr_t)p + size - 1) & ~(uintptr_t)(size - 1));
+#ifdef MADV_HUGEPAGE
+            madvise(p, size, MADV_HUGEPAGE);
+#endif
+        }
+        MEM->chunk = p;
+        MEM->chunk_left = size;
+    }
+    uint8_t* page = MEM->chunk;
+    MEM->chunk += MEM_PAGE_SIZE;
+    MEM->chunk_left -= MEM_PAGE_SIZE;
+    return page;
+}
+
+// First region that covers any byte of the page, or NULL
+static mem_region_t* find_region(uint64_t vpn) {
+    uint64_t first = vpn << MEM_PAGE_SHIFT;
+    uint64_t last = first + MEM_PAGE_MASK;
+
+    for (int i = 0; i < MEM->nregions; i++) {
+        mem_region_t* r = &MEM->regions[i];
+        if (r->size == 0 || (first <= r->start + r->size - 1 && last >= r->start))
+            return r;
+    }
+    return NULL;
+}
+
+// Creating walks must hold mem_lock
+static mem_page_t* radix_walk(uint64_t vpn, int create) {
+    void** level = MEM->root;
+    for (int shift = 3 * RADIX_BITS; shift > 0; shift -= RADIX_BITS) {
+        void** slot = &level[(vpn >> shift) & RADIX_MASK];
+        void* next = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (next == NULL) {
+            if (!create) return NULL;
+            next = calloc(RADIX_SIZE, shift > RADIX_BITS ? sizeof(void*) : sizeof(mem_page_t));
+            __atomic_store_n(slot, next, __ATOMIC_RELEASE);
+        }
+        level = next;
+    }
+    return &((mem_page_t*)level)[vpn & RADIX_MASK];
+}
+
+// Allocates the page if a region covers it. Called with mem_lock held.
+static mem_page_t* first_touch(uint64_t vpn) {
+    mem_page_t* pg = radix_walk(vpn, FALSE);
+    if (pg != NULL && pg->host != NULL) return pg;    // another core was first
+
+    mem_region_t* r = find_region(vpn);
+    if (r == NULL) return NULL;
+    pg = radix_walk(vpn, TRUE);
+    pg->vpn = vpn;
+    pg->perms = r->perms;
+    uint8_t* host;
+    if (r->backing != NULL) {
+        host = r->backing + ((vpn << MEM_PAGE_SHIFT) - r->start);
+        pg->flags |= PAGE_FILE | (r->file_mode == MAP_FILE_COW ? PAGE_COW : 0);
+    } else {
+        host = alloc_host_page();
+    }
+    push_page(&MEM->pages, &MEM->npages, &MEM->pages_cap, pg);
+    update_fast(pg);
+    __atomic_store_n(&pg->host, host, __ATOMIC_RELEASE);
+    return pg;
+}
+
+mem_page_t* mem_lookup_slow(uint64_t vpn) {
+    mem_page_t* pg = radix_walk(vpn, FALSE);
+
+    if (pg == NULL || __atomic_load_n(&pg->host, __ATOMIC_ACQUIRE) == NULL) {
+        pthread_mutex_lock(&mem_lock);
+        pg = first_touch(vpn);
+        pthread_mutex_unlock(&mem_lock);
+        if (pg == NULL) return NULL;
+    }
+
+    MEM_LAST_VPN = vpn;
+    MEM_LAST_PAGE = pg;
+    return pg;
+}
+
+void mem_reset(void) {
+    for (size_t i = 0; i < MEM->ndirty; i++) {
+        mem_page_t* pg = MEM->dirty[i];
+        if (pg->flags & PAGE_COW)
+            madvise(pg->host, MEM_PAGE_SIZE, MADV_DONTNEED);
+        else
+            memset(pg->host, 0, MEM_PAGE_SIZE);
+        if (pg->flags & PAGE_CODE)
+            decode_invalidate(pg->vpn << MEM_PAGE_SHIFT, MEM_PAGE_SIZE);
+        pg->flags &= ~PAGE_DIRTY;
+        update_fast(pg);
+    }
+    MEM->ndirty = 0;
+}
+
+/***************************************************************/
+/* Accesses                                                    */
+/***************************************************************/
+
+static void mem_fault(uint64_t address, const char* access) {
+    // Only the first faulting byte of an access is reported
+    if (RUN_BIT == FALSE) return;
+    printf("Memory fault: %s of 0x%" PRIx64 " not permitted (PC 0x%" PRIx64 ")\n",
+           access, address, CURRENT_STATE.PC);
+    RUN_BIT = FALSE;
+}
+
+static uint8_t mem_read_8(uint64_t address) {
+    mem_page_t* pg = mem_translate(address, MEM_PERM_R);
+    if (pg == NULL) return 0;
+    if (!(pg->perms & MEM_PERM_R)) {
+        mem_fault(address, "read");
+        return 0;
+    }
+    if (pg->flags & PAGE_WATCH)
+        watch_access(address, FALSE);
+    return pg->host[address & MEM_PAGE_MASK];
+}
+
+static void mem_write_8(uint64_t address, uint8_t value) {
+    mem_page_t* pg = mem_translate(address, MEM_PERM_W);
+    if (pg == NULL) return;
+    if (!(pg->perms & MEM_PERM_W)) {
+        mem_fault(address, "write");
+        return;
+    }
+    if (pg->flags & PAGE_WATCH)
+        watch_access(address, TRUE);
+    if (!(pg->flags & PAGE_DIRTY) && tracks_dirty(pg))
+        mark_dirty(pg);
+    pg->host[address & MEM_PAGE_MASK] = value;
+    if (pg->flags & PAGE_CODE)
+        decode_invalidate(address, 1);
+}
+
+// Byte by byte: page-crossing, unmapped, clean or protected pages
+uint32_t mem_read_32_slow(uint64_t address) {
+    return (mem_read_8(address + 3) << 24) |
+           (mem_read_8(address + 2) << 16) |
+           (mem_read_8(address + 1) <<  8) |
+           (mem_read_8(address + 0) <<  0);
+}
+
+void mem_write_32_slow(uint64_t address, uint32_t value) {
+    mem_write_8(address + 3, (value >> 24) & 0xFF);
+    mem_write_8(address + 2, (value >> 16) & 0xFF);
+    mem_write_8(address + 1, (value >>  8) & 0xFF);
+    mem_write_8(address + 0, (value >>  0) & 0xFF);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_read_32                                      */
+/*                                                             */
+/* Purpose: Read a 32-bit word from memory                     */
+/*                                                             */
+/***************************************************************/
+uint32_t mem_read_32(uint64_t address)
+{
+    uint64_t offset = address & MEM_PAGE_MASK;
+    if (COHERENCE)
+        coh_access(address, 4, FALSE);
+    if (offset <= MEM_PAGE_SIZE - 4) {
+        mem_page_t* pg = mem_translate(address, MEM_PERM_R);
+        if (pg != NULL && (pg->flags & PAGE_FAST_R)) {
+            uint32_t value;
+            memcpy(&value, pg->host + offset, 4);   // little-endian host
+            return value;
+        }
+    }
+    return mem_read_32_slow(address);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_write_32                                     */
+/*                                                             */
+/* Purpose: Write a 32-bit word to memory                      */
+/*                                                             */
+/***************************************************************/
+void mem_write_32(uint64_t address, uint32_t value)
+{
+    uint64_t offset = address & MEM_PAGE_MASK;
+    if (COHERENCE)
+        coh_access(address, 4, TRUE);
+    if (offset <= MEM_PAGE_SIZE - 4) {
+        mem_page_t* pg = mem_translate(address, MEM_PERM_W);
+        if (pg != NULL && (pg->flags & PAGE_FAST_W)) {
+            memcpy(pg->host + offset, &value, 4);
+            return;
+        }
+    }
+    mem_write_32_slow(address, value);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_fetch_32                                     */
+/*                                                             */
+/* Purpose: Read an instruction word (needs execute permission)*/
+/*                                                             */
+/***************************************************************/
+uint32_t mem_fetch_32(uint64_t address)
+{
+    mem_page_t* pg = mem_translate(address, MEM_PERM_X);
+    if (pg != NULL && !(pg->perms & MEM_PERM_X)) {
+        mem_fault(address, "execute");
+        return 0;
+    }
+    if (pg != NULL && (address & MEM_PAGE_MASK) <= MEM_PAGE_SIZE - 4) {
+        uint32_t value;
+        memcpy(&value, pg->host + (address & MEM_PAGE_MASK), 4);
+        return value;
+    }
+    return mem_peek_32(address);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_peek_32                                      */
+/*                                                             */
+/* Purpose: Read a 32-bit word for the simulator itself        */
+/*          (fetches, dumps): permissions and watchpoints      */
+/*          are ignored                                        */
+/*                                                             */
+/***************************************************************/
+uint32_t mem_peek_32(uint64_t address)
+{
+    uint32_t value = 0;
+    uint64_t offset = address & MEM_PAGE_MASK;
+    mem_page_t* pg = mem_translate(address, 0);
+
+    if (offset <= MEM_PAGE_SIZE - 4) {
+        if (pg != NULL)
+            memcpy(&value, pg->host + offset, 4);
+        return value;
+    }
+    for (int i = 3; i >= 0; i--) {
+        pg = mem_translate(address + i, 0);
+        value = (value << 8) | (pg ? pg->host[(address + i) & MEM_PAGE_MASK] : 0);
+    }
+    return value;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_atomic_64                                    */
+/*                                                             */
+/* Purpose: Host address of an aligned doubleword, for atomic  */
+/*          read-modify-writes. NULL when the access has to    */
+/*          take the slow path: watched, code, protected or    */
+/*          unmapped pages                                     */
+/*                                                             */
+/***************************************************************/
+uint64_t* mem_atomic_64(uint64_t address)
+{
+    mem_page_t* pg = mem_translate(address, MEM_PERM_R | MEM_PERM_W);
+    if (pg == NULL || (address & 7)) return NULL;
+
+    // A clean page only gets its fast bits with the first store
+    if ((pg->perms & MEM_PERM_W) && !(pg->flags & PAGE_DIRTY) && tracks_dirty(pg))
+        mark_dirty(pg);
+    if ((pg->flags & (PAGE_FAST_R | PAGE_FAST_W)) != (PAGE_FAST_R | PAGE_FAST_W))
+        return NULL;
+    // Exclusive loads count as writes too: they fetch the line for ownership
+    if (COHERENCE)
+        coh_access(address, 8, TRUE);
+    return (uint64_t*)(pg->host + (address & MEM_PAGE_MASK));
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_watch_page                                   */
+/*                                                             */
+/* Purpose: Send every access to a page through the slow path  */
+/*          so watchpoints on it are checked                   */
+/*                                                             */
+/***************************************************************/
+void mem_watch_page(uint64_t address, int enable)
+{
+    mem_page_t* pg = mem_translate(address, 0);
+    if (pg == NULL) return;
+    pthread_mutex_lock(&mem_lock);
+    if (enable) pg->flags |= PAGE_WATCH;
+    else pg->flags &= ~PAGE_WATCH;
+    update_fast(pg);
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_track_code                                   */
+/*                                                             */
+/* Purpose: Send stores to a page with decoded instructions    */
+/*          through the slow path, which invalidates them      */
+/*                                                             */
+/***************************************************************/
+void mem_track_code(mem_page_t* pg, struct DecodedPage* decoded)
+{
+    pthread_mutex_lock(&mem_lock);
+    if (pg->decoded == NULL) {
+        pg->decoded = decoded;
+        pg->flags |= PAGE_CODE;
+        update_fast(pg);
+    } else {
+        free(decoded);
+    }
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure: mem_debug_read / mem_debug_write                 */
+/*                                                             */
+/* Purpose: Byte access for a debugger: code can be patched    */
+/*          and read-only data inspected                       */
+/*                                                             */
+/***************************************************************/
+int mem_debug_read(uint64_t address, uint8_t* buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        mem_page_t* pg = mem_translate(address + i, 0);
+        if (pg == NULL) return -1;
+        buf[i] = pg->host[(address + i) & MEM_PAGE_MASK];
+    }
+    return 0;
+}
+
+int mem_debug_write(uint64_t address, const uint8_t* buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        mem_page_t* pg = mem_translate(address + i, 0);
+        // Read-only file mappings are not writable on the host either
+        if (pg == NULL || ((pg->flags & PAGE_FILE) && !(pg->perms & MEM_PERM_W)))
+            return -1;
+        if (!(pg->flags & PAGE_DIRTY) && tracks_dirty(pg))
+            mark_dirty(pg);
+        pg->host[(address + i) & MEM_PAGE_MASK] = buf[i];
+        if (pg->flags & PAGE_CODE)
+            decode_invalidate(address + i, 1);
+    }
+    return 0;
+}
+
+/***************************************************************/
+/* Snapshots                                                   */
+/***************************************************************/
+
+// Pages that were never written are zero, so only dirty pages are saved
+void mem_snapshot_save(mem_snapshot_t* snap) {
+    mem_snapshot_free(snap);
+    snap->npages = MEM->ndirty;
+    snap->vpns = malloc(snap->npages * sizeof(uint64_t));
+    snap->data = malloc(snap->npages * MEM_PAGE_SIZE);
+    for (size_t i = 0; i < snap->npages; i++) {
+        snap->vpns[i] = MEM->dirty[i]->vpn;
+        memcpy(snap->data + i * MEM_PAGE_SIZE, MEM->dirty[i]->host, MEM_PAGE_SIZE);
+    }
+}
+
+void mem_snapshot_restore(const mem_snapshot_t* snap) {
+    mem_reset();
+    for (size_t i = 0; i < snap->npages; i++) {
+        mem_page_t* pg = mem_lookup_slow(snap->vpns[i]);
+        memcpy(pg->host, snap->data + i * MEM_PAGE_SIZE, MEM_PAGE_SIZE);
+        if (pg->flags & PAGE_CODE)
+            decode_invalidate(pg->vpn << MEM_PAGE_SHIFT, MEM_PAGE_SIZE);
+        if (!(pg->flags & PAGE_DIRTY))
+            mark_dirty(pg);
+    }
+}
+
+void mem_snapshot_free(mem_snapshot_t* snap) {
+    free(snap->vpns);
+    free(snap->data);
+    memset(snap, 0, sizeof(*snap));
+}
@@ -0,0 +1,180 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Guest memory: a sparse 64-bit address space backed by a 4-level radix page
+// table. Regions only describe which addresses exist and with which
+// permissions; their pages are allocated the first time they are touched.
+// The three fixed windows of the original simulator are the default map.
+
+#define MEM_DATA_START  0x10000000
+#define MEM_DATA_SIZE   0x00100000
+#define MEM_TEXT_START  0x00400000
+#define MEM_TEXT_SIZE   0x00100000
+#define MEM_STACK_START 0xfffffffc
+#define MEM_STACK_SIZE  0x00100000
+
+#define MEM_PAGE_SHIFT  12
+#define MEM_PAGE_SIZE   (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK   (MEM_PAGE_SIZE - 1)
+
+#define MEM_PERM_R      0x1
+#define MEM_PERM_W      0x2
+#define MEM_PERM_X      0x4
+#define MEM_PERM_RWX    (MEM_PERM_R | MEM_PERM_W | MEM_PERM_X)
+
+// Page flags. PAGE_FAST_R / PAGE_FAST_W are derived from the others: a set
+// bit means the access can be done with a plain memcpy on the host page.
+#define PAGE_DIRTY      0x01    // written since the last reset
+#define PAGE_FILE       0x02    // points into a mapped host file
+#define PAGE_COW        0x04    // private copy of a file page
+#define PAGE_WATCH      0x08    // has a watchpoint: every access is checked
+#define PAGE_CODE       0x10    // has decoded instructions: stores invalidate them
+#define PAGE_FAST_R     0x40
+#define PAGE_FAST_W     0x80
+
+struct DecodedPage;
+
+typedef struct {
+    uint8_t* host;              // backing memory (NULL until first touch)
+    uint64_t vpn;               // guest page number
+    uint8_t perms;              // MEM_PERM_*
+    uint8_t flags;              // PAGE_*
+    struct DecodedPage* decoded; // decoded-instruction cache, see decode.c
+} mem_page_t;
+
+// How a host file is mapped into the guest (--map-file)
+#define MAP_FILE_SHARED 0       // guest stores go to the file
+#define MAP_FILE_RO     1       // read-only
+#define MAP_FILE_COW    2       // guest stores go to private copies
+
+typedef struct {
+    uint64_t start, size;
+    int perms;
+    uint8_t* backing;           // mapped host file, NULL for anonymous memory
+    int file_mode;              // MAP_FILE_*
+} mem_region_t;
+
+#define MEM_MAX_REGIONS 32
+
+typedef struct {
+    void** root;                // radix table, 13 bits per level
+
+    mem_region_t regions[MEM_MAX_REGIONS];  // searched in order
+    int nregions;
+
+    mem_page_t** dirty;         // pages written since the last reset
+    size_t ndirty, dirty_cap;
+    mem_page_t** pages;         // every page with backing memory
+    size_t npages, pages_cap;
+
+    uint8_t* chunk;             // host memory is carved out of big chunks
+    size_t chunk_left;
+    int huge_pages;             // back chunks with transparent huge pages
+} mem_space_t;
+
+// The address space the calling thread is running on
+extern __thread mem_space_t* MEM;
+
+// One-entry lookup cache, per host thread: cores share MEM (see smp.c)
+extern __thread uint64_t MEM_LAST_VPN;
+extern __thread mem_page_t* MEM_LAST_PAGE;
+
+// Memory contents saved by a checkpoint
+typedef struct {
+    uint64_t* vpns;
+    uint8_t* data;
+    size_t npages;
+} mem_snapshot_t;
+
+// Configuration, before the first mem_init()
+void mem_add_region(uint64_t start, uint64_t size, int perms);
+void mem_set_sparse(int perms);         // map the whole 64-bit space
+void mem_set_huge_pages(int enable);
+int  mem_map_file(const char* path, uint64_t start, int mode);
+int  mem_parse_perms(const char* s);    // "rwx" -> MEM_PERM_*, -1 if invalid
+
+// A new, empty space with the configuration of the current one. Taken
+// before the current space's mem_init(), which adds the fixed windows.
+mem_space_t* mem_space_new(void);
+
+void mem_init(void);                    // create the default map
+void mem_reset(void);                   // zero every dirty page
+
+void mem_snapshot_save(mem_snapshot_t* snap);
+void mem_snapshot_restore(const mem_snapshot_t* snap);
+void mem_snapshot_free(mem_snapshot_t* snap);
+
+void mem_watch_page(uint64_t address, int enable);
+// Attaches DECODED to PG, unless another core was first (then it is freed).
+// Stores to PG then go through decode_invalidate().
+void mem_track_code(mem_page_t* pg, struct DecodedPage* decoded);
+uint32_t mem_peek_32(uint64_t address);  // no faults and no watchpoints
+uint64_t* mem_atomic_64(uint64_t address);  // host pointer for atomics, or NULL
+
+// Debugger access: ignores permissions, -1 if part of the range is unmapped
+int mem_debug_read(uint64_t address, uint8_t* buf, size_t len);
+int mem_debug_write(uint64_t address, const uint8_t* buf, size_t len);
+
+mem_page_t* mem_lookup_slow(uint64_t vpn);
+uint32_t mem_read_32_slow(uint64_t address);
+void mem_write_32_slow(uint64_t address, uint32_t value);
+
+// O(1) page lookup: the cached last page, else a fixed 4-level walk.
+// Faults the page in if it belongs to a region. NULL if unmapped.
+static inline mem_page_t* mem_lookup(uint64_t address) {
+    uint64_t vpn = address >> MEM_PAGE_SHIFT;
+    if (vpn == MEM_LAST_VPN)
+        return MEM_LAST_PAGE;
+    return mem_lookup_slow(vpn);
+}
+
+// Soft MMU, per core (see mmu.c). With SCTLR_EL1.M set, guest addresses are
+// virtual and go through a direct-mapped TLB of physical pages.
+#define MEM_TLB_SIZE    256
+
+typedef struct {
+    uint64_t tag;               // virtual page number + 1, 0 = empty
+    mem_page_t* page;           // physical page
+    uint8_t perms;              // MEM_PERM_* granted by the page tables
+    uint8_t level;              // of the descriptor, for permission faults
+} mem_tlb_entry_t;
+
+typedef struct {
+    int enabled;                // SCTLR_EL1.M
+    uint64_t sctlr, ttbr0;      // system registers
+    unsigned epoch;             // MMU_EPOCH when the TLB was last flushed
+    uint64_t hits, misses, walks, descriptor_reads, faults;
+    mem_tlb_entry_t tlb[MEM_TLB_SIZE];
+} mem_mmu_t;
+
+extern __thread mem_mmu_t MMU;
+extern unsigned MMU_EPOCH;      // bumped by TLBI: every core's TLB is stale
+
+mem_page_t* mmu_translate(uint64_t address, int access);
+
+// TLB slot of a virtual page. The higher bits are folded in so that the
+// text, data and stack windows don't all land in slot 0.
+static inline mem_tlb_entry_t* mem_tlb_entry(uint64_t vpn) {
+    return &MMU.tlb[(vpn ^ (vpn >> 8) ^ (vpn >> 16)) & (MEM_TLB_SIZE - 1)];
+}
+
+// Page of a guest address for an access of type ACCESS (MEM_PERM_*, 0 for
+// the simulator's own accesses, which never fault). Flat memory when the
+// MMU is off, else a TLB hit costs a compare.
+static inline mem_page_t* mem_translate(uint64_t address, int access) {
+    if (!MMU.enabled)
+        return mem_lookup(address);
+    uint64_t vpn = address >> MEM_PAGE_SHIFT;
+    mem_tlb_entry_t* e = mem_tlb_entry(vpn);
+    if (e->tag == vpn + 1 && (e->perms & access) == access && MMU.epoch == MMU_EPOCH) {
+        MMU.hits += access != 0;    // the simulator's own lookups don't count
+        return e->page;
+    }
+    return mmu_translate(address, access);
+}
+
+#endif
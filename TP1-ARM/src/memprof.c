@@ -0,0 +1,376 @@
+#include "memprof.h"
+#include "decode.h"
+#include "memory.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Guest memory access profile, see memprof.h.
+//
+// Reuse distances use the tree-based stack-distance algorithm (Bennett and
+// Kruskal): every access gets a timestamp, and a Fenwick tree over the
+// timestamps holds a 1 at the last access of each line. The distance of an
+// access to a line last used at time t is the number of 1s after t, found in
+// O(log n). When the timestamps run out the live ones are renumbered in
+// order, so the tree stays proportional to the number of distinct lines.
+//
+// Strides: each PC remembers its last address and stride. The reported
+// stride is the majority vote over the run (Boyer-Moore), "regular" is the
+// share of accesses whose stride repeated the previous one.
+
+#define MEMPROF_MIN_TREE 4096
+
+typedef struct {
+    uint64_t vpn;
+    uint64_t reads, writes;
+    uint32_t lines[MEMPROF_LINES];
+} PageStat;
+
+typedef struct {
+    uint64_t pc;
+    uint64_t accesses, regular;
+    uint64_t last_address;
+    int64_t last_stride;
+    int64_t candidate;          // majority vote
+    int64_t votes;
+} PcStat;
+
+// uint64 -> uint64, open addressing, at most half full
+typedef struct {
+    uint64_t* keys;             // key + 1, 0 = free slot
+    uint64_t* vals;
+    size_t cap, used;
+} Map;
+
+int MEMPROF;
+
+static Map pages_map, lines_map, pcs_map;
+static PageStat* pages;
+static size_t npages, pages_cap;
+static PcStat* pcs;
+static size_t npcs, pcs_cap;
+
+static uint32_t* tree;          // Fenwick tree over timestamps 1..tree_size
+static uint64_t tree_size, now;
+static uint64_t reuse[MEMPROF_BUCKETS], cold;
+static uint64_t loads, stores;
+
+static void map_free(Map* m) {
+    free(m->keys);
+    free(m->vals);
+    memset(m, 0, sizeof(*m));
+}
+
+// Value slot of KEY; a new key gets the value NEW_VAL
+static uint64_t* map_get(Map* m, uint64_t key, uint64_t new_val) {
+    if (2 * (m->used + 1) > m->cap) {
+        Map old = *m;
+        m->cap = old.cap ? old.cap * 2 : 1024;
+        m->used = 0;
+        m->keys = calloc(m->cap, sizeof(uint64_t));
+        m->vals = malloc(m->cap * sizeof(uint64_t));
+        for (size_t i = 0; i < old.cap; i++) {
+            if (old.keys[i]) *map_get(m, old.keys[i] - 1, old.vals[i]) = old.vals[i];
+        }
+        free(old.keys);
+        free(old.vals);
+    }
+    size_t i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 20) & (m->cap - 1);
+    while (m->keys[i] && m->keys[i] != key + 1)
+        i = (i + 1) & (m->cap - 1);
+    if (!m->keys[i]) {
+        m->keys[i] = key + 1;
+        m->vals[i] = new_val;
+        m->used++;
+    }
+    return &m->vals[i];
+}
+
+void memprof_init(void) {
+    map_free(&pages_map);
+    map_free(&lines_map);
+    map_free(&pcs_map);
+    free(pages);
+    pages = NULL;
+    npages = pages_cap = 0;
+    free(pcs);
+    pcs = NULL;
+    npcs = pcs_cap = 0;
+    free(tree);
+    tree_size = MEMPROF_MIN_TREE;
+    tree = calloc(tree_size + 1, sizeof(uint32_t));
+    now = 0;
+    memset(reuse, 0, sizeof(reuse));
+    cold = loads = stores = 0;
+    MEMPROF = 1;
+}
+
+/***************************************************************/
+/* Reuse distance                                              */
+/***************************************************************/
+
+static void tree_add(uint64_t i, int delta) {
+    for (; i <= tree_size; i += i & -i)
+        tree[i] += delta;
+}
+
+// Number of live timestamps in 1..I
+static uint64_t tree_prefix(uint64_t i) {
+    uint64_t sum = 0;
+    for (; i > 0; i -= i & -i)
+        sum += tree[i];
+    return sum;
+}
+
+static int by_time(const void* a, const void* b) {
+    uint64_t x = **(const uint64_t* const*)a, y = **(const uint64_t* const*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Renumbers the live timestamps 1..n in order, in a tree with room to spare
+static void compact(void) {
+    size_t n = lines_map.used, k = 0;
+    uint64_t** live = malloc(n * sizeof(uint64_t*));
+
+    for (size_t i = 0; i < lines_map.cap; i++) {
+        if (lines_map.keys[i]) live[k++] = &lines_map.vals[i];
+    }
+    qsort(live, n, sizeof(uint64_t*), by_time);
+
+    free(tree);
+    tree_size = 2 * n > MEMPROF_MIN_TREE ? 2 * n : MEMPROF_MIN_TREE;
+    tree = calloc(tree_size + 1, sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) {
+        *live[i] = i + 1;
+        tree[i + 1] = 1;
+    }
+    // Linear-time build: each node adds itself to its parent
+    for (uint64_t i = 1; i <= tree_size; i++) {
+        uint64_t parent = i + (i & -i);
+        if (parent <= tree_size) tree[parent] += tree[i];
+    }
+    now = n;
+    free(live);
+}
+
+static void reuse_access(uint64_t line) {
+    if (now == tree_size) compact();
+    uint64_t* last = map_get(&lines_map, line, 0);
+    uint64_t t = ++now;
+
+    if (*last == 0) {
+        cold++;
+    } else {
+        // Lines used since: the live timestamps after the last one of this
+        // line. T is not in the tree yet, so every live one is below it.
+        uint64_t distance = lines_map.used - tree_prefix(*last);
+        int b = 0;
+        while (b < MEMPROF_BUCKETS - 1 && distance >= (1ULL << b))
+            b++;
+        reuse[b]++;
+        tree_add(*last, -1);
+    }
+    tree_add(t, 1);
+    *last = t;
+}
+
+/***************************************************************/
+/* Access hook                                                 */
+/***************************************************************/
+
+void memprof_access(uint64_t pc, uint64_t address, int len, int write) {
+    (void)len;
+    if (write) stores++;
+    else loads++;
+
+    // Heatmap
+    uint64_t* p = map_get(&pages_map, address >> MEM_PAGE_SHIFT, npages);
+    if (*p == npages) {
+        if (npages == pages_cap) {
+            pages_cap = pages_cap ? pages_cap * 2 : 64;
+            pages = realloc(pages, pages_cap * sizeof(PageStat));
+        }
+        memset(&pages[npages], 0, sizeof(PageStat));
+        pages[npages++].vpn = address >> MEM_PAGE_SHIFT;
+    }
+    PageStat* pg = &pages[*p];
+    if (write) pg->writes++;
+    else pg->reads++;
+    pg->lines[(address & MEM_PAGE_MASK) >> MEMPROF_LINE_SHIFT]++;
+
+    reuse_access(address >> MEMPROF_LINE_SHIFT);
+
+    // Strides
+    uint64_t* s = map_get(&pcs_map, pc, npcs);
+    if (*s == npcs) {
+        if (npcs == pcs_cap) {
+            pcs_cap = pcs_cap ? pcs_cap * 2 : 64;
+            pcs = realloc(pcs, pcs_cap * sizeof(PcStat));
+        }
+        memset(&pcs[npcs], 0, sizeof(PcStat));
+        pcs[npcs++].pc = pc;
+    }
+    PcStat* st = &pcs[*s];
+    if (st->accesses > 0) {
+        int64_t stride = (int64_t)(address - st->last_address);
+        if (st->accesses > 1 && stride == st->last_stride) st->regular++;
+        if (st->votes == 0) st->candidate = stride;
+        st->votes += stride == st->candidate ? 1 : -1;
+        st->last_stride = stride;
+    }
+    st->last_address = address;
+    st->accesses++;
+}
+
+/***************************************************************/
+/* Reports                                                     */
+/***************************************************************/
+
+static int lines_touched(const PageStat* pg) {
+    int n = 0;
+    for (int i = 0; i < MEMPROF_LINES; i++)
+        n += pg->lines[i] != 0;
+    return n;
+}
+
+static int by_accesses_page(const void* a, const void* b) {
+    const PageStat* x = a;
+    const PageStat* y = b;
+    uint64_t nx = x->reads + x->writes, ny = y->reads + y->writes;
+    return nx < ny ? 1 : nx > ny ? -1 : (x->vpn > y->vpn) - (x->vpn < y->vpn);
+}
+
+static int by_accesses_pc(const void* a, const void* b) {
+    const PcStat* x = a;
+    const PcStat* y = b;
+    return x->accesses < y->accesses ? 1 : x->accesses > y->accesses ? -1 : (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+// Pages and PCs are sorted for the reports (their maps are rebuilt after)
+static void sort_stats(void) {
+    qsort(pages, npages, sizeof(PageStat), by_accesses_page);
+    qsort(pcs, npcs, sizeof(PcStat), by_accesses_pc);
+    map_free(&pages_map);
+    for (size_t i = 0; i < npages; i++)
+        *map_get(&pages_map, pages[i].vpn, i) = i;
+    map_free(&pcs_map);
+    for (size_t i = 0; i < npcs; i++)
+        *map_get(&pcs_map, pcs[i].pc, i) = i;
+}
+
+static double regular_share(const PcStat* st) {
+    return st->accesses > 2 ? (double)st->regular / (st->accesses - 2) : 0;
+}
+
+// Share of the accesses a fully associative LRU cache of LINES lines hits
+static double lru_hit_rate(uint64_t lines) {
+    uint64_t hits = 0, total = cold;
+    for (int b = 0; b < MEMPROF_BUCKETS; b++) {
+        total += reuse[b];
+        // Bucket b holds distances [2^(b-1), 2^b), bucket 0 distance 0
+        if (b == 0 || (1ULL << b) <= lines) hits += reuse[b];
+    }
+    return total ? (double)hits / total : 0;
+}
+
+void memprof_report_text(FILE* out) {
+    sort_stats();
+    fprintf(out, "\nMemory profile: %" PRIu64 " loads, %" PRIu64 " stores, %zu pages, %zu lines of %d bytes\n",
+            loads, stores, npages, lines_map.used, 1 << MEMPROF_LINE_SHIFT);
+
+    fprintf(out, "\nPage                  Reads      Writes     Lines\n");
+    for (size_t i = 0; i < npages && i < MEMPROF_TOP; i++) {
+        const PageStat* pg = &pages[i];
+        fprintf(out, "0x%-16" PRIx64 "  %-9" PRIu64 "  %-9" PRIu64 "  %d/%d\n",
+                pg->vpn << MEM_PAGE_SHIFT, pg->reads, pg->writes, lines_touched(pg), MEMPROF_LINES);
+    }
+
+    fprintf(out, "\nReuse distance        Accesses\n");
+    fprintf(out, "cold                  %" PRIu64 "\n", cold);
+    for (int b = 0; b < MEMPROF_BUCKETS; b++) {
+        char range[48];
+        if (reuse[b] == 0) continue;
+        if (b < 2) snprintf(range, sizeof(range), "%d", b);
+        else snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64, UINT64_C(1) << (b - 1), (UINT64_C(1) << b) - 1);
+        fprintf(out, "%-20s  %" PRIu64 "\n", range, reuse[b]);
+    }
+    fprintf(out, "LRU hit rate: 32 KiB %.1f%%, 256 KiB %.1f%%, 2 MiB %.1f%%\n",
+            100 * lru_hit_rate(512), 100 * lru_hit_rate(4096), 100 * lru_hit_rate(32768));
+
+    fprintf(out, "\nPC                  Instruction  Accesses   Stride     Regular\n");
+    for (size_t i = 0; i < npcs && i < MEMPROF_TOP; i++) {
+        const PcStat* st = &pcs[i];
+        fprintf(out, "0x%-16" PRIx64 "  %-11s  %-9" PRIu64 "  %-9" PRId64 "  %.1f%%\n",
+                st->pc, instruction_name(mem_peek_32(st->pc)), st->accesses, st->candidate,
+                100 * regular_share(st));
+    }
+}
+
+void memprof_report_json(FILE* out) {
+    sort_stats();
+    fprintf(out, "{\"loads\":%" PRIu64 ",\"stores\":%" PRIu64 ",\"line_size\":%d,\"lines\":%zu,\"pages\":[",
+            loads, stores, 1 << MEMPROF_LINE_SHIFT, lines_map.used);
+    for (size_t i = 0; i < npages && i < MEMPROF_TOP; i++) {
+        fprintf(out, "%s{\"page\":\"0x%" PRIx64 "\",\"reads\":%" PRIu64 ",\"writes\":%" PRIu64 ",\"lines\":%d}",
+                i ? "," : "", pages[i].vpn << MEM_PAGE_SHIFT, pages[i].reads, pages[i].writes,
+                lines_touched(&pages[i]));
+    }
+    fprintf(out, "],\"reuse\":{\"cold\":%" PRIu64 ",\"log2_buckets\":[", cold);
+    for (int b = 0; b < MEMPROF_BUCKETS; b++)
+        fprintf(out, "%s%" PRIu64, b ? "," : "", reuse[b]);
+    fprintf(out, "]},\"strides\":[");
+    for (size_t i = 0; i < npcs && i < MEMPROF_TOP; i++) {
+        fprintf(out, "%s{\"pc\":\"0x%" PRIx64 "\",\"accesses\":%" PRIu64 ",\"stride\":%" PRId64 ",\"regular\":%.4f}",
+                i ? "," : "", pcs[i].pc, pcs[i].accesses, pcs[i].candidate, regular_share(&pcs[i]));
+    }
+    fprintf(out, "]}");
+}
+
+static FILE* open_csv(const char* prefix, const char* name) {
+    size_t len = strlen(prefix) + strlen(name) + 6;
+    char* path = malloc(len);
+    snprintf(path, len, "%s-%s.csv", prefix, name);
+    FILE* f = fopen(path, "w");
+    if (f == NULL) fprintf(stderr, "Error: Can't open %s\n", path);
+    free(path);
+    return f;
+}
+
+int memprof_write_csv(const char* prefix) {
+    FILE* f;
+
+    sort_stats();
+    if ((f = open_csv(prefix, "pages")) == NULL) return -1;
+    fprintf(f, "page,reads,writes");
+    for (int l = 0; l < MEMPROF_LINES; l++)
+        fprintf(f, ",line%d", l);
+    fprintf(f, "\n");
+    for (size_t i = 0; i < npages; i++) {
+        fprintf(f, "0x%" PRIx64 ",%" PRIu64 ",%" PRIu64, pages[i].vpn << MEM_PAGE_SHIFT,
+                pages[i].reads, pages[i].writes);
+        for (int l = 0; l < MEMPROF_LINES; l++)
+            fprintf(f, ",%u", pages[i].lines[l]);
+        fprintf(f, "\n");
+    }
+    fclose(f);
+
+    // Rows are [min, max] distances; cold misses have none
+    if ((f = open_csv(prefix, "reuse")) == NULL) return -1;
+    fprintf(f, "min_distance,max_distance,accesses\n");
+    fprintf(f, "cold,cold,%" PRIu64 "\n", cold);
+    for (int b = 0; b < MEMPROF_BUCKETS; b++) {
+        uint64_t lo = b ? 1ULL << (b - 1) : 0, hi = b ? (1ULL << b) - 1 : 0;
+        fprintf(f, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", lo, hi, reuse[b]);
+    }
+    fclose(f);
+
+    if ((f = open_csv(prefix, "strides")) == NULL) return -1;
+    fprintf(f, "pc,instruction,accesses,stride,regular\n");
+    for (size_t i = 0; i < npcs; i++) {
+        fprintf(f, "0x%" PRIx64 ",%s,%" PRIu64 ",%" PRId64 ",%.4f\n", pcs[i].pc,
+                instruction_name(mem_peek_32(pcs[i].pc)), pcs[i].accesses, pcs[i].candidate,
+                regular_share(&pcs[i]));
+    }
+    fclose(f);
+    return 0;
+}
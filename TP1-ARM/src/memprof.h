@@ -0,0 +1,37 @@
+#ifndef MEMPROF_H
+#define MEMPROF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Guest memory access profile (--mem-profile).
+//
+// Fed by the LDUR* / STUR* handlers of execute.c. Three views of the same
+// access stream:
+//   pages     accesses per page, and per 64-byte line within it (heatmap)
+//   reuse     histogram of reuse distances: distinct lines touched between
+//             two accesses to the same line (LRU stack distance)
+//   strides   per load/store PC, its most common stride and how regular it is
+// Single core only; like coherence.c it only counts.
+
+#define MEMPROF_LINE_SHIFT  6
+#define MEMPROF_LINES       (1 << (12 - MEMPROF_LINE_SHIFT))    // per 4 KiB page
+#define MEMPROF_BUCKETS     40      // reuse distances up to 2^39 lines
+#define MEMPROF_TOP         10      // pages and PCs in the text report
+
+extern int MEMPROF;
+
+// Clears the profile and turns it on
+void memprof_init(void);
+
+// A load (WRITE = 0) or store of LEN bytes at ADDRESS by the instruction at PC
+void memprof_access(uint64_t pc, uint64_t address, int len, int write);
+
+void memprof_report_text(FILE* out);
+void memprof_report_json(FILE* out);
+
+// Writes PREFIX-pages.csv, PREFIX-reuse.csv and PREFIX-strides.csv.
+// Returns -1 if a file can't be written.
+int memprof_write_csv(const char* prefix);
+
+#endif
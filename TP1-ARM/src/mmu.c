@@ -0,0 +1,165 @@
+#include "mmu.h"
+#include "decode.h"
+#include "shell.h"
+#include <inttypes.h>
+#include <string.h>
+
+// Soft MMU, see mmu.h.
+//
+// Writing SCTLR_EL1 with M = 1 turns translation on. A walk starts at the
+// table TTBR0_EL1 points to and reads up to four descriptors (levels 0-3,
+// 9 bits of the address each) from physical memory. Level 1 and 2 may hold
+// 1 GiB / 2 MiB blocks. AP[2] makes a page read-only, PXN/UXN take away
+// execute permission; the other attribute bits are ignored.
+//
+// The TLB holds 4 KiB translations only, blocks are entered page by page.
+// It is flushed when either register is written. TLBI bumps MMU_EPOCH, so
+// every core drops its entries before its next TLB hit. Stores to the page
+// tables are not seen until then, like on hardware.
+//
+// A missing or invalid descriptor is a translation fault, an access the
+// descriptor doesn't allow a permission fault: both stop the core, like
+// memory faults. Physical addresses outside every region read as 0 and
+// ignore writes, as without the MMU.
+//
+// TLB hits and misses count guest accesses only; walks and descriptor reads
+// also count the lookups of fetches, dumps and the debugger.
+
+#define DESC_VALID      (1ull << 0)
+#define DESC_TABLE      (1ull << 1)     // table (levels 0-2) or page (level 3)
+#define DESC_AP2        (1ull << 7)     // read-only
+#define DESC_PXN        (1ull << 53)
+#define DESC_UXN        (1ull << 54)
+#define DESC_ADDR       0x0000FFFFFFFFF000ull
+
+__thread mem_mmu_t MMU;
+unsigned MMU_EPOCH;
+
+static void flush(void) {
+    memset(MMU.tlb, 0, sizeof(MMU.tlb));
+    MMU.epoch = __atomic_load_n(&MMU_EPOCH, __ATOMIC_ACQUIRE);
+}
+
+void mmu_reset(void) {
+    memset(&MMU, 0, sizeof(MMU));
+    flush();
+}
+
+void mmu_write_sysreg(int key, uint64_t value) {
+    switch (key) {
+        case SYSREG_SCTLR_EL1:
+            MMU.sctlr = value;
+            MMU.enabled = value & 1;
+            break;
+        case SYSREG_TTBR0_EL1:
+            MMU.ttbr0 = value;
+            break;
+        default:
+            return;
+    }
+    flush();
+}
+
+uint64_t mmu_read_sysreg(int key) {
+    return key == SYSREG_SCTLR_EL1 ? MMU.sctlr : key == SYSREG_TTBR0_EL1 ? MMU.ttbr0 : 0;
+}
+
+void mmu_flush_all(void) {
+    __atomic_add_fetch(&MMU_EPOCH, 1, __ATOMIC_RELEASE);
+    flush();
+}
+
+static mem_page_t* fault(const char* kind, uint64_t address, int access, int level) {
+    // Only the first faulting byte of an access is reported
+    if (RUN_BIT == FALSE) return NULL;
+    MMU.faults++;
+    printf("%s fault: %s of 0x%" PRIx64 " at level %d (PC 0x%" PRIx64 ")\n", kind,
+           access & MEM_PERM_W ? "write" : access & MEM_PERM_X ? "execute" : "read",
+           address, level, CURRENT_STATE.PC);
+    RUN_BIT = FALSE;
+    return NULL;
+}
+
+// Descriptors are read from physical memory, with no watchpoints
+static int read_descriptor(uint64_t pa, uint64_t* desc) {
+    mem_page_t* pg = mem_lookup(pa);
+    if (pg == NULL) return 0;
+    memcpy(desc, pg->host + (pa & MEM_PAGE_MASK), 8);
+    MMU.descriptor_reads++;
+    return 1;
+}
+
+// TLB miss: walks the tables and fills the entry. ACCESS 0 never faults.
+mem_page_t* mmu_translate(uint64_t address, int access) {
+    uint64_t vpn = address >> MEM_PAGE_SHIFT;
+    uint64_t table = MMU.ttbr0 & DESC_ADDR;
+    uint64_t desc = 0, pa = 0;
+    int level;
+
+    if (MMU.epoch != __atomic_load_n(&MMU_EPOCH, __ATOMIC_ACQUIRE))
+        flush();
+
+    // A hit on an entry that doesn't allow the access
+    mem_tlb_entry_t* e = mem_tlb_entry(vpn);
+    if (e->tag == vpn + 1)
+        return fault("Permission", address, access, e->level);
+    if (access) MMU.misses++;
+
+    if (address >> 48)
+        return access ? fault("Translation", address, access, 0) : NULL;
+
+    MMU.walks++;
+    for (level = 0; level <= 3; level++) {
+        int shift = 39 - 9 * level;
+        if (!read_descriptor(table + ((address >> shift) & 511) * 8, &desc) || !(desc & DESC_VALID))
+            return access ? fault("Translation", address, access, level) : NULL;
+        if (level < 3 && (desc & DESC_TABLE)) {
+            table = desc & DESC_ADDR;
+            continue;
+        }
+        // Blocks only at levels 1 and 2, pages at level 3
+        if (level == 0 || (level == 3 && !(desc & DESC_TABLE)))
+            return access ? fault("Translation", address, access, level) : NULL;
+        uint64_t size = 1ull << shift;
+        pa = (desc & DESC_ADDR & ~(size - 1)) | (address & (size - 1));
+        break;
+    }
+
+    int perms = MEM_PERM_R;
+    if (!(desc & DESC_AP2)) perms |= MEM_PERM_W;
+    if (!(desc & (DESC_PXN | DESC_UXN))) perms |= MEM_PERM_X;
+
+    mem_page_t* pg = mem_lookup(pa);
+    if (pg != NULL) {
+        e->tag = vpn + 1;
+        e->page = pg;
+        e->perms = perms;
+        e->level = level;
+    }
+    if ((perms & access) != access)
+        return fault("Permission", address, access, level);
+    return pg;
+}
+
+void mmu_report_text(FILE* out) {
+    uint64_t lookups = MMU.hits + MMU.misses;
+
+    fprintf(out, "\nMMU statistics :\n");
+    fprintf(out, "-------------------------------------\n");
+    fprintf(out, "MMU               : %s\n", MMU.enabled ? "on" : "off");
+    fprintf(out, "TTBR0_EL1         : 0x%" PRIx64 "\n", MMU.ttbr0);
+    fprintf(out, "TLB hits          : %" PRIu64 "\n", MMU.hits);
+    fprintf(out, "TLB misses        : %" PRIu64 "\n", MMU.misses);
+    fprintf(out, "TLB hit rate      : %.2f%%\n", lookups ? 100.0 * MMU.hits / lookups : 0.0);
+    fprintf(out, "Page walks        : %" PRIu64 "\n", MMU.walks);
+    fprintf(out, "Descriptor reads  : %" PRIu64 "\n", MMU.descriptor_reads);
+    fprintf(out, "Faults            : %" PRIu64 "\n", MMU.faults);
+    fprintf(out, "\n");
+}
+
+void mmu_report_json(FILE* out) {
+    fprintf(out, "{\"enabled\":%s,\"ttbr0\":\"0x%" PRIx64 "\",\"tlb_hits\":%" PRIu64 ",\"tlb_misses\":%" PRIu64
+                 ",\"walks\":%" PRIu64 ",\"descriptor_reads\":%" PRIu64 ",\"faults\":%" PRIu64 "}",
+            MMU.enabled ? "true" : "false", MMU.ttbr0, MMU.hits, MMU.misses, MMU.walks,
+            MMU.descriptor_reads, MMU.faults);
+}
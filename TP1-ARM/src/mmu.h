@@ -0,0 +1,26 @@
+#ifndef MMU_H
+#define MMU_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "memory.h"
+
+// Soft MMU: AArch64 stage 1 translation with a 4 KiB granule, TTBR0_EL1
+// only (48-bit virtual addresses). The state and the TLB live in MMU, one
+// per host thread, see memory.h for the fast path.
+
+// Back to power-on: MMU off, registers and statistics cleared
+void mmu_reset(void);
+
+// MSR / MRS of SCTLR_EL1 and TTBR0_EL1 (SYSREG_* keys, see decode.h)
+void mmu_write_sysreg(int key, uint64_t value);
+uint64_t mmu_read_sysreg(int key);
+
+// TLBI VMALLE1 / VMALLE1IS: drops the TLB entries of every core
+void mmu_flush_all(void);
+
+// TLB and page walk statistics of the calling thread's core
+void mmu_report_text(FILE* out);
+void mmu_report_json(FILE* out);
+
+#endif
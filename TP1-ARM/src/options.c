@@ -0,0 +1,394 @@
+#include "options.h"
+#include "coherence.h"
+#include "memory.h"
+#include "loop.h"
+#include "scheduler.h"
+#include "smp.h"
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Command-line parsing for the simulator.
+// Without flags the simulator keeps its original behavior: load the programs
+// and start the interactive shell. The batch flags skip the shell entirely.
+
+enum {
+    OPT_COSIM = 256,
+    OPT_RUN_TO_HALT,
+    OPT_MAX_INSNS,
+    OPT_DUMP,
+    OPT_FORMAT,
+    OPT_DUMPSIM,
+    OPT_SERVE,
+    OPT_WORKERS,
+    OPT_MAP_REGION,
+    OPT_SPARSE,
+    OPT_HUGE_PAGES,
+    OPT_MAP_FILE,
+    OPT_GDB,
+    OPT_ANALYZE,
+    OPT_LATENCY_TABLE,
+    OPT_TRANSLATE,
+    OPT_NO_LOOP_ACCEL,
+    OPT_CORES,
+    OPT_QUANTUM,
+    OPT_DETERMINISTIC,
+    OPT_COHERENCE,
+    OPT_MEM_PROFILE,
+    OPT_MEM_PROFILE_CSV,
+    OPT_HOST_PROFILE,
+    OPT_ROI,
+    OPT_SAMPLE,
+    OPT_SAMPLE_CLUSTERS,
+    OPT_SAMPLE_PER_CLUSTER,
+    OPT_SAMPLE_WARMUP,
+    OPT_SAMPLE_VALIDATE,
+    OPT_SCHED,
+    OPT_SCHED_THREADS,
+    OPT_HELP,
+};
+
+static const struct option long_options[] = {
+    {"cosim",       required_argument, NULL, OPT_COSIM},
+    {"run-to-halt", no_argument,       NULL, OPT_RUN_TO_HALT},
+    {"max-insns",   required_argument, NULL, OPT_MAX_INSNS},
+    {"dump",        required_argument, NULL, OPT_DUMP},
+    {"format",      required_argument, NULL, OPT_FORMAT},
+    {"dumpsim",     required_argument, NULL, OPT_DUMPSIM},
+    {"serve",       required_argument, NULL, OPT_SERVE},
+    {"workers",     required_argument, NULL, OPT_WORKERS},
+    {"map-region",  required_argument, NULL, OPT_MAP_REGION},
+    {"sparse",      no_argument,       NULL, OPT_SPARSE},
+    {"huge-pages",  no_argument,       NULL, OPT_HUGE_PAGES},
+    {"map-file",    required_argument, NULL, OPT_MAP_FILE},
+    {"gdb",         required_argument, NULL, OPT_GDB},
+    {"analyze",     no_argument,       NULL, OPT_ANALYZE},
+    {"latency-table", required_argument, NULL, OPT_LATENCY_TABLE},
+    {"translate",   required_argument, NULL, OPT_TRANSLATE},
+    {"no-loop-accel", no_argument,     NULL, OPT_NO_LOOP_ACCEL},
+    {"cores",       required_argument, NULL, OPT_CORES},
+    {"quantum",     required_argument, NULL, OPT_QUANTUM},
+    {"deterministic", no_argument,     NULL, OPT_DETERMINISTIC},
+    {"coherence",   required_argument, NULL, OPT_COHERENCE},
+    {"mem-profile", no_argument,       NULL, OPT_MEM_PROFILE},
+    {"mem-profile-csv", required_argument, NULL, OPT_MEM_PROFILE_CSV},
+    {"host-profile", no_argument,      NULL, OPT_HOST_PROFILE},
+    {"roi",         no_argument,       NULL, OPT_ROI},
+    {"sample",      required_argument, NULL, OPT_SAMPLE},
+    {"sample-clusters", required_argument, NULL, OPT_SAMPLE_CLUSTERS},
+    {"sample-per-cluster", required_argument, NULL, OPT_SAMPLE_PER_CLUSTER},
+    {"sample-warmup", required_argument, NULL, OPT_SAMPLE_WARMUP},
+    {"sample-validate", no_argument,   NULL, OPT_SAMPLE_VALIDATE},
+    {"sched",       required_argument, NULL, OPT_SCHED},
+    {"sched-threads", required_argument, NULL, OPT_SCHED_THREADS},
+    {"help",        no_argument,       NULL, OPT_HELP},
+    {NULL, 0, NULL, 0}
+};
+
+// The option summary. --help prints it and exits with 0, errors after
+// "Error: " and exit with 1.
+static void help(const char* prog, int error) {
+    printf("%susage: %s [options] <program_file_1> <program_file_2> ...\n", error ? "Error: " : "", prog);
+    printf("       %s --serve SOCKET [--workers N]\n\n", prog);
+    printf("Without options the interactive shell is started.\n\n");
+    printf("  --gdb PORT|SOCKET        wait for gdb on a localhost TCP port or a Unix socket\n");
+    printf("  --analyze                estimate the cycles per iteration of each loop\n");
+    printf("  --latency-table FILE     machine description for --analyze\n");
+    printf("  --translate OUT.c        translate the program to a standalone C file\n");
+    printf("  --no-loop-accel          interpret counted loops instruction by instruction\n");
+    printf("  --cores N                run N cores on shared memory, core i starts with X0 = i\n");
+    printf("  --quantum Q              instructions each core runs between synchronizations\n");
+    printf("  --deterministic          cores take turns, one quantum each, in core order\n");
+    printf("  --coherence mesi|moesi   model private caches and report coherence traffic\n");
+    printf("  --mem-profile            page heatmap, reuse distances and strides of loads/stores\n");
+    printf("  --mem-profile-csv PREFIX also write them to PREFIX-{pages,reuse,strides}.csv\n");
+    printf("  --host-profile           host time per instruction type, MIPS of every run\n");
+    printf("  --roi                    collect statistics only between HINT #0x60 and HINT #0x61\n");
+    printf("  --sample N               estimate the CPI from sampled intervals of N instructions\n");
+    printf("  --sample-clusters K      clusters of similar intervals (default 8)\n");
+    printf("  --sample-per-cluster M   intervals simulated in detail per cluster (default 2)\n");
+    printf("  --sample-warmup W        instructions that warm up the caches (default N)\n");
+    printf("  --sample-validate        also simulate the whole program in detail\n");
+    printf("  --sched rr|prio          run each program in its own address space, time-sliced\n");
+    printf("                           by --quantum; with prio, FILE@PRIO (higher runs first)\n");
+    printf("  --sched-threads N        host threads for --sched (default: one per CPU)\n");
+    printf("  --cosim REF_SIM          compare against the reference simulator in lockstep\n");
+    printf("  --run-to-halt            run until HLT (bounded by --max-insns)\n");
+    printf("  --max-insns N            execute at most N instructions\n");
+    printf("  --dump LIST              comma-separated: regs, mem:LO:HI, mmu\n");
+    printf("  --format text|json       output format of the dumps (default: text)\n");
+    printf("  --dumpsim FILE           also write the text dumps to FILE\n");
+    printf("  --serve SOCKET           accept simulation jobs on a Unix domain socket\n");
+    printf("  --workers N              number of worker contexts for --serve\n");
+    printf("  --map-region START:SIZE[:PERMS]\n");
+    printf("                           add a demand-paged region (PERMS: rwx, default rw)\n");
+    printf("  --sparse                 make the whole 64-bit address space readable/writable\n");
+    printf("  --huge-pages             back guest memory with transparent huge pages\n");
+    printf("  --map-file FILE@ADDR[,ro|cow]\n");
+    printf("                           map FILE at ADDR without copying (stores go to FILE\n");
+    printf("                           unless ro or cow)\n");
+    printf("  --help                   show this summary\n");
+    exit(error ? 1 : 0);
+}
+
+static void usage(const char* prog) {
+    help(prog, 1);
+}
+
+// Says which options don't go together, then the usage
+static void conflict(const char* prog, const char* a, const char* b) {
+    printf("Error: %s can't be combined with %s\n", a, b);
+    usage(prog);
+}
+
+static int parse_u64(const char* s, uint64_t* out) {
+    char* end;
+    if (*s == '\0') return -1;
+    *out = strtoull(s, &end, 0);
+    return *end == '\0' ? 0 : -1;
+}
+
+// "START:SIZE[:PERMS]"
+static int parse_region(char* arg) {
+    uint64_t start, size;
+    int perms = MEM_PERM_R | MEM_PERM_W;
+    char* size_str = strchr(arg, ':');
+    if (size_str == NULL) return -1;
+    *size_str++ = '\0';
+    char* perms_str = strchr(size_str, ':');
+    if (perms_str != NULL) {
+        *perms_str++ = '\0';
+        if ((perms = mem_parse_perms(perms_str)) < 0) return -1;
+    }
+    if (parse_u64(arg, &start) < 0 || parse_u64(size_str, &size) < 0 || size == 0)
+        return -1;
+    mem_add_region(start, size, perms);
+    return 0;
+}
+
+// "FILE@ADDR[,ro|cow]"
+static int parse_map_file(char* arg) {
+    uint64_t start;
+    int mode = MAP_FILE_SHARED;
+    char* addr = strrchr(arg, '@');
+    if (addr == NULL || addr == arg) return -1;
+    *addr++ = '\0';
+    char* mode_str = strchr(addr, ',');
+    if (mode_str != NULL) {
+        *mode_str++ = '\0';
+        if (strcmp(mode_str, "ro") == 0) mode = MAP_FILE_RO;
+        else if (strcmp(mode_str, "cow") == 0) mode = MAP_FILE_COW;
+        else return -1;
+    }
+    if (parse_u64(addr, &start) < 0) return -1;
+    return mem_map_file(arg, start, mode);
+}
+
+// "regs,mem:0x10000000:0x10000100,..."
+int parse_dump_list(char* list, SimOptions* opts) {
+    char* save;
+    for (char* item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (strcmp(item, "regs") == 0) {
+            opts->dump_regs = 1;
+        } else if (strcmp(item, "mmu") == 0) {
+            opts->dump_mmu = 1;
+        } else if (strncmp(item, "mem:", 4) == 0) {
+            char* lo = item + 4;
+            char* hi = strchr(lo, ':');
+            if (hi == NULL || opts->num_mem_ranges == MAX_DUMP_RANGES) return -1;
+            *hi++ = '\0';
+            MemRange* r = &opts->mem_ranges[opts->num_mem_ranges];
+            if (parse_u64(lo, &r->start) < 0 || parse_u64(hi, &r->stop) < 0 || r->stop < r->start) return -1;
+            opts->num_mem_ranges++;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void parse_options(int argc, char* argv[], SimOptions* opts) {
+    int c;
+    int sparse = 0;
+    uint64_t n;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->max_insns = -1;
+    opts->cores = 1;
+    opts->quantum = SMP_DEFAULT_QUANTUM;
+    opts->sample_clusters = 8;
+    opts->sample_per_cluster = 2;
+    opts->sample_warmup = -1;
+
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (c) {
+            case OPT_COSIM:
+                opts->cosim_ref = optarg;
+                break;
+            case OPT_RUN_TO_HALT:
+                opts->run_to_halt = 1;
+                opts->batch = 1;
+                break;
+            case OPT_MAX_INSNS:
+                if (parse_u64(optarg, &n) < 0) usage(argv[0]);
+                opts->max_insns = n;
+                opts->batch = 1;
+                break;
+            case OPT_DUMP:
+                if (parse_dump_list(optarg, opts) < 0) {
+                    printf("Error: bad --dump list '%s'\n", optarg);
+                    usage(argv[0]);
+                }
+                opts->batch = 1;
+                break;
+            case OPT_FORMAT:
+                if (strcmp(optarg, "json") == 0) opts->json = 1;
+                else if (strcmp(optarg, "text") == 0) opts->json = 0;
+                else usage(argv[0]);
+                opts->batch = 1;
+                break;
+            case OPT_DUMPSIM:
+                opts->dumpsim_path = optarg;
+                break;
+            case OPT_SERVE:
+                opts->serve_path = optarg;
+                break;
+            case OPT_WORKERS:
+                if (parse_u64(optarg, &n) < 0) usage(argv[0]);
+                opts->workers = n;
+                break;
+            case OPT_MAP_REGION:
+                if (parse_region(optarg) < 0) {
+                    printf("Error: bad --map-region '%s'\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_SPARSE:
+                sparse = 1;
+                break;
+            case OPT_HUGE_PAGES:
+                mem_set_huge_pages(1);
+                break;
+            case OPT_GDB:
+                opts->gdb_target = optarg;
+                break;
+            case OPT_ANALYZE:
+                opts->analyze = 1;
+                break;
+            case OPT_LATENCY_TABLE:
+                opts->latency_table = optarg;
+                break;
+            case OPT_TRANSLATE:
+                opts->translate_path = optarg;
+                break;
+            case OPT_NO_LOOP_ACCEL:
+                LOOP_ACCEL = 0;
+                break;
+            case OPT_CORES:
+                if (parse_u64(optarg, &n) < 0 || n < 1 || n > SMP_MAX_CORES) usage(argv[0]);
+                opts->cores = (int)n;
+                opts->batch = 1;
+                break;
+            case OPT_QUANTUM:
+                if (parse_u64(optarg, &n) < 0 || n < 1 || n > INT_MAX) usage(argv[0]);
+                opts->quantum = (int)n;
+                break;
+            case OPT_DETERMINISTIC:
+                opts->deterministic = 1;
+                break;
+            case OPT_COHERENCE:
+                if (strcmp(optarg, "mesi") == 0) opts->coherence = COH_MESI;
+                else if (strcmp(optarg, "moesi") == 0) opts->coherence = COH_MOESI;
+                else usage(argv[0]);
+                opts->batch = 1;
+                break;
+            case OPT_MEM_PROFILE_CSV:
+                opts->mem_profile_csv = optarg;
+                /* fall through */
+            case OPT_MEM_PROFILE:
+                opts->mem_profile = 1;
+                opts->batch = 1;
+                break;
+            case OPT_HOST_PROFILE:
+                opts->host_profile = 1;
+                break;
+            case OPT_ROI:
+                opts->roi = 1;
+                break;
+            case OPT_SAMPLE:
+                if (parse_u64(optarg, &n) < 0 || n < 1 || n > INT_MAX) usage(argv[0]);
+                opts->sample_interval = (int)n;
+                break;
+            case OPT_SAMPLE_CLUSTERS:
+                if (parse_u64(optarg, &n) < 0 || n < 1 || n > 1024) usage(argv[0]);
+                opts->sample_clusters = (int)n;
+                break;
+            case OPT_SAMPLE_PER_CLUSTER:
+                if (parse_u64(optarg, &n) < 0 || n < 1 || n > INT_MAX) usage(argv[0]);
+                opts->sample_per_cluster = (int)n;
+                break;
+            case OPT_SAMPLE_WARMUP:
+                if (parse_u64(optarg, &n) < 0 || n > INT_MAX) usage(argv[0]);
+                opts->sample_warmup = (int)n;
+                break;
+            case OPT_SAMPLE_VALIDATE:
+                opts->sample_validate = 1;
+                break;
+            case OPT_SCHED:
+                if (strcmp(optarg, "rr") == 0) opts->sched = SCHED_RR;
+                else if (strcmp(optarg, "prio") == 0) opts->sched = SCHED_PRIO;
+                else usage(argv[0]);
+                opts->batch = 1;
+                break;
+            case OPT_SCHED_THREADS:
+                if (parse_u64(optarg, &n) < 0 || n > 1024) usage(argv[0]);
+                opts->sched_threads = (int)n;
+                break;
+            case OPT_MAP_FILE:
+                if (parse_map_file(optarg) < 0) {
+                    printf("Error: bad --map-file '%s'\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case OPT_HELP:
+                help(argv[0], 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    // The catch-all region must come after every explicit one
+    if (sparse)
+        mem_set_sparse(MEM_PERM_R | MEM_PERM_W);
+
+    opts->programs = argv + optind;
+    opts->num_programs = argc - optind;
+    if (opts->num_programs < 1 && opts->serve_path == NULL) {
+        printf("Error: no program file given\n");
+        usage(argv[0]);
+    }
+    if ((opts->cosim_ref != NULL || opts->analyze || opts->translate_path != NULL) && opts->num_programs != 1) {
+        printf("Error: %s takes exactly one program file\n",
+               opts->cosim_ref != NULL ? "--cosim" : opts->analyze ? "--analyze" : "--translate");
+        usage(argv[0]);
+    }
+
+    // Statistics kept by a single core
+    const char* single_core = opts->sample_interval ? "--sample" : opts->mem_profile ? "--mem-profile" :
+                              opts->host_profile ? "--host-profile" : opts->roi ? "--roi" : NULL;
+    if (single_core != NULL && opts->cores > 1)
+        conflict(argv[0], single_core, "--cores");
+    if (opts->sample_interval && opts->coherence)
+        conflict(argv[0], "--sample", "--coherence");
+    // The profiles and the multi-core state are process-wide
+    if (opts->sched) {
+        const char* shared = opts->cores > 1 ? "--cores" : opts->coherence ? "--coherence" :
+                             single_core != NULL ? single_core : opts->gdb_target != NULL ? "--gdb" : NULL;
+        if (shared != NULL)
+            conflict(argv[0], shared, "--sched");
+    }
+}
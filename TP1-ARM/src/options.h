@@ -0,0 +1,59 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdint.h>
+
+#define MAX_DUMP_RANGES 16
+
+typedef struct {
+    uint64_t start;
+    uint64_t stop;
+} MemRange;
+
+// Everything that can be set from the command line
+typedef struct {
+    char** programs;            // program files, in load order
+    int num_programs;
+
+    const char* cosim_ref;      // --cosim <ref_sim>
+
+    int batch;                  // any of the non-interactive flags was given
+    int run_to_halt;            // --run-to-halt
+    long long max_insns;        // --max-insns N (-1 = no limit)
+    int dump_regs;              // --dump regs
+    int dump_mmu;               // --dump mmu
+    MemRange mem_ranges[MAX_DUMP_RANGES]; // --dump mem:LO:HI
+    int num_mem_ranges;
+    int json;                   // --format json
+    const char* dumpsim_path;   // --dumpsim FILE
+
+    const char* serve_path;     // --serve SOCKET
+    const char* gdb_target;     // --gdb PORT|SOCKET
+    int analyze;                // --analyze: static throughput report
+    const char* latency_table;  // --latency-table FILE
+    const char* translate_path; // --translate OUT.c
+    int workers;                // --workers N (0 = one per CPU)
+    int cores;                  // --cores N (1 = no SMP)
+    int quantum;                // --quantum Q
+    int deterministic;          // --deterministic
+    int coherence;              // --coherence mesi|moesi (COH_*, 0 = off)
+    int mem_profile;            // --mem-profile
+    const char* mem_profile_csv; // --mem-profile-csv PREFIX
+    int host_profile;           // --host-profile
+    int roi;                    // --roi: statistics between HINT #0x60 and #0x61 only
+    int sample_interval;        // --sample N (0 = off)
+    int sample_clusters;        // --sample-clusters K
+    int sample_per_cluster;     // --sample-per-cluster M
+    int sample_warmup;          // --sample-warmup W (-1 = one interval)
+    int sample_validate;        // --sample-validate
+    int sched;                  // --sched rr|prio (SCHED_*, 0 = off)
+    int sched_threads;          // --sched-threads N (0 = one per CPU)
+} SimOptions;
+
+// Parses argv into opts. Prints the usage and exits on any error.
+void parse_options(int argc, char* argv[], SimOptions* opts);
+
+// Parses a --dump list ("regs,mem:LO:HI,...") into opts. Returns -1 on error.
+int parse_dump_list(char* list, SimOptions* opts);
+
+#endif
@@ -0,0 +1,60 @@
+#include "roi.h"
+#include "coherence.h"
+#include "hostprof.h"
+#include "memprof.h"
+#include "shell.h"
+#include <inttypes.h>
+
+// Region of interest, see roi.h.
+
+int ROI_ENABLED;
+int ROI_INSIDE = 1;
+
+// Collectors the markers switch, as they were configured
+static int coherence, memprof, hostprof;
+
+static int regions;
+static uint64_t instructions;
+static int entered_at;
+
+void roi_init(void) {
+    coherence = COHERENCE;
+    memprof = MEMPROF;
+    hostprof = HOSTPROF;
+    COHERENCE = MEMPROF = HOSTPROF = 0;
+    regions = 0;
+    instructions = 0;
+    ROI_INSIDE = 0;
+    ROI_ENABLED = 1;
+}
+
+void roi_marker(int hint) {
+    int inside = hint == ROI_BEGIN_HINT;
+    if (!ROI_ENABLED || inside == ROI_INSIDE) return;
+
+    ROI_INSIDE = inside;
+    COHERENCE = inside ? coherence : 0;
+    MEMPROF = inside ? memprof : 0;
+    HOSTPROF = inside ? hostprof : 0;
+    if (inside) {
+        regions++;
+        entered_at = INSTRUCTION_COUNT;
+    } else {
+        instructions += INSTRUCTION_COUNT - entered_at;
+    }
+}
+
+// A program that stops inside the region counts up to where it stopped
+static uint64_t total(void) {
+    return instructions + (ROI_INSIDE ? (uint64_t)(INSTRUCTION_COUNT - entered_at) : 0);
+}
+
+void roi_report_text(FILE* out) {
+    fprintf(out, "\nRegion of interest: %d region%s, %" PRIu64 " instructions%s\n",
+            regions, regions == 1 ? "" : "s", total(), ROI_INSIDE ? " (still inside)" : "");
+}
+
+void roi_report_json(FILE* out) {
+    fprintf(out, "{\"regions\":%d,\"instructions\":%" PRIu64 ",\"inside\":%s}",
+            regions, total(), ROI_INSIDE ? "true" : "false");
+}
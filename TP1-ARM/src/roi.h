@@ -0,0 +1,32 @@
+#ifndef ROI_H
+#define ROI_H
+
+#include <stdio.h>
+
+// Region of interest (--roi).
+//
+// HINT #0x60 begins the region and HINT #0x61 ends it; both are NOPs on
+// real hardware, so the same binary runs anywhere. With --roi the statistics
+// collectors (--coherence, --mem-profile, --host-profile) only run inside
+// the region and --sample only samples it; outside it the program runs in
+// fast mode. Without --roi the markers do nothing. Single core only: the
+// region is measured with the instruction count of the core that runs it.
+
+#define ROI_BEGIN_HINT  0x60
+#define ROI_END_HINT    0x61
+
+extern int ROI_ENABLED;         // --roi
+extern int ROI_INSIDE;          // in the region (always 1 without --roi)
+
+// Called once the collectors are on: switches them off until the first
+// begin marker
+void roi_init(void);
+
+// HINT #0x60 / #0x61
+void roi_marker(int hint);
+
+// Regions entered and instructions run in them
+void roi_report_text(FILE* out);
+void roi_report_json(FILE* out);
+
+#endif
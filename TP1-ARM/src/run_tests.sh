@@ -3,33 +3,55 @@
 OUTPUT_DIR=tests_outputs
 mkdir -p "$OUTPUT_DIR"
 
-# Redirect stdout and stderr to final_results.txt inside the output directory
-exec > "$OUTPUT_DIR"/final_results.txt 2>&1
+# Reference results only depend on the reference binary, the program and the
+# commands we feed it, so they are cached under a hash of those three
+REF_SIM=./ref_sim_x86
+CACHE_DIR=${REF_CACHE_DIR:-.ref_cache}
+mkdir -p "$CACHE_DIR"
 
-# Loop through each test file in the inputs directory
-for test in ../inputs/tests_1/*.x; do
-    echo "Running test for $test"
-    
-    # Get the base name of the test file without extension for unique output filenames
-    TEST_NAME=$(basename "$test" .x)
-    
-    # Run the reference simulator and capture its output
-    ./ref_sim_x86 "$test" <<EOF > "$OUTPUT_DIR"/ref_output_"$TEST_NAME".txt
-go
-rdump
-quit
-EOF
+# Number of tests to run at the same time
+JOBS=${JOBS:-$(nproc 2>/dev/null || echo 4)}
 
-    # Run your simulator and capture its output
-    ./sim "$test" <<EOF > "$OUTPUT_DIR"/sim_output_"$TEST_NAME".txt
-go
+# Commands sent to both simulators
+COMMANDS='go
 rdump
-quit
-EOF
+mdump 0x10000000 0x100000fc
+quit'
+
+REF_HASH=$(sha256sum "$REF_SIM" | cut -d' ' -f1)
+
+# Keep only the section from the register dump onward
+filter() {
+    sed -n '/^Current register\/bus values/,$p'
+}
+
+# Same dumps as COMMANDS, for the batch runs
+DUMP=regs,mem:0x10000000:0x100000fc
+
+# Just the dumps: no shell prompts or blank lines
+dumps_only() {
+    grep -v '^ARM-SIM>\|^Bye\.$' | sed '/^$/d'
+}
+
+run_test() {
+    local test=$1
+    local TEST_NAME=$(basename "$test" .x)
+    local key=$( { echo "$REF_HASH"; sha256sum < "$test"; echo "$COMMANDS"; } | sha256sum | cut -d' ' -f1)
+    local cached="$CACHE_DIR/$key.txt"
+
+    echo "Running test for $test"
 
-    # Filter outputs: extract only the section from the register dump onward
-    sed -n '/^Current register\/bus values/,$p' "$OUTPUT_DIR"/ref_output_"$TEST_NAME".txt > "$OUTPUT_DIR"/ref_filtered_"$TEST_NAME".txt
-    sed -n '/^Current register\/bus values/,$p' "$OUTPUT_DIR"/sim_output_"$TEST_NAME".txt > "$OUTPUT_DIR"/sim_filtered_"$TEST_NAME".txt
+    # Reference output: from the cache, or run it once and store it
+    if [ -f "$cached" ]; then
+        cp "$cached" "$OUTPUT_DIR"/ref_filtered_"$TEST_NAME".txt
+    else
+        echo "$COMMANDS" | "$REF_SIM" "$test" | filter > "$OUTPUT_DIR"/ref_filtered_"$TEST_NAME".txt
+        # $$ is the parent shell in the background subshells, $BASHPID is ours
+        cp "$OUTPUT_DIR"/ref_filtered_"$TEST_NAME".txt "$cached.$BASHPID" && mv "$cached.$BASHPID" "$cached"
+    fi
+
+    # Run your simulator and capture its output
+    echo "$COMMANDS" | ./sim "$test" | filter > "$OUTPUT_DIR"/sim_filtered_"$TEST_NAME".txt
 
     # Compare the filtered outputs
     if diff -q "$OUTPUT_DIR"/ref_filtered_"$TEST_NAME".txt "$OUTPUT_DIR"/sim_filtered_"$TEST_NAME".txt > /dev/null; then
@@ -37,5 +59,35 @@ EOF
     else
         echo "Test $test failed. Differences:"
         diff "$OUTPUT_DIR"/ref_filtered_"$TEST_NAME".txt "$OUTPUT_DIR"/sim_filtered_"$TEST_NAME".txt
+
+        # Run both simulators in lockstep to find the first instruction that differs
+        ./sim --cosim "$REF_SIM" "$test" | sed -n '/^Divergence/,$p'
     fi
+
+    # The shell traces every instruction, so it runs them one by one. Batch
+    # runs fuse pairs and run counted loops ahead (only fuse with
+    # --no-loop-accel); neither may change the results.
+    dumps_only < "$OUTPUT_DIR"/sim_filtered_"$TEST_NAME".txt > "$OUTPUT_DIR"/plain_"$TEST_NAME".txt
+    for flags in "" "--no-loop-accel"; do
+        ./sim --run-to-halt --dump "$DUMP" $flags "$test" | filter | dumps_only > "$OUTPUT_DIR"/fast_"$TEST_NAME".txt
+        if ! diff -q "$OUTPUT_DIR"/plain_"$TEST_NAME".txt "$OUTPUT_DIR"/fast_"$TEST_NAME".txt > /dev/null; then
+            echo "Fast paths ${flags:-(all)} for $test failed. Differences:"
+            diff "$OUTPUT_DIR"/plain_"$TEST_NAME".txt "$OUTPUT_DIR"/fast_"$TEST_NAME".txt
+        fi
+    done
+}
+
+# Run the tests in parallel, each one into its own results file
+TESTS=(../inputs/tests_1/*.x)
+for test in "${TESTS[@]}"; do
+    while [ "$(jobs -rp | wc -l)" -ge "$JOBS" ]; do
+        wait -n
+    done
+    run_test "$test" > "$OUTPUT_DIR"/result_"$(basename "$test" .x)".txt 2>&1 &
 done
+wait
+
+# Collect the results in order into final_results.txt inside the output directory
+for test in "${TESTS[@]}"; do
+    cat "$OUTPUT_DIR"/result_"$(basename "$test" .x)".txt
+done > "$OUTPUT_DIR"/final_results.txt
@@ -0,0 +1,453 @@
+#include "sample.h"
+#include "cfg.h"
+#include "roi.h"
+#include "shell.h"
+#include "timing.h"
+#include <float.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sampled simulation, in the spirit of SimPoint.
+//
+//   1. The program runs on the normal engine, split in intervals of N
+//      instructions. Each interval gets a basic-block vector: the
+//      instructions it ran in each block of the load-time CFG, as a fraction
+//      of the interval, randomly projected down to SAMPLE_DIMS dimensions.
+//   2. The vectors are grouped by k-means (k-means++ seeding, fixed seed).
+//      Each cluster is sampled: the interval closest to its centroid, plus
+//      random members up to --sample-per-cluster.
+//   3. The program runs again on the normal engine. A checkpoint is taken
+//      W instructions before each sampled interval; from there the timing
+//      model (timing.c) warms up its caches for W instructions and measures
+//      the interval. The run then goes back to the checkpoint and on.
+//
+// The clusters are the strata of a stratified sample: the estimate is
+// sum(w_h * mean_h), w_h being the share of the program's instructions in
+// cluster h, and its 95% bound 1.96 * sqrt(sum(w_h^2 * (1 - n_h/N_h) *
+// s_h^2 / n_h)). A cluster with a single sample uses the variance pooled
+// over the others. --sample-validate also runs every interval through the
+// timing model and prints the real error.
+
+#define SAMPLE_DIMS       15
+#define SAMPLE_MAX_ITERS  100
+#define SAMPLE_SEED       0x5eed5eedULL
+
+typedef struct {
+    int start;                  // instruction count at the start
+    int len;
+    float v[SAMPLE_DIMS];       // projected basic-block vector
+    int cluster;
+    double cpi;                 // sampled intervals only
+    int sampled;
+} Interval;
+
+static Interval* intervals;
+static int nintervals;
+
+static uint64_t rng_state = SAMPLE_SEED;
+
+// splitmix64
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t rng(void) {
+    return mix(rng_state++);
+}
+
+// Entry (BLOCK, DIM) of the projection matrix, uniform in [-1, 1]
+static float projection(int block, int dim) {
+    uint64_t h = mix(((uint64_t)block << 4) | (uint64_t)dim);
+    return (float)((double)(h >> 11) / (double)(1ULL << 52) - 1.0);
+}
+
+/***************************************************************/
+/* Pass 1: basic-block vectors                                 */
+/***************************************************************/
+
+// Block of the instruction at PC; code outside the loaded text all counts
+// as one extra block
+static int block_at(uint64_t pc) {
+    const Cfg* cfg = &PROGRAM_CFG;
+    if (pc >= cfg->base && (pc - cfg->base) / 4 < (uint64_t)cfg->ninsns)
+        return cfg->block_of[(pc - cfg->base) / 4];
+    return cfg->nblocks;
+}
+
+static int budget_end(long long max_insns, long long want) {
+    if (max_insns >= 0 && want > max_insns) want = max_insns;
+    return want > INT_MAX ? INT_MAX : (int)want;
+}
+
+// Runs on the normal engine up to instruction TO
+static void fast_forward(int to) {
+    INSTRUCTION_LIMIT = to;
+    while (RUN_BIT == TRUE && INSTRUCTION_COUNT < INSTRUCTION_LIMIT)
+        cycle();
+    INSTRUCTION_LIMIT = INT_MAX;
+}
+
+// With --roi, intervals only cover the region of interest: they end at the
+// end marker, and the code outside the region runs without vectors
+static void collect_vectors(int n, long long max_insns) {
+    int nblocks = PROGRAM_CFG.nblocks + 1;
+    int* counts = calloc(nblocks, sizeof(int));
+    int capacity = 0;
+
+    while (RUN_BIT == TRUE) {
+        INSTRUCTION_LIMIT = budget_end(max_insns, INT_MAX);
+        while (RUN_BIT == TRUE && !ROI_INSIDE && INSTRUCTION_COUNT < INSTRUCTION_LIMIT)
+            cycle();
+
+        int start = INSTRUCTION_COUNT;
+        INSTRUCTION_LIMIT = budget_end(max_insns, (long long)start + n);
+        while (RUN_BIT == TRUE && ROI_INSIDE && INSTRUCTION_COUNT < INSTRUCTION_LIMIT) {
+            uint64_t pc = CURRENT_STATE.PC;
+            int before = INSTRUCTION_COUNT;
+            cycle();
+            counts[block_at(pc)] += INSTRUCTION_COUNT - before;
+        }
+        INSTRUCTION_LIMIT = INT_MAX;
+        if (INSTRUCTION_COUNT == start) break;
+
+        if (nintervals == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            intervals = realloc(intervals, capacity * sizeof(Interval));
+        }
+        Interval* iv = &intervals[nintervals++];
+        memset(iv, 0, sizeof(*iv));
+        iv->start = start;
+        iv->len = INSTRUCTION_COUNT - start;
+        for (int b = 0; b < nblocks; b++) {
+            if (counts[b] == 0) continue;
+            float share = (float)counts[b] / iv->len;
+            for (int k = 0; k < SAMPLE_DIMS; k++)
+                iv->v[k] += share * projection(b, k);
+            counts[b] = 0;
+        }
+    }
+    free(counts);
+}
+
+/***************************************************************/
+/* Clustering                                                  */
+/***************************************************************/
+
+static double distance(const float* a, const float* b) {
+    double d = 0;
+    for (int k = 0; k < SAMPLE_DIMS; k++)
+        d += (double)(a[k] - b[k]) * (a[k] - b[k]);
+    return d;
+}
+
+// Returns the number of non-empty clusters; their centroids are in CENTERS
+static int kmeans(int k, float (*centers)[SAMPLE_DIMS]) {
+    double* nearest = malloc(nintervals * sizeof(double));
+
+    // k-means++: each new center is drawn with probability proportional to
+    // the squared distance to the closest center so far
+    memcpy(centers[0], intervals[rng() % nintervals].v, sizeof(centers[0]));
+    for (int c = 1; c < k; c++) {
+        double total = 0;
+        for (int i = 0; i < nintervals; i++) {
+            nearest[i] = DBL_MAX;
+            for (int j = 0; j < c; j++) {
+                double d = distance(intervals[i].v, centers[j]);
+                if (d < nearest[i]) nearest[i] = d;
+            }
+            total += nearest[i];
+        }
+        if (total == 0) {
+            k = c;      // fewer distinct vectors than clusters
+            break;
+        }
+        double r = (double)(rng() >> 11) / (double)(1ULL << 53) * total;
+        int pick = nintervals - 1;
+        for (int i = 0; i < nintervals; i++) {
+            if ((r -= nearest[i]) < 0) {
+                pick = i;
+                break;
+            }
+        }
+        memcpy(centers[c], intervals[pick].v, sizeof(centers[0]));
+    }
+    free(nearest);
+
+    int* members = malloc(k * sizeof(int));
+    for (int iter = 0; iter < SAMPLE_MAX_ITERS; iter++) {
+        int changed = 0;
+        for (int i = 0; i < nintervals; i++) {
+            int best = 0;
+            for (int c = 1; c < k; c++) {
+                if (distance(intervals[i].v, centers[c]) < distance(intervals[i].v, centers[best]))
+                    best = c;
+            }
+            if (iter == 0 || intervals[i].cluster != best) changed = 1;
+            intervals[i].cluster = best;
+        }
+        if (!changed) break;
+
+        memset(centers, 0, k * sizeof(centers[0]));
+        memset(members, 0, k * sizeof(int));
+        for (int i = 0; i < nintervals; i++) {
+            int c = intervals[i].cluster;
+            members[c]++;
+            for (int d = 0; d < SAMPLE_DIMS; d++)
+                centers[c][d] += intervals[i].v[d];
+        }
+        for (int c = 0; c < k; c++) {
+            for (int d = 0; d < SAMPLE_DIMS && members[c]; d++)
+                centers[c][d] /= members[c];
+        }
+    }
+
+    // Renumber so that only non-empty clusters remain
+    int* renumber = malloc(k * sizeof(int));
+    int used = 0;
+    memset(members, 0, k * sizeof(int));
+    for (int i = 0; i < nintervals; i++)
+        members[intervals[i].cluster]++;
+    for (int c = 0; c < k; c++) {
+        renumber[c] = members[c] ? used : -1;
+        if (members[c]) memmove(centers[used++], centers[c], sizeof(centers[0]));
+    }
+    for (int i = 0; i < nintervals; i++)
+        intervals[i].cluster = renumber[intervals[i].cluster];
+    free(renumber);
+    free(members);
+    return used;
+}
+
+// Marks the intervals to simulate in detail
+static void choose_samples(int k, float (*centers)[SAMPLE_DIMS], int per_cluster) {
+    if (nintervals <= 0) return;
+    int* members = malloc(nintervals * sizeof(int));
+
+    for (int c = 0; c < k; c++) {
+        int n = 0, closest = 0;
+        for (int i = 0; i < nintervals; i++) {
+            if (intervals[i].cluster != c) continue;
+            members[n] = i;
+            if (distance(intervals[i].v, centers[c]) < distance(intervals[members[closest]].v, centers[c]))
+                closest = n;
+            n++;
+        }
+        intervals[members[closest]].sampled = 1;
+        members[closest] = members[--n];
+
+        // Then random members, without repetition
+        for (int s = 1; s < per_cluster && n > 0; s++) {
+            int pick = (int)(rng() % n);
+            intervals[members[pick]].sampled = 1;
+            members[pick] = members[--n];
+        }
+    }
+    free(members);
+}
+
+/***************************************************************/
+/* Pass 2: detailed simulation of the samples                  */
+/***************************************************************/
+
+// Returns the instructions run through the timing model, warm-up included
+static long long simulate_samples(const sim_checkpoint_t* start, int warmup) {
+    long long detailed = 0;
+    sim_checkpoint_t cp = { 0 };
+
+    restore_checkpoint(start);
+    for (int i = 0; i < nintervals; i++) {
+        Interval* iv = &intervals[i];
+        if (!iv->sampled) continue;
+
+        // Fast-forward to the start of the warm-up
+        fast_forward(iv->start - warmup);
+
+        save_checkpoint(&cp);
+        int warm_from = INSTRUCTION_COUNT;
+        timing_reset();
+        timing_run(iv->start);
+        memset(&TIMING, 0, sizeof(TIMING));
+        timing_run(iv->start + iv->len);
+        iv->cpi = TIMING.instructions ? (double)TIMING.cycles / TIMING.instructions : 0;
+        detailed += INSTRUCTION_COUNT - warm_from;
+        restore_checkpoint(&cp);
+        free_checkpoint(&cp);
+    }
+    return detailed;
+}
+
+/***************************************************************/
+/* Estimate and report                                         */
+/***************************************************************/
+
+typedef struct {
+    int intervals;              // N_h
+    int samples;                // n_h
+    double weight;              // w_h
+    double mean;                // mean CPI of the samples
+    double var;                 // sample variance (n_h >= 2)
+} Stratum;
+
+static void stratify(int k, Stratum* st, int total) {
+    memset(st, 0, k * sizeof(Stratum));
+    for (int i = 0; i < nintervals; i++) {
+        Stratum* s = &st[intervals[i].cluster];
+        s->intervals++;
+        s->weight += (double)intervals[i].len / total;
+        if (intervals[i].sampled) {
+            s->samples++;
+            s->mean += intervals[i].cpi;
+        }
+    }
+    for (int c = 0; c < k; c++)
+        st[c].mean /= st[c].samples;
+    for (int i = 0; i < nintervals; i++) {
+        Stratum* s = &st[intervals[i].cluster];
+        if (intervals[i].sampled && s->samples > 1)
+            s->var += (intervals[i].cpi - s->mean) * (intervals[i].cpi - s->mean) / (s->samples - 1);
+    }
+}
+
+// Returns the 95% half-width of the estimate, or -1 if no cluster had two
+// samples to tell the variance from
+static double bound(int k, const Stratum* st) {
+    double pooled = 0, var = 0;
+    int dof = 0;
+
+    for (int c = 0; c < k; c++) {
+        if (st[c].samples > 1) {
+            pooled += st[c].var * (st[c].samples - 1);
+            dof += st[c].samples - 1;
+        }
+    }
+    if (dof == 0) {
+        for (int c = 0; c < k; c++) {
+            if (st[c].samples < st[c].intervals) return -1;
+        }
+        return 0;       // every interval was simulated
+    }
+    pooled /= dof;
+
+    for (int c = 0; c < k; c++) {
+        double s2 = st[c].samples > 1 ? st[c].var : pooled;
+        double fpc = 1.0 - (double)st[c].samples / st[c].intervals;
+        var += st[c].weight * st[c].weight * fpc * s2 / st[c].samples;
+    }
+    return 1.96 * sqrt(var);
+}
+
+static void report_text(int k, const Stratum* st, int total, int n, long long detailed,
+                        double cpi, double half, double true_cpi) {
+    printf("Sampled simulation: %d instructions, %d intervals of %d, %d clusters\n\n",
+           total, nintervals, n, k);
+    printf("Cluster  Intervals  Weight  CPI       Sampled intervals\n");
+    for (int c = 0; c < k; c++) {
+        printf("%7d  %9d  %5.1f%%  %-8.4f ", c, st[c].intervals, 100 * st[c].weight, st[c].mean);
+        for (int i = 0; i < nintervals; i++) {
+            if (intervals[i].cluster == c && intervals[i].sampled)
+                printf(" %d", i);
+        }
+        printf("\n");
+    }
+    printf("\nDetailed: %lld instructions with warm-up (%.1f%% of the program)\n",
+           detailed, 100.0 * detailed / total);
+    if (half >= 0)
+        printf("Estimated CPI: %.4f +- %.4f (95%%)\n", cpi, half);
+    else
+        printf("Estimated CPI: %.4f (no bound: use --sample-per-cluster 2 or more)\n", cpi);
+    printf("Estimated cycles: %.0f\n", cpi * total);
+    if (true_cpi > 0) {
+        printf("True CPI: %.4f (error %.2f%%", true_cpi, 100 * fabs(cpi - true_cpi) / true_cpi);
+        if (half >= 0)
+            printf(", %s the bound", fabs(cpi - true_cpi) <= half + 1e-9 * true_cpi ? "within" : "outside");
+        printf(")\n");
+    }
+}
+
+static void report_json(int k, const Stratum* st, int total, int n, long long detailed,
+                        double cpi, double half, double true_cpi) {
+    printf("{\"instructions\": %d, \"interval\": %d, \"intervals\": %d, \"detailed\": %lld, \"clusters\": [",
+           total, n, nintervals, detailed);
+    for (int c = 0; c < k; c++) {
+        printf("%s{\"intervals\": %d, \"weight\": %.6f, \"cpi\": %.6f, \"sampled\": [",
+               c ? ", " : "", st[c].intervals, st[c].weight, st[c].mean);
+        int first = 1;
+        for (int i = 0; i < nintervals; i++) {
+            if (intervals[i].cluster == c && intervals[i].sampled) {
+                printf("%s%d", first ? "" : ", ", i);
+                first = 0;
+            }
+        }
+        printf("]}");
+    }
+    printf("], \"cpi\": %.6f", cpi);
+    if (half >= 0) printf(", \"bound\": %.6f", half);
+    if (true_cpi > 0) printf(", \"true_cpi\": %.6f", true_cpi);
+    printf("}\n");
+}
+
+int sample_main(const SimOptions* opts) {
+    int n = opts->sample_interval;
+    int warmup = opts->sample_warmup >= 0 ? opts->sample_warmup : n;
+    sim_checkpoint_t start = { 0 };
+
+    VERBOSE = FALSE;
+    initialize(opts->programs, opts->num_programs);
+    save_checkpoint(&start);
+
+    if (opts->roi)
+        roi_init();
+
+    collect_vectors(n, opts->max_insns);
+    int total = 0;
+    for (int i = 0; i < nintervals; i++)
+        total += intervals[i].len;
+    if (nintervals == 0) {
+        printf("Error: no instructions to sample\n");
+        return 1;
+    }
+
+    int k = opts->sample_clusters < nintervals ? opts->sample_clusters : nintervals;
+    float (*centers)[SAMPLE_DIMS] = malloc(k * sizeof(*centers));
+    k = kmeans(k, centers);
+    choose_samples(k, centers, opts->sample_per_cluster);
+    free(centers);
+
+    long long detailed = simulate_samples(&start, warmup);
+
+    Stratum* st = malloc(k * sizeof(Stratum));
+    stratify(k, st, total);
+    double cpi = 0;
+    for (int c = 0; c < k; c++)
+        cpi += st[c].weight * st[c].mean;
+    double half = bound(k, st);
+
+    double true_cpi = 0;
+    if (opts->sample_validate) {
+        // Every interval in detail, the model carrying its state across
+        restore_checkpoint(&start);
+        timing_reset();
+        for (int i = 0; i < nintervals; i++) {
+            fast_forward(intervals[i].start);
+            timing_run(intervals[i].start + intervals[i].len);
+        }
+        true_cpi = (double)TIMING.cycles / TIMING.instructions;
+    }
+    free_checkpoint(&start);
+
+    if (opts->json)
+        report_json(k, st, total, n, detailed, cpi, half, true_cpi);
+    else
+        report_text(k, st, total, n, detailed, cpi, half, true_cpi);
+
+    free(st);
+    free(intervals);
+    return 0;
+}
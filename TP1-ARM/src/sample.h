@@ -0,0 +1,11 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include "options.h"
+
+// Sampled simulation (--sample N): estimates the CPI of the whole program
+// from a few intervals run through the timing model. Returns the process
+// exit status.
+int sample_main(const SimOptions* opts);
+
+#endif
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include "scheduler.h"
+#include "batch.h"
+#include "loop.h"
+#include "shell.h"
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Multi-program runs, see scheduler.h.
+//
+// The programs are loaded one after the other on the main thread, each into
+// a fresh address space made from the --map-region / --sparse configuration
+// (file regions end up shared). The per-instruction globals, MEM and the loop
+// table are all per host thread, so a pool thread switches to a program by
+// loading its context into them, runs one quantum with the unchanged
+// interpreter, and saves the context back.
+//
+// The ready queue is a flag and a sequence number per program: a thread takes
+// the ready program with the highest priority that was queued first, so with
+// one priority it is plain round robin. Strict priorities starve the lower
+// ones for as long as enough higher ones are ready to keep every thread busy.
+// A program leaves the queue once it halts or uses up --max-insns.
+
+typedef struct {
+    const char* file;
+    int priority;
+    mem_space_t* space;
+    LoopTable* loops;
+    CPU_State state;
+    int instruction_count;
+    int run_bit;
+    mem_mmu_t mmu;
+    uint64_t slices;
+    int ready;
+    uint64_t queued_at;         // sequence number: FIFO within a priority
+} Program;
+
+__thread int SCHED_RUNNING;
+
+static struct {
+    Program* programs;
+    int nprograms;
+    int quantum;
+    long long max_insns;
+    int active;                 // programs that can still run
+    uint64_t next_seq;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} sched = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+};
+
+static void switch_to(const Program* p) {
+    MEM = p->space;
+    MEM_LAST_VPN = UINT64_MAX;
+    loop_table_use(p->loops);
+    MMU = p->mmu;
+    CURRENT_STATE = p->state;
+    NEXT_STATE = p->state;
+    INSTRUCTION_COUNT = p->instruction_count;
+    RUN_BIT = p->run_bit;
+}
+
+static void save_context(Program* p) {
+    p->state = CURRENT_STATE;
+    p->instruction_count = INSTRUCTION_COUNT;
+    p->run_bit = RUN_BIT;
+    p->mmu = MMU;
+}
+
+// FILE or, with --sched prio, FILE@PRIO
+static void parse_program(Program* p, char* arg, int policy) {
+    char* at = strrchr(arg, '@');
+    char* end;
+
+    p->file = arg;
+    if (policy != SCHED_PRIO || at == NULL)
+        return;
+    long prio = strtol(at + 1, &end, 10);
+    if (at[1] == '\0' || *end != '\0' || prio < INT_MIN || prio > INT_MAX) {
+        printf("Error: bad priority in '%s'\n", arg);
+        exit(-1);
+    }
+    *at = '\0';
+    p->priority = (int)prio;
+}
+
+static void load(Program* p) {
+    p->space = mem_space_new();
+    p->loops = loop_table_new();
+    MEM = p->space;
+    loop_table_use(p->loops);
+
+    init_memory();
+    memset(&CURRENT_STATE, 0, sizeof(CURRENT_STATE));
+    INSTRUCTION_COUNT = 0;
+    RUN_BIT = TRUE;
+    load_program((char*)p->file);
+    NEXT_STATE = CURRENT_STATE;
+    save_context(p);
+}
+
+// The ready program to run next, NULL if none. Called with sched.lock held.
+static Program* pick(void) {
+    Program* best = NULL;
+
+    for (int i = 0; i < sched.nprograms; i++) {
+        Program* p = &sched.programs[i];
+        if (!p->ready) continue;
+        if (best == NULL || p->priority > best->priority ||
+            (p->priority == best->priority && p->queued_at < best->queued_at))
+            best = p;
+    }
+    return best;
+}
+
+// Runs one quantum of the current program. Returns whether it can run
+// again: not halted and not out of budget.
+static int run_quantum(void) {
+    long long limit = (long long)INSTRUCTION_COUNT + sched.quantum;
+    if (sched.max_insns >= 0 && limit > sched.max_insns) limit = sched.max_insns;
+    if (limit > INT_MAX) limit = INT_MAX;
+
+    INSTRUCTION_LIMIT = (int)limit;
+    while (RUN_BIT == TRUE && INSTRUCTION_COUNT < INSTRUCTION_LIMIT)
+        cycle();
+    INSTRUCTION_LIMIT = INT_MAX;
+
+    return RUN_BIT == TRUE && (sched.max_insns < 0 || INSTRUCTION_COUNT < sched.max_insns);
+}
+
+static void* worker_main(void* arg) {
+    (void)arg;
+    SCHED_RUNNING = 1;
+
+    for (;;) {
+        Program* p;
+
+        pthread_mutex_lock(&sched.lock);
+        while ((p = pick()) == NULL && sched.active > 0)
+            pthread_cond_wait(&sched.ready, &sched.lock);
+        if (p == NULL) {
+            pthread_mutex_unlock(&sched.lock);
+            return NULL;
+        }
+        p->ready = 0;
+        pthread_mutex_unlock(&sched.lock);
+
+        switch_to(p);
+        int again = run_quantum();
+        save_context(p);
+
+        pthread_mutex_lock(&sched.lock);
+        p->slices++;
+        if (again) {
+            p->ready = 1;
+            p->queued_at = sched.next_seq++;
+            pthread_cond_signal(&sched.ready);
+        } else if (--sched.active == 0) {
+            pthread_cond_broadcast(&sched.ready);
+        }
+        pthread_mutex_unlock(&sched.lock);
+    }
+}
+
+static void report_text(FILE* out, const SimOptions* opts, int nthreads, double seconds) {
+    uint64_t total = 0, slices = 0;
+
+    fprintf(out, "Scheduler: %s, %d programs, %d host threads, quantum %d\n",
+            opts->sched == SCHED_PRIO ? "priority" : "round robin",
+            sched.nprograms, nthreads, sched.quantum);
+    fprintf(out, "  #  %-24s %8s %14s %10s  %s\n", "program", "priority", "instructions", "slices", "state");
+    for (int i = 0; i < sched.nprograms; i++) {
+        const Program* p = &sched.programs[i];
+        fprintf(out, "%3d  %-24s %8d %14d %10" PRIu64 "  %s\n", i, p->file, p->priority,
+                p->instruction_count, p->slices, p->run_bit ? "running" : "halted");
+        total += p->instruction_count;
+        slices += p->slices;
+    }
+    fprintf(out, "Total: %" PRIu64 " instructions in %" PRIu64 " slices, %.3f s, %.2f MIPS\n",
+            total, slices, seconds, seconds > 0 ? total / seconds / 1e6 : 0.0);
+
+    for (int i = 0; i < sched.nprograms; i++) {
+        switch_to(&sched.programs[i]);
+        fprintf(out, "\nProgram %d (%s):", i, sched.programs[i].file);
+        batch_report(out, opts);
+    }
+}
+
+// {"policy":...,"programs":[{...,"report":<the batch report>}],...}
+static void report_json(FILE* out, const SimOptions* opts, int nthreads, double seconds) {
+    uint64_t total = 0, slices = 0;
+
+    for (int i = 0; i < sched.nprograms; i++) {
+        total += sched.programs[i].instruction_count;
+        slices += sched.programs[i].slices;
+    }
+    fprintf(out, "{\"policy\":\"%s\",\"threads\":%d,\"quantum\":%d,\"instructions\":%" PRIu64
+            ",\"slices\":%" PRIu64 ",\"seconds\":%.6f,\"programs\":[",
+            opts->sched == SCHED_PRIO ? "prio" : "rr", nthreads, sched.quantum, total, slices, seconds);
+    for (int i = 0; i < sched.nprograms; i++) {
+        const Program* p = &sched.programs[i];
+        switch_to(p);
+        fprintf(out, "%s{\"file\":\"%s\",\"priority\":%d,\"slices\":%" PRIu64 ",\"report\":",
+                i ? "," : "", p->file, p->priority, p->slices);
+        batch_report(out, opts);
+        fprintf(out, "}");
+    }
+    fprintf(out, "]}\n");
+}
+
+int sched_main(const SimOptions* opts) {
+    char* buf = NULL;
+    size_t len = 0;
+    struct timespec t0, t1;
+    mem_space_t* saved_mem = MEM;
+
+    VERBOSE = FALSE;
+    sched.nprograms = opts->num_programs;
+    sched.programs = calloc(sched.nprograms, sizeof(Program));
+    sched.quantum = opts->quantum;
+    sched.max_insns = opts->max_insns;
+    for (int i = 0; i < sched.nprograms; i++) {
+        Program* p = &sched.programs[i];
+        parse_program(p, opts->programs[i], opts->sched);
+        load(p);
+        p->ready = 1;
+        p->queued_at = sched.next_seq++;
+    }
+    sched.active = sched.nprograms;
+
+    int nthreads = opts->sched_threads;
+    if (nthreads <= 0) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > sched.nprograms) nthreads = sched.nprograms;
+    if (nthreads < 1) nthreads = 1;
+    pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, worker_main, NULL) != 0) {
+            printf("Error: Can't start scheduler thread %d\n", i);
+            exit(-1);
+        }
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(threads);
+    double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    // With no --dump at all, report the registers like batch runs do
+    SimOptions o = *opts;
+    if (!o.dump_regs && !o.dump_mmu && o.num_mem_ranges == 0)
+        o.dump_regs = 1;
+
+    FILE* out = open_memstream(&buf, &len);
+    if (o.json) report_json(out, &o, nthreads, seconds);
+    else report_text(out, &o, nthreads, seconds);
+    fclose(out);
+
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = write(STDOUT_FILENO, buf + done, len - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    free(buf);
+
+    if (o.dumpsim_path != NULL) {
+        FILE* dumpsim_file = fopen(o.dumpsim_path, "w");
+        if (dumpsim_file == NULL) {
+            fprintf(stderr, "Error: Can't open dumpsim file %s\n", o.dumpsim_path);
+            return 2;
+        }
+        o.json = 0;  // the dumpsim file always uses the shell's text format
+        report_text(dumpsim_file, &o, nthreads, seconds);
+        fclose(dumpsim_file);
+    }
+
+    int running = 0;
+    for (int i = 0; i < sched.nprograms; i++)
+        running |= sched.programs[i].run_bit;
+    MEM = saved_mem;
+    MEM_LAST_VPN = UINT64_MAX;
+    loop_table_use(NULL);
+
+    // --run-to-halt promises halted programs; running out of budget is an error
+    return (opts->run_to_halt && running) ? 1 : 0;
+}
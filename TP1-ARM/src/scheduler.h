@@ -0,0 +1,24 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "options.h"
+
+// Several programs in one simulator process (--sched rr|prio).
+//
+// Every program file gets its own context: registers, MMU, loop tables and
+// a private address space, so they no longer overwrite each other's text.
+// A pool of host threads time-slices them, --quantum instructions at a time.
+
+#define SCHED_RR            1   // round robin
+#define SCHED_PRIO          2   // highest priority first, FILE@PRIO
+
+#define SCHED_YIELD_HINT    0x1 // YIELD (HINT #1) ends the time slice early
+
+// Set on the threads of the pool while they run a program
+extern __thread int SCHED_RUNNING;
+
+// Runs the programs to completion (or --max-insns each) and writes a
+// combined report to stdout. Returns the process exit status.
+int sched_main(const SimOptions* opts);
+
+#endif
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "batch.h"
+#include "options.h"
+#include "shell.h"
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Long-lived simulation server.
+//
+// The parent process listens on a Unix domain socket and pre-forks a pool of
+// workers. Each worker is one simulator context: its memory is allocated once
+// and reset between jobs, so a job only pays for loading and running the
+// program. Workers accept connections from the shared listening socket and
+// serve any number of jobs per connection, answering each job as soon as it
+// finishes.
+//
+// Protocol (one job, text header lines):
+//
+//   PROGRAM <nbytes>\n<nbytes of .x program text>
+//   REG <n> <value>\n          initial value of Xn (any number of times)
+//   MAX <n>\n                  instruction limit (default: run until HLT)
+//   DUMP <list>\n              same syntax as --dump
+//   FORMAT text|json\n
+//   RUN\n                      run the job
+//
+// Answer: "OK <nbytes>\n" followed by the report, or "ERR <message>\n". A
+// rejected REG, DUMP or FORMAT line fails its job: RUN answers with that
+// error instead of running it.
+
+#define SERVER_MAX_PROGRAM (16 << 20)
+#define SERVER_LINE 512
+
+typedef struct {
+    char* program;
+    size_t program_len;
+    int reg_set[ARM_REGS];
+    int64_t reg_value[ARM_REGS];
+    SimOptions opts;
+    const char* error;          // first rejected line, answered by RUN
+} Job;
+
+static volatile sig_atomic_t server_stop = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    server_stop = 1;
+}
+
+static int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_error(int fd, const char* msg) {
+    char line[SERVER_LINE];
+    int n = snprintf(line, sizeof(line), "ERR %s\n", msg);
+    return write_all(fd, line, n);
+}
+
+static void job_clear(Job* job) {
+    free(job->program);
+    memset(job, 0, sizeof(*job));
+    job->opts.max_insns = -1;
+}
+
+// Runs the job on this worker's context and sends back the report
+static int run_job(int fd, Job* job) {
+    char* report = NULL;
+    size_t len = 0;
+    char header[64];
+
+    reset_machine();
+
+    FILE* prog = fmemopen(job->program, job->program_len, "r");
+    int words = prog ? load_program_stream(prog) : -1;
+    if (prog) fclose(prog);
+    if (words < 0)
+        return send_error(fd, "malformed program");
+
+    for (int k = 0; k < ARM_REGS; k++) {
+        if (job->reg_set[k]) {
+            CURRENT_STATE.REGS[k] = job->reg_value[k];
+        }
+    }
+    NEXT_STATE = CURRENT_STATE;
+
+    batch_run(job->opts.max_insns);
+
+    FILE* out = open_memstream(&report, &len);
+    batch_report(out, &job->opts);
+    fclose(out);
+
+    int n = snprintf(header, sizeof(header), "OK %zu\n", len);
+    int rc = write_all(fd, header, n) < 0 || write_all(fd, report, len) < 0 ? -1 : 0;
+    free(report);
+    return rc;
+}
+
+// Serves jobs on one connection until the client closes it
+static void serve_connection(int fd) {
+    FILE* in = fdopen(dup(fd), "r");
+    char line[SERVER_LINE];
+    Job job = { 0 };
+
+    job_clear(&job);
+    while (in && fgets(line, sizeof(line), in) != NULL) {
+        int k;
+        long long v;
+        size_t nbytes;
+        char arg[SERVER_LINE];
+
+        if (sscanf(line, "PROGRAM %zu", &nbytes) == 1) {
+            if (nbytes > SERVER_MAX_PROGRAM) {
+                send_error(fd, "program too large");
+                break;
+            }
+            free(job.program);
+            job.program = malloc(nbytes + 1);
+            if (fread(job.program, 1, nbytes, in) != nbytes) break;
+            job.program[nbytes] = '\0';
+            job.program_len = nbytes;
+        } else if (sscanf(line, "REG %d %511s", &k, arg) == 2) {
+            // Unsigned, so all 64 bits can be given (strtoll saturates)
+            char* end;
+            uint64_t u = strtoull(arg, &end, 0);
+            if (k < 0 || k >= ARM_REGS) {
+                if (!job.error) job.error = "bad register";
+                continue;
+            }
+            if (*end != '\0') {
+                if (!job.error) job.error = "bad register value";
+                continue;
+            }
+            job.reg_set[k] = 1;
+            job.reg_value[k] = (int64_t)u;
+        } else if (sscanf(line, "MAX %lli", &v) == 1) {
+            job.opts.max_insns = v;
+        } else if (sscanf(line, "DUMP %511s", arg) == 1) {
+            if (parse_dump_list(arg, &job.opts) < 0 && !job.error)
+                job.error = "bad dump list";
+        } else if (sscanf(line, "FORMAT %511s", arg) == 1) {
+            if (strcmp(arg, "json") == 0) job.opts.json = 1;
+            else if (strcmp(arg, "text") == 0) job.opts.json = 0;
+            else if (!job.error) job.error = "bad format";
+        } else if (strncmp(line, "RUN", 3) == 0) {
+            int rc = job.error ? send_error(fd, job.error)
+                     : job.program ? run_job(fd, &job) : send_error(fd, "no program");
+            job_clear(&job);
+            if (rc < 0) break;
+        } else {
+            send_error(fd, "unknown request");
+        }
+    }
+    job_clear(&job);
+    if (in) fclose(in);
+}
+
+static void worker_loop(int listen_fd) {
+    // Allocate this context's memory once; jobs only reset it
+    init_memory();
+
+    while (!server_stop) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            _exit(1);
+        }
+        serve_connection(fd);
+        close(fd);
+    }
+    _exit(0);
+}
+
+static pid_t spawn_worker(int listen_fd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        worker_loop(listen_fd);
+    }
+    return pid;
+}
+
+int serve_main(const char* sock_path, int workers) {
+    struct sockaddr_un addr;
+
+    if (workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? cpus : 1;
+    }
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", sock_path);
+        return 1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path);
+    unlink(sock_path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 128) < 0) {
+        perror("Error: can't listen on socket");
+        return 1;
+    }
+
+    VERBOSE = FALSE;
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    pid_t* pids = calloc(workers, sizeof(pid_t));
+    for (int i = 0; i < workers; i++)
+        pids[i] = spawn_worker(listen_fd);
+    fprintf(stderr, "Serving on %s with %d workers\n", sock_path, workers);
+
+    // Replace workers that die until we are told to stop
+    while (!server_stop) {
+        pid_t dead = wait(NULL);
+        if (dead < 0) continue;
+        for (int i = 0; i < workers && !server_stop; i++) {
+            if (pids[i] == dead)
+                pids[i] = spawn_worker(listen_fd);
+        }
+    }
+
+    for (int i = 0; i < workers; i++)
+        kill(pids[i], SIGTERM);
+    while (wait(NULL) > 0);
+    close(listen_fd);
+    unlink(sock_path);
+    free(pids);
+    return 0;
+}
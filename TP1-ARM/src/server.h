@@ -0,0 +1,9 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+// Serves simulation jobs on a Unix domain socket with a pool of `workers`
+// pre-forked simulator contexts (0 = one per CPU). Returns when the server
+// receives SIGINT or SIGTERM.
+int serve_main(const char* sock_path, int workers);
+
+#endif
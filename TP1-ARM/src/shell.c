@@ -27,91 +27,70 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
 #include "shell.h"
-
-/***************************************************************/
-/* Main memory.                                                */
-/***************************************************************/
-
-#define MEM_DATA_START  0x10000000
-#define MEM_DATA_SIZE   0x00100000
-#define MEM_TEXT_START  0x00400000
-#define MEM_TEXT_SIZE   0x00100000
-#define MEM_STACK_START 0xfffffffc
-#define MEM_STACK_SIZE  0x00100000
-
-typedef struct {
-    uint64_t start, size;
-    uint8_t *mem;
-} mem_region_t;
-
-/* memory will be dynamically allocated at initialization */
-mem_region_t MEM_REGIONS[] = {
-    { MEM_TEXT_START, MEM_TEXT_SIZE, NULL },
-    { MEM_DATA_START, MEM_DATA_SIZE, NULL },
-    { MEM_STACK_START, MEM_STACK_SIZE, NULL },
-};
-
-#define MEM_NREGIONS (sizeof(MEM_REGIONS)/sizeof(mem_region_t))
+#include "memory.h"
+#include "mmu.h"
+#include "cosim.h"
+#include "options.h"
+#include "batch.h"
+#include "server.h"
+#include "debug.h"
+#include "gdbstub.h"
+#include "analyze.h"
+#include "translate.h"
+#include "sample.h"
+#include "hostprof.h"
+#include "roi.h"
+#include "scheduler.h"
+#include "loop.h"
+#include "cfg.h"
 
 /***************************************************************/
 /* CPU State info.                                             */
 /***************************************************************/
 
-CPU_State CURRENT_STATE, NEXT_STATE;
-int RUN_BIT;	/* run bit */
-int INSTRUCTION_COUNT;
+__thread CPU_State CURRENT_STATE, NEXT_STATE;
+__thread int RUN_BIT;	/* run bit */
+int VERBOSE = TRUE;	/* print the per-instruction trace */
+__thread int INSTRUCTION_COUNT;
+__thread int INSTRUCTION_LIMIT = INT_MAX;
 
 
 /***************************************************************/
 /*                                                             */
-/* Procedure: mem_read_32                                      */
+/* Procedure: save_checkpoint / restore_checkpoint             */
 /*                                                             */
-/* Purpose: Read a 32-bit word from memory                     */
+/* Purpose: Copy the CPU state and the written memory pages    */
+/*          so the machine can be rewound later                */
 /*                                                             */
 /***************************************************************/
-uint32_t mem_read_32(uint64_t address)
+void save_checkpoint(sim_checkpoint_t *cp)
 {
-    int i;
-    for (i = 0; i < MEM_NREGIONS; i++) {
-        if (address >= MEM_REGIONS[i].start &&
-                address < (MEM_REGIONS[i].start + MEM_REGIONS[i].size)) {
-            uint32_t offset = address - MEM_REGIONS[i].start;
-
-            return
-                (MEM_REGIONS[i].mem[offset+3] << 24) |
-                (MEM_REGIONS[i].mem[offset+2] << 16) |
-                (MEM_REGIONS[i].mem[offset+1] <<  8) |
-                (MEM_REGIONS[i].mem[offset+0] <<  0);
-        }
-    }
+    mem_snapshot_save(&cp->mem);
+    cp->state = CURRENT_STATE;
+    cp->instruction_count = INSTRUCTION_COUNT;
+    cp->run_bit = RUN_BIT;
+    cp->mmu = MMU;
+}
 
-    return 0;
+void restore_checkpoint(const sim_checkpoint_t *cp)
+{
+    mem_snapshot_restore(&cp->mem);
+    CURRENT_STATE = cp->state;
+    NEXT_STATE = cp->state;
+    INSTRUCTION_COUNT = cp->instruction_count;
+    RUN_BIT = cp->run_bit;
+    /* The registers and statistics come back, the TLB starts cold */
+    MMU = cp->mmu;
+    memset(MMU.tlb, 0, sizeof(MMU.tlb));
 }
 
-/***************************************************************/
-/*                                                             */
-/* Procedure: mem_write_32                                     */
-/*                                                             */
-/* Purpose: Write a 32-bit word to memory                      */
-/*                                                             */
-/***************************************************************/
-void mem_write_32(uint64_t address, uint32_t value)
+void free_checkpoint(sim_checkpoint_t *cp)
 {
-    int i;
-    for (i = 0; i < MEM_NREGIONS; i++) {
-        if (address >= MEM_REGIONS[i].start &&
-                address < (MEM_REGIONS[i].start + MEM_REGIONS[i].size)) {
-            uint32_t offset = address - MEM_REGIONS[i].start;
-
-            MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-            MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-            MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-            MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
-            return;
-        }
-    }
+    mem_snapshot_free(&cp->mem);
 }
+
 /***************************************************************/
 /*                                                             */
 /* Procedure : help                                            */
@@ -126,6 +105,12 @@ void help() {
   printf("mdump low high   -  dump memory from low to high      \n");
   printf("rdump            -  dump the register & bus values    \n");
   printf("input reg_no reg_value - set GPR reg_no to reg_value  \n");
+  printf("break pc [xN op value] - stop at pc (op: == != < > <= >=)\n");
+  printf("watch addr [r|w|rw]    - stop after an access to a word\n");
+  printf("delete n         -  delete breakpoint/watchpoint n    \n");
+  printf("list             -  list breakpoints and watchpoints  \n");
+  printf("cfg              -  print the control-flow graph (DOT)\n");
+  printf("profile          -  host cost per instruction type (--host-profile)\n");
   printf("?                -  display this help menu            \n");
   printf("quit             -  exit the program                  \n\n");
 }
@@ -152,21 +137,61 @@ void cycle() {
 /*                                                             */
 /***************************************************************/
 void run(int num_cycles) {                                      
-  int i;
-
   if (RUN_BIT == FALSE) {
     printf("Can't simulate, Simulator is halted\n\n");
     return;
   }
 
   printf("Simulating for %d cycles...\n\n", num_cycles);
-  for (i = 0; i < num_cycles; i++) {
+  INSTRUCTION_LIMIT = INSTRUCTION_COUNT + num_cycles;
+  hostprof_run_begin();
+  while (INSTRUCTION_COUNT < INSTRUCTION_LIMIT) {
     if (RUN_BIT == FALSE) {
 	    printf("Simulator halted\n\n");
 	    break;
     }
+    if (RUN_BIT == STOPPED)
+	    break;
     cycle();
   }
+  INSTRUCTION_LIMIT = INT_MAX;
+  hostprof_run_end(stdout);
+  if (RUN_BIT == STOPPED)
+    debug_report_stop();
+}
+
+/***************************************************************/ 
+/*                                                             */
+/* Procedure : mdump_to / rdump_to                             */
+/*                                                             */
+/* Purpose   : Write a memory / register dump to one stream    */
+/*                                                             */
+/***************************************************************/
+void mdump_to(FILE * out, uint64_t start, uint64_t stop) {
+  uint64_t address;
+
+  fprintf(out, "\nMemory content [0x%08" PRIx64 "..0x%08" PRIx64 "] :\n", start, stop);
+  fprintf(out, "-------------------------------------\n");
+  for (address = start; address <= stop; address += 4) {
+    fprintf(out, "  0x%08" PRIx64 " (%d) : 0x%x\n", address, (int)address, mem_peek_32(address));
+    if (stop - address < 4) break;  /* the next address would wrap */
+  }
+  fprintf(out, "\n");
+}
+
+void rdump_to(FILE * out) {
+  int k;
+
+  fprintf(out, "\nCurrent register/bus values :\n");
+  fprintf(out, "-------------------------------------\n");
+  fprintf(out, "Instruction Count : %u\n", INSTRUCTION_COUNT);
+  fprintf(out, "PC                : 0x%" PRIx64 "\n", CURRENT_STATE.PC);
+  fprintf(out, "Registers:\n");
+  for (k = 0; k < ARM_REGS; k++)
+    fprintf(out, "X%d: 0x%" PRIx64 "\n", k, CURRENT_STATE.REGS[k]);
+  fprintf(out, "FLAG_N: %d\n", CURRENT_STATE.FLAG_N);
+  fprintf(out, "FLAG_Z: %d\n", CURRENT_STATE.FLAG_Z);
+  fprintf(out, "\n");
 }
 
 /***************************************************************/ 
@@ -178,20 +203,10 @@ void run(int num_cycles) {
 /*                                                             */
 /***************************************************************/
 void mdump(FILE * dumpsim_file, int start, int stop) {          
-  int address;
-
-  printf("\nMemory content [0x%08x..0x%08x] :\n", start, stop);
-  printf("-------------------------------------\n");
-  for (address = start; address <= stop; address += 4)
-    printf("  0x%08x (%d) : 0x%x\n", address, address, mem_read_32(address));
-  printf("\n");
+  mdump_to(stdout, (uint32_t)start, (uint32_t)stop);
 
   /* dump the memory contents into the dumpsim file */
-  fprintf(dumpsim_file, "\nMemory content [0x%08x..0x%08x] :\n", start, stop);
-  fprintf(dumpsim_file, "-------------------------------------\n");
-  for (address = start; address <= stop; address += 4)
-    fprintf(dumpsim_file, "  0x%08x (%d) : 0x%x\n", address, address, mem_read_32(address));
-  fprintf(dumpsim_file, "\n");
+  mdump_to(dumpsim_file, (uint32_t)start, (uint32_t)stop);
 }
 
 /***************************************************************/
@@ -203,30 +218,10 @@ void mdump(FILE * dumpsim_file, int start, int stop) {
 /*                                                             */
 /***************************************************************/
 void rdump(FILE * dumpsim_file) {                               
-  int k; 
-
-  printf("\nCurrent register/bus values :\n");
-  printf("-------------------------------------\n");
-  printf("Instruction Count : %u\n", INSTRUCTION_COUNT);
-  printf("PC                : 0x%" PRIx64 "\n", CURRENT_STATE.PC);
-  printf("Registers:\n");
-  for (k = 0; k < ARM_REGS; k++)
-    printf("X%d: 0x%" PRIx64 "\n", k, CURRENT_STATE.REGS[k]);
-  printf("FLAG_N: %d\n", CURRENT_STATE.FLAG_N);
-  printf("FLAG_Z: %d\n", CURRENT_STATE.FLAG_Z);
-  printf("\n");
+  rdump_to(stdout);
 
   /* dump the state information into the dumpsim file */
-  fprintf(dumpsim_file, "\nCurrent register/bus values :\n");
-  fprintf(dumpsim_file, "-------------------------------------\n");
-  fprintf(dumpsim_file, "Instruction Count : %u\n", INSTRUCTION_COUNT);
-  fprintf(dumpsim_file, "PC                : 0x%" PRIx64 "\n", CURRENT_STATE.PC);
-  fprintf(dumpsim_file, "Registers:\n");
-  for (k = 0; k < ARM_REGS; k++)
-    fprintf(dumpsim_file, "X%d: 0x%" PRIx64 "\n", k, CURRENT_STATE.REGS[k]);
-  fprintf(dumpsim_file, "FLAG_N: %d\n", CURRENT_STATE.FLAG_N);
-  fprintf(dumpsim_file, "FLAG_Z: %d\n", CURRENT_STATE.FLAG_Z);
-  fprintf(dumpsim_file, "\n");
+  rdump_to(dumpsim_file);
 }
 /***************************************************************/
 /*                                                             */
@@ -242,12 +237,18 @@ void go(FILE * dumpsim_file) {
   }
 
   printf("Simulating...\n\n");
-  while (RUN_BIT) {
+  hostprof_run_begin();
+  while (RUN_BIT == TRUE) {
     cycle();
     //printf("Going\n");
     //rdump(dumpsim_file);
     //mdump(dumpsim_file, MEM_DATA_START, MEM_DATA_START+0x100);
   }
+  hostprof_run_end(stdout);
+  if (RUN_BIT == STOPPED) {
+    debug_report_stop();
+    return;
+  }
   printf("Simulator halted\n\n");
 }
 
@@ -264,6 +265,8 @@ void get_command(FILE * dumpsim_file) {
   int start, stop, cycles;
   int register_no;
   int64_t register_value;
+  uint64_t address;
+  char rest[80], access[4];
 
   printf("ARM-SIM> ");
 
@@ -313,6 +316,53 @@ void get_command(FILE * dumpsim_file) {
    NEXT_STATE.REGS[register_no] = register_value;
    break;
 
+  case 'B':
+  case 'b':
+    if (scanf("%" SCNi64, &address) != 1)
+        break;
+    if (fgets(rest, sizeof(rest), stdin) == NULL)
+        rest[0] = '\0';
+    debug_break(address, rest);
+    break;
+
+  case 'W':
+  case 'w':
+    if (scanf("%" SCNi64, &address) != 1)
+        break;
+    if (fgets(rest, sizeof(rest), stdin) == NULL || sscanf(rest, "%3s", access) != 1)
+        strcpy(access, "w");
+    if (strcmp(access, "r") == 0)
+        debug_watch(address, WATCH_BYTES, WATCH_READ);
+    else if (strcmp(access, "w") == 0)
+        debug_watch(address, WATCH_BYTES, WATCH_WRITE);
+    else if (strcmp(access, "rw") == 0)
+        debug_watch(address, WATCH_BYTES, WATCH_READ | WATCH_WRITE);
+    else
+        printf("Invalid Command\n");
+    break;
+
+  case 'D':
+  case 'd':
+    if (scanf("%d", &register_no) != 1)
+        break;
+    debug_delete(register_no);
+    break;
+
+  case 'L':
+  case 'l':
+    debug_list();
+    break;
+
+  case 'C':
+  case 'c':
+    cfg_dump_dot(stdout);
+    break;
+
+  case 'P':
+  case 'p':
+    hostprof_report_text(stdout);
+    break;
+
   default:
     printf("Invalid Command\n");
     break;
@@ -324,15 +374,33 @@ void get_command(FILE * dumpsim_file) {
 /* Procedure : init_memory                                     */
 /*                                                             */
 /* Purpose   : Allocate and zero memory                        */
+/*             Pages are allocated on first touch; once the    */
+/*             address space exists only dirty pages are       */
+/*             cleared.                                        */
 /*                                                             */
 /***************************************************************/
 void init_memory() {                                           
-    int i;
-    for (i = 0; i < MEM_NREGIONS; i++) {
-        // Extra 3 bytes to prevent buffer overflow on unaligned access.
-        MEM_REGIONS[i].mem = malloc(MEM_REGIONS[i].size + 3);
-        memset(MEM_REGIONS[i].mem, 0, MEM_REGIONS[i].size);
-    }
+    if (MEM->root == NULL)
+        mem_init();
+    else
+        mem_reset();
+    mmu_reset();
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : reset_machine                                   */
+/*                                                             */
+/* Purpose   : Bring the machine back to its power-on state    */
+/*             so the same process can run another program     */
+/*                                                             */
+/***************************************************************/
+void reset_machine() {
+    init_memory();
+    memset(&CURRENT_STATE, 0, sizeof(CURRENT_STATE));
+    NEXT_STATE = CURRENT_STATE;
+    INSTRUCTION_COUNT = 0;
+    RUN_BIT = TRUE;
 }
 
 /**************************************************************/
@@ -340,11 +408,33 @@ void init_memory() {
 /* Procedure : load_program                                   */
 /*                                                            */
 /* Purpose   : Load program and service routines into mem.    */
+/*             load_program_stream returns the number of      */
+/*             words read, or -1 if the file is malformed,    */
+/*             and builds the CFG and counted loops of the    */
+/*             text it loaded.                                */
 /*                                                            */
 /**************************************************************/
+int load_program_stream(FILE * prog) {
+  int ii, word;
+
+  ii = 0;
+  int bytes_read = EOF;
+  while ((bytes_read=fscanf(prog, "%x\n", &word)) > 0) {
+    mem_write_32(MEM_TEXT_START + ii, word);
+    ii += 4;
+  }
+  if (bytes_read == 0)
+    return -1;
+
+  CURRENT_STATE.PC = MEM_TEXT_START;
+  cfg_build(MEM_TEXT_START, ii/4);
+  loop_build();
+  return ii/4;
+}
+
 void load_program(char *program_filename) {                   
   FILE * prog;
-  int ii, word;
+  int words;
 
   /* Open program file. */
   prog = fopen(program_filename, "r");
@@ -354,21 +444,15 @@ void load_program(char *program_filename) {
   }
 
   /* Read in the program. */
-
-  ii = 0;
-  int bytes_read = EOF;
-  while ((bytes_read=fscanf(prog, "%x\n", &word)) > 0) {
-    mem_write_32(MEM_TEXT_START + ii, word);
-    ii += 4;
-  }
-  if (bytes_read == 0) {
+  words = load_program_stream(prog);
+  fclose(prog);
+  if (words < 0) {
     printf("Error: Malformed program file %s\n", program_filename);
     exit(-1);
   }
 
-  CURRENT_STATE.PC = MEM_TEXT_START;
-
-  printf("Read %d words from program into memory.\n\n", ii/4);
+  if (VERBOSE)
+    printf("Read %d words from program into memory.\n\n", words);
 }
 
 /************************************************************/
@@ -377,16 +461,17 @@ void load_program(char *program_filename) {
 /*                                                          */
 /* Purpose   : Load machine language program                */ 
 /*             and set up initial state of the machine.     */
+/*             Every file is loaded at the text address;    */
+/*             --sched gives each its own address space     */
+/*             instead (see scheduler.c).                   */
 /*                                                          */
 /************************************************************/
-void initialize(char *program_filename, int num_prog_files) { 
+void initialize(char *program_filenames[], int num_prog_files) { 
   int i;
 
   init_memory();
-  for ( i = 0; i < num_prog_files; i++ ) {
-    load_program(program_filename);
-    while(*program_filename++ != '\0');
-  }
+  for ( i = 0; i < num_prog_files; i++ )
+    load_program(program_filenames[i]);
   NEXT_STATE = CURRENT_STATE;
     
   RUN_BIT = TRUE;
@@ -399,19 +484,56 @@ void initialize(char *program_filename, int num_prog_files) {
 /***************************************************************/
 int main(int argc, char *argv[]) {                              
   FILE * dumpsim_file;
+  SimOptions opts;
 
   /* Error Checking */
-  if (argc < 2) {
-    printf("Error: usage: %s <program_file_1> <program_file_2> ...\n",
-           argv[0]);
-    exit(1);
+  parse_options(argc, argv, &opts);
+
+  /* The trace would be most of what gets measured */
+  if (opts.host_profile) {
+    hostprof_init();
+    VERBOSE = FALSE;
   }
 
+  /* Lockstep comparison against the reference simulator */
+  if (opts.cosim_ref != NULL)
+    return cosim(opts.cosim_ref, opts.programs[0]);
+
+  /* Static analysis only, nothing is simulated */
+  if (opts.analyze)
+    return analyze_main(opts.programs[0], opts.latency_table);
+
+  /* Ahead-of-time translation to C, nothing is simulated */
+  if (opts.translate_path != NULL)
+    return translate_main(opts.programs[0], opts.translate_path);
+
+  /* Sampled simulation: CPI estimate from a few detailed intervals */
+  if (opts.sample_interval)
+    return sample_main(&opts);
+
+  /* Remote debugging with gdb */
+  if (opts.gdb_target != NULL)
+    return gdb_main(opts.gdb_target, &opts);
+
+  /* Long-lived job server */
+  if (opts.serve_path != NULL)
+    return serve_main(opts.serve_path, opts.workers);
+
+  /* Several programs, each in its own address space */
+  if (opts.sched)
+    return sched_main(&opts);
+
+  /* Non-interactive run driven by command-line flags */
+  if (opts.batch)
+    return batch_main(&opts);
+
   printf("ARM Simulator\n\n");
 
-  initialize(argv[1], argc - 1);
+  initialize(opts.programs, opts.num_programs);
+  if (opts.roi)
+    roi_init();
 
-  if ( (dumpsim_file = fopen( "dumpsim", "w" )) == NULL ) {
+  if ( (dumpsim_file = fopen( opts.dumpsim_path ? opts.dumpsim_path : "dumpsim", "w" )) == NULL ) {
     printf("Error: Can't open dumpsim file\n");
     exit(-1);
   }
@@ -16,8 +16,11 @@
 #define _SIM_SHELL_H_
 
 #include <inttypes.h>
+#include <stdio.h>
+#include "memory.h"
 #define FALSE 0
 #define TRUE  1
+#define STOPPED 2	/* RUN_BIT after a breakpoint or watchpoint */
 
 #define ARM_REGS 32
 
@@ -30,12 +33,40 @@ typedef struct CPU_State_Struct {
 
 /* Data Structure for Latch */
 
-extern CPU_State CURRENT_STATE, NEXT_STATE;
+/* Per host thread: each simulated core has its own (see smp.c) */
+extern __thread CPU_State CURRENT_STATE, NEXT_STATE;
 
-extern int RUN_BIT;	/* run bit */
+extern __thread int RUN_BIT;	/* run bit */
+extern int VERBOSE;	/* print the per-instruction trace */
+extern __thread int INSTRUCTION_COUNT;
+extern __thread int INSTRUCTION_LIMIT;	/* fused pairs never run past this count */
 
 uint32_t mem_read_32(uint64_t address);
 void     mem_write_32(uint64_t address, uint32_t value);
+uint32_t mem_fetch_32(uint64_t address);
+
+/* Snapshot of the whole machine (CPU state + MMU + written memory). */
+typedef struct {
+  CPU_State state;
+  int instruction_count;
+  int run_bit;
+  mem_mmu_t mmu;
+  mem_snapshot_t mem;
+} sim_checkpoint_t;
+
+void save_checkpoint(sim_checkpoint_t *cp);
+void restore_checkpoint(const sim_checkpoint_t *cp);
+void free_checkpoint(sim_checkpoint_t *cp);
+
+void initialize(char *program_filenames[], int num_prog_files);
+void init_memory();
+void reset_machine();
+int  load_program_stream(FILE * prog);
+void load_program(char *program_filename);
+void cycle();
+
+void mdump_to(FILE * out, uint64_t start, uint64_t stop);
+void rdump_to(FILE * out);
 
 /* YOU IMPLEMENT THIS FUNCTION */
 void process_instruction();
@@ -1,21 +1,53 @@
 #include "decode.h"
 #include "execute.h"
+#include "hostprof.h"
 #include "utils.h"
+#include "debug.h"
+#include "loop.h"
 #include "shell.h"
 #include <stdio.h>
 
 
 void process_instruction() {
-    printf("-------------------------- Processing instruction --------------------------\n\n");
-    uint32_t instruction = mem_read_32(CURRENT_STATE.PC);
-    DecodedInstruction d = decode_instruction(instruction);
-    show_instruction_in_binary(d);
-    show_instruction(d);
+    trace("-------------------------- Processing instruction --------------------------\n\n");
+    uint64_t t0 = HOSTPROF ? hostprof_ticks() : 0;
+    uint32_t instruction = mem_fetch_32(CURRENT_STATE.PC);
+    const DecodedInstruction* d = decode_cached(CURRENT_STATE.PC, instruction);
+    if (VERBOSE) {
+        show_instruction_in_binary(*d);
+        show_instruction(*d);
+    }
 
     // In some cases (e.g. branches), the PC is updated in the instruction itself
     // But this is the default behavior
     NEXT_STATE.PC = CURRENT_STATE.PC + 4;
 
+    if (HOSTPROF) {
+        // The handler may re-decode the slot (self-modifying code), keep the type
+        InstructionType type = d->type;
+        uint64_t t1 = hostprof_ticks();
+        hostprof_path(HOSTPROF_LOOKUP, t1 - t0);
+        execute_instruction(d);
+        hostprof_execute(type, hostprof_ticks() - t1);
+    } else {
+        execute_instruction(d);
+    }
+
+    // A taken backward branch may close a counted loop. The loops are found
+    // at load-time text addresses, so not while the PC is a virtual address.
+    if (NEXT_STATE.PC < CURRENT_STATE.PC && LOOP_ACCEL && RUN_BIT == TRUE && !VERBOSE && !MMU.enabled) {
+        uint64_t t2 = HOSTPROF ? hostprof_ticks() : 0;
+        loop_accelerate();
+        if (HOSTPROF) hostprof_path(HOSTPROF_LOOP, hostprof_ticks() - t2);
+    }
+
+    CURRENT_STATE.REGS[31] = 0;
+}
+
+
+void execute_instruction(const DecodedInstruction* i) {
+    DecodedInstruction d = *i;
+
     switch (d.type) {
         case ADDS_IMM: adds_imm(d); break;
         case ADDS_REG: adds_reg(d); break;
@@ -50,8 +82,18 @@ void process_instruction() {
         case MUL: mul(d); break;
         case CBZ: cbz(d); break;
         case CBNZ: cbnz(d); break;
+        case LDXR: ldxr(d); break;
+        case STXR: stxr(d); break;
+        case LDADD: ldadd(d); break;
+        case SWP: swp(d); break;
+        case CAS: cas(d); break;
+        case MSR: msr(d); break;
+        case MRS: mrs(d); break;
+        case TLBI: tlbi(); break;
+        case HINT: hint(d); break;
+        case BREAKPOINT: breakpoint_hit(); break;
+        case FUSED_ALU_BCOND: fused_alu_bcond(d); break;
+        case FUSED_MOVZ_STUR: fused_movz_stur(d); break;
         default: break;
     }
-
-    CURRENT_STATE.REGS[31] = 0;
 }
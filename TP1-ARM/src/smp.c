@@ -0,0 +1,157 @@
+#include "smp.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Multi-core runs.
+//
+// Every core is a host thread. CURRENT_STATE, RUN_BIT and the other
+// per-instruction globals are thread-local, so the interpreter runs unchanged
+// on each thread. The cores share the guest memory: page faults and page flag
+// changes are serialized in memory.c, guest loads and stores are plain host
+// accesses with no ordering between cores beyond the synchronization points.
+// Exclusives and LSE atomics are host atomics (see execute.c).
+// Core i starts at the program entry with X0 = i so programs can split work.
+//
+// Cores run in quanta of Q instructions. Normally every core runs its quantum
+// at the same time and they meet at a barrier, so no core gets more than one
+// quantum ahead of another. With --deterministic they take turns in core
+// order instead: the interleaving only depends on the instruction counts, so
+// every run gives the same result.
+//
+// load_program() decodes the whole text before the threads start, so cores
+// don't race to fill the same decoded-instruction slots.
+
+SmpCore* SMP_CORES;
+int SMP_NCORES;
+__thread int SMP_CORE_ID;
+
+static struct {
+    int quantum;
+    long long max_insns;
+    int deterministic;
+    int active;                 // cores that can still run
+    int all_done;
+    int turn;                   // --deterministic: the core whose quantum it is
+    pthread_mutex_t lock;
+    pthread_cond_t turn_changed;
+    pthread_barrier_t barrier;
+} smp = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .turn_changed = PTHREAD_COND_INITIALIZER,
+};
+
+// Runs one quantum on the calling thread's core. Returns whether the core
+// can run again: not halted and not out of budget.
+static int run_quantum(void) {
+    long long limit = (long long)INSTRUCTION_COUNT + smp.quantum;
+    if (smp.max_insns >= 0 && limit > smp.max_insns) limit = smp.max_insns;
+    if (limit > INT_MAX) limit = INT_MAX;
+
+    INSTRUCTION_LIMIT = (int)limit;
+    while (RUN_BIT == TRUE && INSTRUCTION_COUNT < INSTRUCTION_LIMIT)
+        cycle();
+    INSTRUCTION_LIMIT = INT_MAX;
+
+    return RUN_BIT == TRUE && (smp.max_insns < 0 || INSTRUCTION_COUNT < smp.max_insns);
+}
+
+// Waits for the end of the quantum. Returns whether every core is done.
+static int synchronize(int id) {
+    int done;
+
+    if (smp.deterministic) {
+        pthread_mutex_lock(&smp.lock);
+        done = smp.active == 0;
+        smp.turn = (id + 1) % SMP_NCORES;
+        pthread_cond_broadcast(&smp.turn_changed);
+        pthread_mutex_unlock(&smp.lock);
+        return done;
+    }
+
+    if (pthread_barrier_wait(&smp.barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+        smp.all_done = __atomic_load_n(&smp.active, __ATOMIC_SEQ_CST) == 0;
+    pthread_barrier_wait(&smp.barrier);
+    return smp.all_done;
+}
+
+static void* core_main(void* arg) {
+    SmpCore* core = arg;
+    int id = (int)(core - SMP_CORES);
+    int running = 1;
+
+    SMP_CORE_ID = id;
+    CURRENT_STATE = core->state;
+    NEXT_STATE = core->state;
+    INSTRUCTION_COUNT = 0;
+    RUN_BIT = TRUE;
+
+    for (;;) {
+        if (smp.deterministic) {
+            pthread_mutex_lock(&smp.lock);
+            while (smp.turn != id)
+                pthread_cond_wait(&smp.turn_changed, &smp.lock);
+            pthread_mutex_unlock(&smp.lock);
+        }
+
+        if (running && !(running = run_quantum()))
+            __atomic_sub_fetch(&smp.active, 1, __ATOMIC_SEQ_CST);
+
+        if (synchronize(id))
+            break;
+    }
+
+    core->state = CURRENT_STATE;
+    core->instruction_count = INSTRUCTION_COUNT;
+    core->run_bit = RUN_BIT;
+    core->mmu = MMU;
+    return NULL;
+}
+
+void smp_run(int ncores, int quantum, int deterministic, long long max_insns) {
+    pthread_t* threads = malloc(ncores * sizeof(pthread_t));
+
+    free(SMP_CORES);
+    SMP_CORES = calloc(ncores, sizeof(SmpCore));
+    SMP_NCORES = ncores;
+    smp.quantum = quantum;
+    smp.max_insns = max_insns;
+    smp.deterministic = deterministic;
+    smp.active = ncores;
+    smp.turn = 0;
+    pthread_barrier_init(&smp.barrier, NULL, ncores);
+
+    // Every core starts from the state initialize() left, X0 = core number
+    for (int i = 0; i < ncores; i++) {
+        SMP_CORES[i].state = CURRENT_STATE;
+        SMP_CORES[i].state.REGS[0] = i;
+    }
+    for (int i = 0; i < ncores; i++) {
+        if (pthread_create(&threads[i], NULL, core_main, &SMP_CORES[i]) != 0) {
+            printf("Error: Can't start core %d\n", i);
+            exit(-1);
+        }
+    }
+    for (int i = 0; i < ncores; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_barrier_destroy(&smp.barrier);
+    free(threads);
+}
+
+void smp_select(int core) {
+    CURRENT_STATE = SMP_CORES[core].state;
+    NEXT_STATE = SMP_CORES[core].state;
+    INSTRUCTION_COUNT = SMP_CORES[core].instruction_count;
+    RUN_BIT = SMP_CORES[core].run_bit;
+    MMU = SMP_CORES[core].mmu;
+}
+
+void smp_rdump_to(FILE* out) {
+    for (int i = 0; i < SMP_NCORES; i++) {
+        smp_select(i);
+        fprintf(out, "\nCore %d:", i);
+        rdump_to(out);
+    }
+}
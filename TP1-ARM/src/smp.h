@@ -0,0 +1,32 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "shell.h"
+
+// Multi-core runs on shared memory (--cores N)
+
+#define SMP_MAX_CORES       64
+#define SMP_DEFAULT_QUANTUM 1000
+
+typedef struct {
+    CPU_State state;
+    int instruction_count;
+    int run_bit;
+    mem_mmu_t mmu;
+} SmpCore;
+
+extern SmpCore* SMP_CORES;      // final state of each core after smp_run()
+extern int SMP_NCORES;          // 0 when no multi-core run was done
+extern __thread int SMP_CORE_ID; // core run by the calling thread, 0 outside smp_run()
+
+// Runs the loaded program on NCORES cores, each for at most max_insns
+// instructions (-1 = until HLT).
+void smp_run(int ncores, int quantum, int deterministic, long long max_insns);
+
+// Loads the state of CORE into the calling thread's CPU globals
+void smp_select(int core);
+
+// Per-core rdump: a "Core i:" header before each register dump
+void smp_rdump_to(FILE* out);
+
+#endif
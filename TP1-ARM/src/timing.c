@@ -0,0 +1,153 @@
+#include "timing.h"
+#include "analyze.h"
+#include "decode.h"
+#include "loop.h"
+#include "shell.h"
+#include <limits.h>
+#include <string.h>
+
+TimingStats TIMING;
+int TIMING_ACTIVE;
+
+static struct {
+    uint64_t now;                       // cycle the next instruction can issue
+    uint64_t ready[NUM_DEPS];           // cycle each register / the flags are ready
+    uint64_t tag[TIM_SETS][TIM_WAYS];   // line + 1, 0 = invalid
+    uint64_t used[TIM_SETS][TIM_WAYS];  // LRU stamps
+    uint64_t stamp;
+    uint64_t btb[TIM_BTB_SIZE];         // BR: last target by PC
+} tm;
+
+uint64_t timing_cycles(void) {
+    return tm.now;
+}
+
+void timing_reset(void) {
+    memset(&tm, 0, sizeof(tm));
+    memset(&TIMING, 0, sizeof(TIMING));
+}
+
+// Returns whether the line of ADDRESS was in the cache; it is afterwards
+// (write-allocate)
+static int cache_access(uint64_t address) {
+    uint64_t line = address >> TIM_LINE_SHIFT;
+    int set = (int)(line % TIM_SETS);
+    int victim = 0;
+
+    for (int w = 0; w < TIM_WAYS; w++) {
+        if (tm.tag[set][w] == line + 1) {
+            tm.used[set][w] = ++tm.stamp;
+            return 1;
+        }
+        if (tm.used[set][w] < tm.used[set][victim]) victim = w;
+    }
+    tm.tag[set][victim] = line + 1;
+    tm.used[set][victim] = ++tm.stamp;
+    return 0;
+}
+
+static int is_memory(InstructionType type) {
+    switch (type) {
+        case LDUR: case LDURB: case LDURH: case STUR: case STURB: case STURH:
+        case LDXR: case STXR: case LDADD: case SWP: case CAS:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Whether the branch at PC, which went to NEXT_PC, was predicted
+static int predicted(const DecodedInstruction* d, uint64_t pc, uint64_t next_pc) {
+    switch (d->type) {
+        case BEQ: case BNE: case BGT: case BLT: case BGE: case BLE:
+        case CBZ: case CBNZ:
+            return (d->imm < 0) == (next_pc != pc + 4);
+        case BR: {
+            uint64_t* e = &tm.btb[(pc >> 2) % TIM_BTB_SIZE];
+            int hit = *e == next_pc;
+            *e = next_pc;
+            return hit;
+        }
+        default:
+            return 1;
+    }
+}
+
+// Accounts one instruction. ADDRESS is its memory address (memory
+// instructions only), NEXT_PC where it went.
+static void account(const DecodedInstruction* d, uint64_t pc, uint64_t address, uint64_t next_pc) {
+    int srcs[4], dst, sets_flags;
+    int n = insn_operands(d, srcs, &dst, &sets_flags);
+    InsnClass c = insn_class(d);
+    uint64_t issue = tm.now;
+    uint64_t latency = class_latency(c);
+
+    for (int i = 0; i < n; i++) {
+        if (tm.ready[srcs[i]] > issue) issue = tm.ready[srcs[i]];
+    }
+    if (is_memory(d->type)) {
+        int hit = cache_access(address);
+        if (c == CLASS_LOAD) TIMING.loads++;
+        else TIMING.stores++;
+        if (!hit) {
+            TIMING.misses++;
+            // Stores retire into a store buffer, only loads wait for the line
+            if (c == CLASS_LOAD) latency += TIM_MISS_PENALTY;
+        }
+    }
+    if (dst >= 0) tm.ready[dst] = issue + latency;
+    if (sets_flags) tm.ready[REG_FLAGS] = issue + latency;
+    tm.now = issue + 1;
+
+    if (c == CLASS_BRANCH && d->type != HLT) {
+        TIMING.branches++;
+        if (!predicted(d, pc, next_pc)) {
+            TIMING.mispredicts++;
+            tm.now += TIM_MISPREDICT_PENALTY;
+        }
+    }
+    TIMING.instructions++;
+}
+
+// Address of the access D is about to make, from the registers before it runs
+static uint64_t access_address(const DecodedInstruction* d) {
+    uint64_t base = CURRENT_STATE.REGS[d->rn];
+    switch (d->type) {
+        case LDUR: case LDURB: case LDURH: case STUR: case STURB: case STURH:
+            return base + d->imm;
+        default:
+            return base;
+    }
+}
+
+void timing_run(int limit) {
+    int loop_accel = LOOP_ACCEL;
+    uint64_t start = tm.now;
+
+    // Every instruction has to go through the model
+    LOOP_ACCEL = 0;
+    TIMING_ACTIVE = 1;
+    INSTRUCTION_LIMIT = limit;
+    while (RUN_BIT == TRUE && INSTRUCTION_COUNT < limit) {
+        uint64_t pc = CURRENT_STATE.PC;
+        int before = INSTRUCTION_COUNT;
+        // The decoded-instruction cache may hold a fused pair, decode each half
+        DecodedInstruction d = decode_instruction(mem_peek_32(pc));
+        uint64_t address = access_address(&d);
+
+        cycle();
+        if (INSTRUCTION_COUNT - before == 2) {
+            // A fused pair ran in one step. The second half is a B.cond or a
+            // STUR, which write no register, so its address can be read now.
+            DecodedInstruction p = decode_instruction(mem_peek_32(pc + 4));
+            account(&d, pc, address, pc + 4);
+            account(&p, pc + 4, CURRENT_STATE.REGS[p.rn] + p.imm, CURRENT_STATE.PC);
+        } else {
+            account(&d, pc, address, CURRENT_STATE.PC);
+        }
+    }
+    INSTRUCTION_LIMIT = INT_MAX;
+    TIMING_ACTIVE = 0;
+    LOOP_ACCEL = loop_accel;
+    TIMING.cycles += tm.now - start;
+}
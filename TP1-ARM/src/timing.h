@@ -0,0 +1,42 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+
+// In-order timing model, the detailed model of sampled simulation (sample.c).
+//
+// One instruction issues per cycle, in order, once its source registers are
+// ready; results come back after the latency of its class on the --analyze
+// machine. Loads and stores go through a private L1 data cache, conditional
+// branches are predicted backward-taken / forward-not-taken and BR by its
+// last target. Like coherence.c the model only counts: the program runs on
+// the normal interpreter and its results don't change.
+
+#define TIM_LINE_SHIFT          6       // 64-byte lines
+#define TIM_SETS                64
+#define TIM_WAYS                8       // 32 KiB
+#define TIM_MISS_PENALTY        20      // extra cycles of a load that misses
+#define TIM_MISPREDICT_PENALTY  8       // cycles lost on a wrong prediction
+#define TIM_BTB_SIZE            256
+
+typedef struct {
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t loads, stores, misses;
+    uint64_t branches, mispredicts;
+} TimingStats;
+
+extern TimingStats TIMING;
+extern int TIMING_ACTIVE;       // timing_run() is running the program
+
+// Cycles since timing_reset(), up to the last instruction accounted
+uint64_t timing_cycles(void);
+
+// Cold caches, predictor and scoreboard; statistics cleared
+void timing_reset(void);
+
+// Runs the program through the model until INSTRUCTION_COUNT reaches LIMIT
+// or the program stops, adding to TIMING
+void timing_run(int limit);
+
+#endif
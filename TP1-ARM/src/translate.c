@@ -0,0 +1,370 @@
+#include "translate.h"
+#include "cfg.h"
+#include "shell.h"
+#include "utils.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Ahead-of-time translation to C.
+//
+// Every basic block of PROGRAM_CFG becomes a label, guest registers become
+// locals x0..x31 and the flags the locals n and z, so the host compiler can
+// keep them in registers. Direct branches are gotos; BR jumps through a
+// switch over the instruction addresses. Each block adds its length to the
+// instruction count on entry: blocks always run to the end, nothing faults.
+// An indirect jump into the middle of a block adds what is left of it.
+//
+// The semantics are the ones in execute.c, quirks included (STURB/STURH
+// read-modify-write the containing word, MOVZ ignores hw, X31 is an
+// ordinary register: what tst leaves there is read back).
+// Memory is the default map: text, data and stack windows, unmapped
+// addresses read as 0 and ignore writes. Not translated: --map-region,
+// --map-file, --sparse, stores into the text (the code is fixed at
+// translation time) and the MMU: MSR and TLBI do nothing, MRS only reads the
+// counters (SCTLR_EL1 and TTBR0_EL1 read as 0). The program
+// runs on one core, so exclusives and atomics are plain read-modify-writes;
+// unaligned ones don't fault.
+
+// Host windows of the default regions, rounded out to whole pages like the
+// demand-paged memory does
+typedef struct {
+    const char* name;
+    uint64_t start;
+    uint64_t size;
+} Window;
+
+static Window window(const char* name, uint64_t start, uint64_t size) {
+    Window w;
+    w.name = name;
+    w.start = start & ~(uint64_t)MEM_PAGE_MASK;
+    w.size = ((start + size - 1) | MEM_PAGE_MASK) + 1 - w.start;
+    return w;
+}
+
+// Source operand
+static const char* src(int r) {
+    static char buf[4][8];
+    static int next;
+    char* s = buf[next++ & 3];
+    snprintf(s, sizeof(buf[0]), "x%d", r);
+    return s;
+}
+
+// Destination operand
+static const char* dst(int r) {
+    static char buf[8];
+    snprintf(buf, sizeof(buf), "x%d", r);
+    return buf;
+}
+
+static void emit_prelude(FILE* out, const Window* w, int nwindows) {
+    fprintf(out,
+        "#include <inttypes.h>\n"
+        "#include <stdint.h>\n"
+        "#include <stdio.h>\n"
+        "#include <string.h>\n\n"
+        "#define ADD(a, b) ((int64_t)((uint64_t)(a) + (uint64_t)(b)))\n"
+        "#define SUB(a, b) ((int64_t)((uint64_t)(a) - (uint64_t)(b)))\n"
+        "#define MUL(a, b) ((int64_t)((uint64_t)(a) * (uint64_t)(b)))\n"
+        "#define SETF(r)   (z = (r) == 0, n = (r) < 0)\n\n");
+
+    for (int i = 0; i < nwindows; i++)
+        fprintf(out, "static uint8_t %s[0x%" PRIx64 "];\n", w[i].name, w[i].size);
+    fprintf(out, "\nstatic inline uint8_t* host(uint64_t a) {\n");
+    for (int i = 0; i < nwindows; i++)
+        fprintf(out, "    if (a - UINT64_C(0x%" PRIx64 ") < sizeof %s) return &%s[a - UINT64_C(0x%" PRIx64 ")];\n",
+                w[i].start, w[i].name, w[i].name, w[i].start);
+    fprintf(out,
+        "    return NULL;\n"
+        "}\n\n"
+        "static inline uint8_t rd8(uint64_t a) {\n"
+        "    uint8_t* p = host(a);\n"
+        "    return p != NULL ? *p : 0;\n"
+        "}\n\n"
+        "static inline void wr8(uint64_t a, uint8_t v) {\n"
+        "    uint8_t* p = host(a);\n"
+        "    if (p != NULL) *p = v;\n"
+        "}\n\n"
+        "static inline uint32_t rd32(uint64_t a) {\n"
+        "    uint8_t* p = host(a);\n"
+        "    if (p != NULL && host(a + 3) == p + 3) {\n"
+        "        uint32_t v;\n"
+        "        memcpy(&v, p, 4);\n"
+        "        return v;\n"
+        "    }\n"
+        "    return (uint32_t)rd8(a + 3) << 24 | (uint32_t)rd8(a + 2) << 16 | (uint32_t)rd8(a + 1) << 8 | rd8(a);\n"
+        "}\n\n"
+        "static inline void wr32(uint64_t a, uint32_t v) {\n"
+        "    uint8_t* p = host(a);\n"
+        "    if (p != NULL && host(a + 3) == p + 3) {\n"
+        "        memcpy(p, &v, 4);\n"
+        "        return;\n"
+        "    }\n"
+        "    wr8(a + 3, v >> 24);\n"
+        "    wr8(a + 2, v >> 16);\n"
+        "    wr8(a + 1, v >> 8);\n"
+        "    wr8(a, v);\n"
+        "}\n\n"
+        "static inline uint64_t rd64(uint64_t a) {\n"
+        "    return (uint64_t)rd32(a + 4) << 32 | rd32(a);\n"
+        "}\n\n"
+        "static inline void wr64(uint64_t a, uint64_t v) {\n"
+        "    wr32(a, (uint32_t)v);\n"
+        "    wr32(a + 4, (uint32_t)(v >> 32));\n"
+        "}\n\n"
+        "static void rdump(uint32_t icount, uint64_t pc, const int64_t* regs, int n, int z) {\n"
+        "    printf(\"\\nCurrent register/bus values :\\n\");\n"
+        "    printf(\"-------------------------------------\\n\");\n"
+        "    printf(\"Instruction Count : %%u\\n\", icount);\n"
+        "    printf(\"PC                : 0x%%\" PRIx64 \"\\n\", pc);\n"
+        "    printf(\"Registers:\\n\");\n"
+        "    for (int k = 0; k < 32; k++)\n"
+        "        printf(\"X%%d: 0x%%\" PRIx64 \"\\n\", k, (uint64_t)regs[k]);\n"
+        "    printf(\"FLAG_N: %%d\\n\", n);\n"
+        "    printf(\"FLAG_Z: %%d\\n\", z);\n"
+        "    printf(\"\\n\");\n"
+        "}\n\n");
+}
+
+static void emit_text(FILE* out, const Cfg* cfg) {
+    fprintf(out, "static const uint32_t program_text[%d] = {", cfg->ninsns > 0 ? cfg->ninsns : 1);
+    for (int i = 0; i < cfg->ninsns; i++)
+        fprintf(out, "%s0x%08x", i == 0 ? "\n    " : i % 8 ? ", " : ",\n    ", mem_peek_32(cfg->base + 4 * (uint64_t)i));
+    fprintf(out, "\n};\n\n");
+}
+
+// Leaves the translated code for address TARGET: another block, or the exit
+static void emit_jump(FILE* out, int block, uint64_t target) {
+    if (block != CFG_NONE)
+        fprintf(out, "goto L%d;", block);
+    else
+        fprintf(out, "{ pc = UINT64_C(0x%" PRIx64 "); goto out; }", target);
+}
+
+static const char* condition(InstructionType type) {
+    switch (type) {
+        case BEQ: return "z";
+        case BNE: return "!z";
+        case BGT: return "!z && !n";
+        case BLT: return "n";
+        case BGE: return "!n";
+        default:  return "z || n";      // BLE
+    }
+}
+
+static void emit_insn(FILE* out, const Cfg* cfg, int b, int i) {
+    const DecodedInstruction* d = cfg_insn(i);
+    uint64_t pc = cfg->base + 4 * (uint64_t)i;
+    InstructionType type = d->type;
+    if (type == FUSED_ALU_BCOND || type == FUSED_MOVZ_STUR) type = d->op;
+    const char* rn = src(d->rn);
+    const char* rm = src(d->rm);
+    const char* rt = src(d->rd);
+    const char* rd = dst(d->rd);
+    int64_t imm = d->imm;
+
+    fprintf(out, "    // 0x%" PRIx64 ": %s\n    ", pc, instruction_name(d->instruction));
+    switch (type) {
+        case ADDS_IMM: fprintf(out, "%s = r = ADD(%s, INT64_C(%" PRId64 ")); SETF(r);\n", rd, rn, imm); break;
+        case ADDS_REG: fprintf(out, "%s = r = ADD(%s, %s); SETF(r);\n", rd, rn, rm); break;
+        case SUBS_IMM: fprintf(out, "%s = r = SUB(%s, INT64_C(%" PRId64 ")); SETF(r);\n", rd, rn, imm); break;
+        case SUBS_REG: fprintf(out, "%s = r = SUB(%s, %s); SETF(r);\n", rd, rn, rm); break;
+        case CMP_IMM:  fprintf(out, "r = SUB(%s, INT64_C(%" PRId64 ")); SETF(r);\n", rn, imm); break;
+        case CMP_REG:  fprintf(out, "r = SUB(%s, %s); SETF(r);\n", rn, rm); break;
+        case ANDS_REG: fprintf(out, "%s = r = %s & %s; SETF(r);\n", rd, rn, rm); break;
+        case EOR_REG:  fprintf(out, "%s = %s ^ %s;\n", rd, rn, rm); break;
+        case ORR_REG:  fprintf(out, "%s = %s | %s;\n", rd, rn, rm); break;
+        case ADD_IMM:  fprintf(out, "%s = ADD(%s, INT64_C(%" PRId64 "));\n", rd, rn, imm); break;
+        case ADD_REG:  fprintf(out, "%s = ADD(%s, %s);\n", rd, rn, rm); break;
+        case MUL:      fprintf(out, "%s = MUL(%s, %s);\n", rd, rn, rm); break;
+        case MOVZ:     fprintf(out, "%s = INT64_C(%" PRId64 ");\n", rd, imm); break;
+        case LSL_IMM:  fprintf(out, "%s = (int64_t)((uint64_t)%s << %" PRId64 ");\n", rd, rn, imm); break;
+        case LSR_IMM:  fprintf(out, "%s = (int64_t)((uint64_t)%s >> %" PRId64 ");\n", rd, rn, imm); break;
+
+        case STUR:
+            fprintf(out, "a = (uint64_t)ADD(%s, INT64_C(%" PRId64 ")); wr32(a, (uint32_t)%s); wr32(a + 4, (uint32_t)((uint64_t)%s >> 32));\n",
+                    rn, imm, rt, rt);
+            break;
+        case STURB:
+            fprintf(out, "a = (uint64_t)ADD(%s, INT64_C(%" PRId64 ")); w = rd32(a); "
+                         "wr32(a & ~UINT64_C(3), (w & ~(0xFFu << (a & 3) * 8)) | (uint32_t)(%s & 0xFF) << (a & 3) * 8);\n",
+                    rn, imm, rt);
+            break;
+        case STURH:
+            fprintf(out, "a = (uint64_t)ADD(%s, INT64_C(%" PRId64 ")); w = rd32(a); "
+                         "wr32(a & ~UINT64_C(3), (w & ~(0xFFFFu << (a & 2) * 8)) | (uint32_t)(%s & 0xFFFF) << (a & 2) * 8);\n",
+                    rn, imm, rt);
+            break;
+        case LDUR:
+            fprintf(out, "a = (uint64_t)ADD(%s, INT64_C(%" PRId64 ")); %s = (int64_t)((uint64_t)rd32(a + 4) << 32 | rd32(a));\n",
+                    rn, imm, rd);
+            break;
+        case LDURB:
+            fprintf(out, "a = (uint64_t)ADD(%s, INT64_C(%" PRId64 ")); %s = rd32(a & ~UINT64_C(3)) >> (a & 3) * 8 & 0xFF;\n",
+                    rn, imm, rd);
+            break;
+        case LDURH:
+            fprintf(out, "a = (uint64_t)ADD(%s, INT64_C(%" PRId64 ")); %s = rd32(a & ~UINT64_C(3)) >> (a & 2) * 8 & 0xFFFF;\n",
+                    rn, imm, rd);
+            break;
+
+        // Exclusive monitor as in execute.c: ex is the address, 1 when clear
+        case LDXR:
+            fprintf(out, "a = (uint64_t)%s; ex = a; exv = rd64(a); %s = (int64_t)exv;\n", rn, rd);
+            break;
+        case STXR:
+            fprintf(out, "a = (uint64_t)%s; if (ex == a && rd64(a) == exv) { wr64(a, (uint64_t)%s); %s = 0; } else %s = 1; ex = 1;\n",
+                    rn, rt, dst(d->rm), dst(d->rm));
+            break;
+        case LDADD:
+            fprintf(out, "a = (uint64_t)%s; r = (int64_t)rd64(a); wr64(a, (uint64_t)ADD(r, %s)); %s = r;\n", rn, rm, rd);
+            break;
+        case SWP:
+            fprintf(out, "a = (uint64_t)%s; r = (int64_t)rd64(a); wr64(a, (uint64_t)%s); %s = r;\n", rn, rm, rd);
+            break;
+        case CAS:
+            fprintf(out, "a = (uint64_t)%s; r = (int64_t)rd64(a); if (r == %s) wr64(a, (uint64_t)%s); %s = r;\n",
+                    rn, rm, rt, dst(d->rm));
+            break;
+
+        // Counters: one cycle per instruction. The block was counted on
+        // entry, take back the instructions from this one to its end.
+        case MRS:
+            if (imm == SYSREG_CNTFRQ_EL0)
+                fprintf(out, "%s = INT64_C(%d);\n", rd, GUEST_CLOCK_HZ);
+            else if (imm == SYSREG_CNTVCT_EL0 || imm == SYSREG_PMCCNTR_EL0 || imm == SYSREG_PMEVCNTR0_EL0)
+                fprintf(out, "%s = (int64_t)(icount - %d);\n", rd, cfg->first[b + 1] - i);
+            else
+                fprintf(out, "%s = 0;\n", rd);
+            break;
+
+        case HLT:
+            fprintf(out, "pc = UINT64_C(0x%" PRIx64 "); goto halt;\n", pc + 4);
+            break;
+        case BR:
+            fprintf(out, "target = (uint64_t)%s; goto dispatch;\n", rn);
+            break;
+        case B:
+            emit_jump(out, cfg->succ[2 * b], pc + imm);
+            fprintf(out, "\n");
+            break;
+        case BEQ: case BNE: case BGT: case BLT: case BGE: case BLE:
+            fprintf(out, "if (%s) ", condition(type));
+            emit_jump(out, cfg->succ[2 * b], pc + imm);
+            fprintf(out, "\n");
+            break;
+        case CBZ: case CBNZ:
+            fprintf(out, "if (%s %s 0) ", rt, type == CBZ ? "==" : "!=");
+            emit_jump(out, cfg->succ[2 * b], pc + imm);
+            fprintf(out, "\n");
+            break;
+
+        default:
+            // Unknown words do nothing but count, like in execute_instruction()
+            fprintf(out, ";\n");
+            break;
+    }
+}
+
+static void emit_main(FILE* out, const Cfg* cfg) {
+    int indirect = 0;
+    uint8_t* referenced = calloc(cfg->nblocks + 1, 1);
+    for (int b = 0; b < cfg->nblocks; b++) {
+        if (cfg->succ[2 * b] != CFG_NONE) referenced[cfg->succ[2 * b]] = 1;
+        if (cfg->flags[b] & CFG_INDIRECT) indirect = 1;
+    }
+
+    fprintf(out, "int main(void) {\n    int64_t ");
+    for (int k = 0; k < 31; k++)
+        fprintf(out, "x%d = 0, ", k);
+    fprintf(out, "x31 = 0;\n");
+    fprintf(out,
+        "    int64_t r;\n"
+        "    uint64_t a, pc, target = 0, ex = 1, exv = 0;\n"
+        "    uint32_t w, icount = 0;\n"
+        "    int n = 0, z = 0, status = 0;\n"
+        "    (void)r; (void)a; (void)w; (void)target; (void)ex; (void)exv;\n\n"
+        "    memcpy(&text[UINT64_C(0x%" PRIx64 ") - UINT64_C(0x%" PRIx64 ")], program_text, sizeof(uint32_t) * %d);\n",
+        cfg->base, cfg->base & ~(uint64_t)MEM_PAGE_MASK, cfg->ninsns);
+
+    for (int b = 0; b < cfg->nblocks; b++) {
+        int first = cfg->first[b], end = cfg->first[b + 1];
+        const DecodedInstruction* last = cfg_insn(end - 1);
+        if (referenced[b] || indirect)
+            fprintf(out, "\nL%d:\n", b);
+        else
+            fprintf(out, "\n    // block %d\n", b);
+        fprintf(out, "    icount += %d;\n", end - first);
+        for (int i = first; i < end; i++) {
+            if (indirect && i > first) fprintf(out, "I%d:\n", i);
+            emit_insn(out, cfg, b, i);
+        }
+
+        // Falling off the end of the program
+        if (b == cfg->nblocks - 1 && last->type != B && last->type != BR && last->type != HLT)
+            fprintf(out, "    pc = UINT64_C(0x%" PRIx64 "); goto out;\n", cfg->base + 4 * (uint64_t)end);
+    }
+    if (cfg->nblocks == 0)
+        fprintf(out, "    pc = UINT64_C(0x%" PRIx64 "); goto out;\n", cfg->base);
+
+    if (indirect) {
+        fprintf(out, "\ndispatch:\n    switch (target) {\n");
+        for (int i = 0; i < cfg->ninsns; i++) {
+            int b = cfg->block_of[i];
+            fprintf(out, "    case UINT64_C(0x%" PRIx64 "): ", cfg->base + 4 * (uint64_t)i);
+            if (i == cfg->first[b])
+                fprintf(out, "goto L%d;\n", b);
+            else
+                fprintf(out, "icount += %d; goto I%d;\n", cfg->first[b + 1] - i, i);
+        }
+        fprintf(out, "    }\n    pc = target;\n    goto out;\n");
+    }
+
+    fprintf(out,
+        "\nout: __attribute__((unused));\n"
+        "    fprintf(stderr, \"Error: left the translated program at 0x%%\" PRIx64 \"\\n\", pc);\n"
+        "    status = 1;\n"
+        "halt:\n"
+        "    {\n"
+        "        int64_t regs[32] = {");
+    for (int k = 0; k < 31; k++)
+        fprintf(out, "x%d, ", k);
+    fprintf(out,
+        "x31};\n"
+        "        rdump(icount, pc, regs, n, z);\n"
+        "    }\n"
+        "    return status;\n"
+        "}\n");
+    free(referenced);
+}
+
+int translate_main(const char* program_filename, const char* output_filename) {
+    const Cfg* cfg = &PROGRAM_CFG;
+
+    VERBOSE = FALSE;
+    // Loading the program builds its CFG
+    initialize((char**)&program_filename, 1);
+
+    FILE* out = fopen(output_filename, "w");
+    if (out == NULL) {
+        printf("Error: Can't open output file %s\n", output_filename);
+        return 2;
+    }
+
+    Window windows[3] = {
+        window("text", MEM_TEXT_START, MEM_TEXT_SIZE),
+        window("data", MEM_DATA_START, MEM_DATA_SIZE),
+        window("stack", MEM_STACK_START, MEM_STACK_SIZE),
+    };
+    fprintf(out, "// Translated from %s, %d instructions in %d basic blocks\n\n",
+            program_filename, cfg->ninsns, cfg->nblocks);
+    emit_prelude(out, windows, 3);
+    emit_text(out, cfg);
+    emit_main(out, cfg);
+    fclose(out);
+
+    printf("%s: %d instructions, %d basic blocks -> %s\n",
+           program_filename, cfg->ninsns, cfg->nblocks, output_filename);
+    return 0;
+}
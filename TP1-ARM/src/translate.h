@@ -0,0 +1,9 @@
+#ifndef TRANSLATE_H
+#define TRANSLATE_H
+
+// Ahead-of-time translation of a program into a standalone C file
+// (--translate). The generated program prints the same register dump
+// as "go; rdump" in the shell.
+int translate_main(const char* program_filename, const char* output_filename);
+
+#endif
@@ -2,6 +2,12 @@
 #define UTILS_H
 
 #include "decode.h"
+#include "shell.h"
+#include <stdio.h>
+
+// Instruction tracing is only printed when the shell runs in verbose mode
+// (the default). Batch tools like the co-simulator turn it off.
+#define trace(...) do { if (VERBOSE) printf(__VA_ARGS__); } while (0)
 
 void show_instruction(DecodedInstruction d);
 void show_instruction_in_binary(DecodedInstruction d);